@@ -17,6 +17,8 @@
 #include <errno.h>
 #include <pthread.h>
 
+#include "bench.h"
+
 #define ITERATIONS 1000000
 /* Number of threads touching the same memory region atomically */
 #define WARMUP_ITERATIONS ITERATIONS/1000
@@ -30,13 +32,8 @@ typedef uint32_t u32;
 static volatile u64 shared_counter_llsc = 0;
 static volatile u64 shared_counter_lse = 0;
 
-/* Barrier to synchronize thread start */
-static pthread_barrier_t start_barrier;
-
 /* Thread-local data */
 struct thread_data {
-	int thread_id;
-	int cpu;
 	double *latencies_llsc;
 	double *latencies_lse;
 };
@@ -69,72 +66,20 @@ static inline void __percpu_add_case_64_lse(void *ptr, unsigned long val)
 		: "memory");
 }
 
-static inline uint64_t get_time_ns(void)
-{
-	struct timespec ts;
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
-}
-
-static int compare_double(const void *a, const void *b)
-{
-	double val_a = *(const double *)a;
-	double val_b = *(const double *)b;
-	if (val_a < val_b)
-		return -1;
-	if (val_a > val_b)
-		return 1;
-	return 0;
-}
-
-static double calculate_percentile(double *sorted_array, uint64_t count,
-				      double percentile)
-{
-	uint64_t index = (uint64_t)((percentile / 100.0) * (count - 1));
-	return sorted_array[index];
-}
-
-static int get_num_cpus(void)
-{
-	return sysconf(_SC_NPROCESSORS_ONLN);
-}
-
-static int set_cpu_affinity(int cpu)
-{
-	cpu_set_t mask;
-	CPU_ZERO(&mask);
-	CPU_SET(cpu, &mask);
-
-	if (sched_setaffinity(0, sizeof(mask), &mask) == -1) {
-		perror("sched_setaffinity");
-		return -1;
-	}
-	return 0;
-}
-
-static void *thread_benchmark(void *arg)
+/* Workers are pinned and released together by the pool */
+static void thread_benchmark(struct bench_worker *w)
 {
-	struct thread_data *data = (struct thread_data *)arg;
+	struct thread_data *data = w->priv;
 	uint64_t start, end;
 	uint64_t i, z;
 
-	/* Set CPU affinity */
-	if (set_cpu_affinity(data->cpu) != 0) {
-		fprintf(stderr, "Thread %d: Failed to set affinity to CPU %d\n",
-			data->thread_id, data->cpu);
-		return NULL;
-	}
-
-	/* Wait for all threads to be ready */
-	pthread_barrier_wait(&start_barrier);
-
 	/* Warmup - LL/SC */
 	for (i = 0; i < WARMUP_ITERATIONS; i++) {
 		__percpu_add_case_64_llsc((void *)&shared_counter_llsc, 1);
 	}
 
 	/* Wait for all threads to finish warmup */
-	pthread_barrier_wait(&start_barrier);
+	bench_pool_sync(w);
 
 	/* Warmup - LSE */
 	for (i = 0; i < WARMUP_ITERATIONS; i++) {
@@ -142,7 +87,7 @@ static void *thread_benchmark(void *arg)
 	}
 
 	/* Wait for all threads to finish warmup */
-	pthread_barrier_wait(&start_barrier);
+	bench_pool_sync(w);
 
 	/* Allocate latency arrays */
 	data->latencies_llsc = malloc(PERCENTILE_ITERATIONS * sizeof(double));
@@ -150,88 +95,100 @@ static void *thread_benchmark(void *arg)
 
 	if (!data->latencies_llsc || !data->latencies_lse) {
 		fprintf(stderr, "Thread %d: Failed to allocate memory\n",
-			data->thread_id);
-		return NULL;
+			w->id);
+		exit(1);
 	}
 
 	/* Measure LL/SC latencies under parallel access */
 	for (i = 0; i < PERCENTILE_ITERATIONS; i++) {
-		start = get_time_ns();
+		start = bench_cycles_serial();
 		for (z = 0; z < SUB_ITERATIONS; z++)
 			__percpu_add_case_64_llsc((void *)&shared_counter_llsc, 1);
-		end = get_time_ns();
-		data->latencies_llsc[i] = (double)(end - start) / SUB_ITERATIONS;
+		end = bench_cycles_serial();
+		data->latencies_llsc[i] = bench_cycles_to_ns(end - start) / SUB_ITERATIONS;
 	}
 
 	/* Wait for all threads to finish LL/SC measurements */
-	pthread_barrier_wait(&start_barrier);
+	bench_pool_sync(w);
 
 	/* Measure LSE latencies under parallel access */
 	for (i = 0; i < PERCENTILE_ITERATIONS; i++) {
-		start = get_time_ns();
+		start = bench_cycles_serial();
 		for (z = 0; z < SUB_ITERATIONS; z++)
 			__percpu_add_case_64_lse((void *)&shared_counter_lse, 1);
-		end = get_time_ns();
-		data->latencies_lse[i] = (double)(end - start) / SUB_ITERATIONS;
+		end = bench_cycles_serial();
+		data->latencies_lse[i] = bench_cycles_to_ns(end - start) / SUB_ITERATIONS;
 	}
+}
+
+static void print_result(const char *test, int cpu, int threads,
+			 double *latencies, enum bench_format fmt)
+{
+	struct bench_result r;
 
-	return NULL;
+	bench_result_init(&r, "parallel_atomic_bench", test);
+	r.cpu = cpu;
+	r.threads = threads;
+	bench_result_from_sorted(&r, latencies, PERCENTILE_ITERATIONS);
+	bench_result_print(stdout, fmt, &r);
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
-	int num_cpus;
-	int i;
-	pthread_t *threads;
+	enum bench_format fmt = BENCH_FMT_TEXT;
 	struct thread_data *thread_data_array;
+	struct bench_pool *pool;
+	int num_cpus, *cpus;
+	int i, arg;
 
-	printf("ARM64 Parallel Atomic Add Benchmark\n");
-	printf("====================================\n");
-
-	printf("Running parallel atomic operations with contention...\n");
-	printf("Percentile measurements (%d iterations per thread)...\n",
-	       PERCENTILE_ITERATIONS);
+	while ((arg = getopt(argc, argv, "f:")) != -1) {
+		if (arg != 'f' || bench_parse_format(optarg) < 0) {
+			fprintf(stderr, "usage: %s [-f text|csv|json]\n", argv[0]);
+			return 1;
+		}
+		fmt = bench_parse_format(optarg);
+	}
 
-	num_cpus = get_num_cpus();
+	num_cpus = bench_cpu_list(&cpus);
 	if (num_cpus <= 0) {
 		fprintf(stderr, "Failed to get number of CPUs\n");
 		return 1;
 	}
 
-	printf("Detected %d CPUs, creating %d threads\n", num_cpus, num_cpus);
+	if (fmt == BENCH_FMT_TEXT) {
+		printf("ARM64 Parallel Atomic Add Benchmark\n");
+		printf("====================================\n");
 
-	/* Allocate thread structures */
-	threads = malloc(num_cpus * sizeof(pthread_t));
-	thread_data_array = malloc(num_cpus * sizeof(struct thread_data));
+		printf("Running parallel atomic operations with contention...\n");
+		printf("Percentile measurements (%d iterations per thread)...\n",
+		       PERCENTILE_ITERATIONS);
 
-	if (!threads || !thread_data_array) {
+		printf("Detected %d CPUs, creating %d threads\n", num_cpus, num_cpus);
+	}
+
+	/* Allocate thread structures */
+	thread_data_array = calloc(num_cpus, sizeof(struct thread_data));
+	if (!thread_data_array) {
 		fprintf(stderr, "Failed to allocate memory\n");
-		free(threads);
-		free(thread_data_array);
 		return 1;
 	}
 
-	/* Initialize barrier (need 4 sync points: 2 warmups, 2 measurements) */
-	pthread_barrier_init(&start_barrier, NULL, num_cpus);
-
-	/* Create threads, one per CPU */
-	for (i = 0; i < num_cpus; i++) {
-		thread_data_array[i].thread_id = i;
-		thread_data_array[i].cpu = i;
-		thread_data_array[i].latencies_llsc = NULL;
-		thread_data_array[i].latencies_lse = NULL;
-
-		if (pthread_create(&threads[i], NULL, thread_benchmark,
-				   &thread_data_array[i]) != 0) {
-			fprintf(stderr, "Failed to create thread %d\n", i);
-			return 1;
-		}
+	/*
+	 * One pinned thread per CPU. The pool releases them together, then they
+	 * sync among themselves between the 2 warmups and the 2 measurements.
+	 */
+	pool = bench_pool_create(num_cpus, cpus, num_cpus, thread_benchmark, NULL);
+	if (!pool) {
+		fprintf(stderr, "Failed to create threads\n");
+		return 1;
 	}
+	for (i = 0; i < num_cpus; i++)
+		pool->workers[i].priv = &thread_data_array[i];
 
-	/* Wait for all threads to complete */
-	for (i = 0; i < num_cpus; i++) {
-		pthread_join(threads[i], NULL);
-	}
+	bench_pool_start(pool);
+	bench_pool_join(pool);
+
+	bench_result_header(stdout, fmt);
 
 	/* Print results for each thread */
 	for (i = 0; i < num_cpus; i++) {
@@ -241,52 +198,61 @@ int main(void)
 			continue;
 
 		/* Sort the latencies */
-		qsort(data->latencies_llsc, PERCENTILE_ITERATIONS,
-		      sizeof(double), compare_double);
-		qsort(data->latencies_lse, PERCENTILE_ITERATIONS,
-		      sizeof(double), compare_double);
+		bench_sort(data->latencies_llsc, PERCENTILE_ITERATIONS);
+		bench_sort(data->latencies_lse, PERCENTILE_ITERATIONS);
+
+		if (fmt != BENCH_FMT_TEXT) {
+			print_result("LL/SC", cpus[i], num_cpus,
+				     data->latencies_llsc, fmt);
+			print_result("LSE", cpus[i], num_cpus,
+				     data->latencies_lse, fmt);
+			goto next;
+		}
 
 		/* Calculate percentiles */
 		printf("\n Thread %d (CPU %d) - Latency Percentiles:\n",
-		       data->thread_id, data->cpu);
+		       i, cpus[i]);
 		printf("====================\n");
 		printf("LL/SC: ");
 		printf("  p50: %07.2f ns\t",
-		       calculate_percentile(data->latencies_llsc,
-					    PERCENTILE_ITERATIONS, 50));
+		       bench_percentile(data->latencies_llsc,
+					PERCENTILE_ITERATIONS, 50));
 		printf("  p95: %07.2f ns\t",
-		       calculate_percentile(data->latencies_llsc,
-					    PERCENTILE_ITERATIONS, 95));
+		       bench_percentile(data->latencies_llsc,
+					PERCENTILE_ITERATIONS, 95));
 		printf("  p99: %07.2f ns\n",
-		       calculate_percentile(data->latencies_llsc,
-					    PERCENTILE_ITERATIONS, 99));
+		       bench_percentile(data->latencies_llsc,
+					PERCENTILE_ITERATIONS, 99));
 
 		printf("LSE  : ");
 		printf("  p50: %07.2f ns\t",
-		       calculate_percentile(data->latencies_lse,
-					    PERCENTILE_ITERATIONS, 50));
+		       bench_percentile(data->latencies_lse,
+					PERCENTILE_ITERATIONS, 50));
 		printf("  p95: %07.2f ns\t",
-		       calculate_percentile(data->latencies_lse,
-					    PERCENTILE_ITERATIONS, 95));
+		       bench_percentile(data->latencies_lse,
+					PERCENTILE_ITERATIONS, 95));
 		printf("  p99: %07.2f ns\n",
-		       calculate_percentile(data->latencies_lse,
-					    PERCENTILE_ITERATIONS, 99));
-
+		       bench_percentile(data->latencies_lse,
+					PERCENTILE_ITERATIONS, 99));
+next:
 		free(data->latencies_llsc);
 		free(data->latencies_lse);
 	}
 
-	printf("\nShared counters final values:\n");
-	printf("LL/SC counter: %lu\n", shared_counter_llsc);
-	printf("LSE counter:   %lu\n", shared_counter_lse);
-	printf("Expected:      %lu\n",
-	       (uint64_t)(WARMUP_ITERATIONS + PERCENTILE_ITERATIONS * SUB_ITERATIONS) * num_cpus);
+	if (fmt == BENCH_FMT_TEXT) {
+		printf("\nShared counters final values:\n");
+		printf("LL/SC counter: %lu\n", shared_counter_llsc);
+		printf("LSE counter:   %lu\n", shared_counter_lse);
+		printf("Expected:      %lu\n",
+		       (uint64_t)(WARMUP_ITERATIONS + PERCENTILE_ITERATIONS * SUB_ITERATIONS) * num_cpus);
+	}
 
 	/* Cleanup */
-	pthread_barrier_destroy(&start_barrier);
-	free(threads);
+	bench_pool_destroy(pool);
 	free(thread_data_array);
+	free(cpus);
 
-	printf("\n=== Benchmark Complete ===\n");
+	if (fmt == BENCH_FMT_TEXT)
+		printf("\n=== Benchmark Complete ===\n");
 	return 0;
 }
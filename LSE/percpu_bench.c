@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "percpu_bench_lib.h"
 
@@ -82,21 +83,22 @@ void run_core_benchmark(u64 *counter, double *latencies, void (*func)(void *, un
 	uint64_t i, z, d;
 
 	for (i = 0; i < PERCENTILE_ITERATIONS; i++) {
-		start = get_time_ns();
+		start = bench_cycles_serial();
 		for (z = 0; z < SUB_ITERATIONS; z++) {
 			func(counter, 1);
 			for (d = 0; d < duty; d++)
 				__asm__ volatile ("nop");
 		}
-		end = get_time_ns();
-		latencies[i] = (double)(end - start) / SUB_ITERATIONS;
+		end = bench_cycles_serial();
+		latencies[i] = bench_cycles_to_ns(end - start) / SUB_ITERATIONS;
 	}
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
+	enum bench_format fmt = BENCH_FMT_TEXT;
 	int num_cpus;
-	int i, b;
+	int i, b, arg;
 
 	struct benchmark benchmarks[] = {
 		{
@@ -270,18 +272,34 @@ int main(void)
 		},
 	};
 
-	printf("ARM64 Per-CPU Atomic Add Benchmark\n");
-	printf("===================================\n");
-
-	printf("Running percentile measurements (%d iterations)...\n",
-	       PERCENTILE_ITERATIONS);
+	while ((arg = getopt(argc, argv, "f:")) != -1) {
+		if (arg != 'f' || bench_parse_format(optarg) < 0) {
+			fprintf(stderr, "usage: %s [-f text|csv|json]\n", argv[0]);
+			return 1;
+		}
+		fmt = bench_parse_format(optarg);
+	}
 
-	num_cpus = get_num_cpus();
+	num_cpus = bench_num_cpus();
 	if (num_cpus <= 0) {
 		fprintf(stderr, "Failed to get number of CPUs\n");
 		return 1;
 	}
 
+	if (fmt != BENCH_FMT_TEXT) {
+		bench_result_header(stdout, fmt);
+		for (i = 0; i < num_cpus; i++)
+			for (b = 0; b < (sizeof(benchmarks) / sizeof(benchmarks[0])); ++b)
+				run_benchmark_on_cpu(i, benchmarks + b, fmt);
+		return 0;
+	}
+
+	printf("ARM64 Per-CPU Atomic Add Benchmark\n");
+	printf("===================================\n");
+
+	printf("Running percentile measurements (%d iterations)...\n",
+	       PERCENTILE_ITERATIONS);
+
 	printf("Detected %d CPUs\n", num_cpus);
 
 	/* Run benchmark on each CPU */
@@ -290,7 +308,7 @@ int main(void)
 		printf("====================\n");
 
 		for (b = 0; b < (sizeof(benchmarks) / sizeof(benchmarks[0])); ++b)
-			run_benchmark_on_cpu(i, benchmarks + b);
+			run_benchmark_on_cpu(i, benchmarks + b, fmt);
 	}
 
 	printf("\n=== Benchmark Complete ===\n");
@@ -17,36 +17,6 @@
 
 #include "percpu_bench_lib.h"
 
-uint64_t get_time_ns(void)
-{
-	struct timespec ts;
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
-}
-
-int compare_double(const void *a, const void *b)
-{
-	double val_a = *(const double *)a;
-	double val_b = *(const double *)b;
-	if (val_a < val_b)
-		return -1;
-	if (val_a > val_b)
-		return 1;
-	return 0;
-}
-
-double calculate_percentile(double *sorted_array, uint64_t count,
-			      double percentile)
-{
-	uint64_t index = (uint64_t)((percentile / 100.0) * (count - 1));
-	return sorted_array[index];
-}
-
-int get_num_cpus(void)
-{
-	return sysconf(_SC_NPROCESSORS_ONLN);
-}
-
 int set_cpu_antiaffinity(int cpu)
 {
 	cpu_set_t mask;
@@ -64,19 +34,6 @@ int set_cpu_antiaffinity(int cpu)
 	return 0;
 }
 
-int set_cpu_affinity(int cpu)
-{
-	cpu_set_t mask;
-	CPU_ZERO(&mask);
-	CPU_SET(cpu, &mask);
-
-	if (sched_setaffinity(0, sizeof(mask), &mask) == -1) {
-		perror("sched_setaffinity");
-		return -1;
-	}
-	return 0;
-}
-
 static void *contender_main(void *arg_uncast)
 {
 	struct contender *arg = arg_uncast;
@@ -92,7 +49,26 @@ static void *contender_main(void *arg_uncast)
 	return NULL;
 }
 
-void run_benchmark_on_cpu(int cpu, struct benchmark *b)
+/* Benchmark names are padded with spaces for the text output */
+static void print_result(struct benchmark *b, int cpu, double *latencies,
+			 enum bench_format fmt)
+{
+	struct bench_result r;
+	char test[64];
+	int len = strlen(b->name);
+
+	while (len && b->name[len - 1] == ' ')
+		len--;
+	snprintf(test, sizeof(test), "%.*s c=%ld d=%ld", len, b->name,
+		 b->contention, b->duty);
+
+	bench_result_init(&r, "percpu_bench", test);
+	r.cpu = cpu;
+	bench_result_from_sorted(&r, latencies, PERCENTILE_ITERATIONS);
+	bench_result_print(stdout, fmt, &r);
+}
+
+void run_benchmark_on_cpu(int cpu, struct benchmark *b, enum bench_format fmt)
 {
 	u64 counters[2048];
 	u64 *counter = counters + 1024;
@@ -114,7 +90,7 @@ void run_benchmark_on_cpu(int cpu, struct benchmark *b)
 	}
 
 	/* Set CPU affinity */
-	if (set_cpu_affinity(cpu) != 0) {
+	if (bench_pin_cpu(cpu) != 0) {
 		fprintf(stderr, "Failed to set affinity to CPU %d\n", cpu);
 		return;
 	}
@@ -137,17 +113,20 @@ void run_benchmark_on_cpu(int cpu, struct benchmark *b)
 	run_core_benchmark(counter, latencies, b->func, b->duty);
 
 	/* Sort the latencies */
-	qsort(latencies, PERCENTILE_ITERATIONS, sizeof(double),
-	      compare_double);
-
-	/* Calculate percentiles */
-	printf("%s (c %16ld, d %16ld): ", b->name, b->contention, b->duty);
-	printf("  p50: %06.2f ns\t",
-	       calculate_percentile(latencies, PERCENTILE_ITERATIONS, 50));
-	printf("  p95: %06.2f ns\t",
-	       calculate_percentile(latencies, PERCENTILE_ITERATIONS, 95));
-	printf("  p99: %06.2f ns\n",
-	       calculate_percentile(latencies, PERCENTILE_ITERATIONS, 99));
+	bench_sort(latencies, PERCENTILE_ITERATIONS);
+
+	if (fmt != BENCH_FMT_TEXT) {
+		print_result(b, cpu, latencies, fmt);
+	} else {
+		/* Calculate percentiles */
+		printf("%s (c %16ld, d %16ld): ", b->name, b->contention, b->duty);
+		printf("  p50: %06.2f ns\t",
+		       bench_percentile(latencies, PERCENTILE_ITERATIONS, 50));
+		printf("  p95: %06.2f ns\t",
+		       bench_percentile(latencies, PERCENTILE_ITERATIONS, 95));
+		printf("  p99: %06.2f ns\n",
+		       bench_percentile(latencies, PERCENTILE_ITERATIONS, 99));
+	}
 
 	free(latencies);
 
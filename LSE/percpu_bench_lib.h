@@ -9,6 +9,8 @@
 #include <stdint.h>
 #include <stdatomic.h>
 
+#include "bench.h"
+
 #define ITERATIONS (1000UL * 1000 * 1000)
 #define WARMUP_ITERATIONS ITERATIONS/1000
 #define PERCENTILE_ITERATIONS 100
@@ -39,11 +41,6 @@ extern uint64_t loop, tmp;
 void run_core_benchmark(u64 *counter, double *latencies, void (*func)(void *, unsigned long), long duty);
 
 /* Helper function declarations */
-uint64_t get_time_ns(void);
-int compare_double(const void *a, const void *b);
-double calculate_percentile(double *sorted_array, uint64_t count, double percentile);
-int get_num_cpus(void);
-int set_cpu_affinity(int cpu);
-void run_benchmark_on_cpu(int cpu, struct benchmark *b);
+void run_benchmark_on_cpu(int cpu, struct benchmark *b, enum bench_format fmt);
 
 #endif /* PERCPU_BENCH_LIB_H */
@@ -4,6 +4,11 @@
  * This program creates cgroup hierarchies and performs memory operations
  * that will indirectly exercise the page_counter_uncharge() function in
  * the kernel when memory is freed.
+ *
+ * Everything that is not the hierarchy can be changed from the command
+ * line (chunk size, allocator backend, how memory is given back), so the
+ * page_counter cost can be told apart from the syscall and allocator cost.
+ * The release (madvise & co) and free phases are timed separately.
  */
 
 #define _GNU_SOURCE
@@ -15,40 +20,118 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
 #include <time.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+#include "bench.h"
 
 /* Test configuration */
-#define MAX_HIERARCHY_DEPTH 8
-#define MAX_PATH_LEN 256
+#define MAX_HIERARCHY_DEPTH 32
+#define DEFAULT_DEPTH 8
+#define MAX_DEPTHS MAX_HIERARCHY_DEPTH
+#define MAX_PATH_LEN 512
 #define MEMORY_SIZE (5 * 1024 * 1024 * 1024UL) /* 5G per test */
 #define ALLOCATION_SIZE 4096UL			 /* 4KB allocations */
-#define NUM_ALLOCATIONS (MEMORY_SIZE / ALLOCATION_SIZE)
 #define NUM_THREADS 70
 #define STRESS_ITERATIONS 1000
+#define STRESS_CHUNKS 10
+/* Stat readers run alone this long before the workload starts */
+#define READER_IDLE_MS 1000
+/* Pressure mode defaults, and how often its counters are sampled */
+#define PRESSURE_SECS 10
+#define PRESSURE_SAMPLE_MS 500
+#define PRESSURE_GRACE_MS 5000
+/* process_madvise() takes at most UIO_MAXIOV ranges per call */
+#define MADVISE_BATCH 1024
 
 /* Cgroup paths */
 #define CGROUP_V2_MOUNT "/sys/fs/cgroup"
 #define TEST_CGROUP_BASE "page_counter_test"
 
+enum backend {
+	BACKEND_MALLOC,		/* one page aligned malloc per chunk */
+	BACKEND_MMAP,		/* one anonymous mapping, chunks are slices */
+	BACKEND_HUGETLB,	/* same with MAP_HUGETLB */
+	BACKEND_THP,		/* same, 2M aligned and MADV_HUGEPAGE */
+};
+
+static const char *backend_names[] = { "malloc", "mmap", "hugetlb", "thp" };
+
+enum release {
+	RELEASE_DONTNEED,	/* MADV_DONTNEED per chunk */
+	RELEASE_DONTNEED_RANGE,	/* one MADV_DONTNEED over the mapping */
+	RELEASE_FREE,		/* MADV_FREE per chunk, uncharged on reclaim */
+	RELEASE_MUNMAP,		/* munmap() per chunk */
+	RELEASE_PROCESS_MADVISE, /* MADV_DONTNEED, MADVISE_BATCH chunks per call */
+};
+
+static const char *release_names[] = {
+	"dontneed", "dontneed-range", "free", "munmap", "process_madvise",
+};
+
 struct test_config {
 	char base_path[MAX_PATH_LEN - 20];
 	int hierarchy_depth;
 	int num_threads;
+	int depths[MAX_DEPTHS];
+	int nr_depths;
+	int fanout;		/* sibling leaves in the parallel test */
+	int curve;		/* run the depth/contention curve instead */
+	int read_rate;		/* stat reader rounds per second, 0 for none */
+	const char *limit;	/* "memory.high" or "memory.max", or NULL */
+	int limit_pct;		/* of the working set */
+	int populate;		/* prefault mappings instead of first touch */
+	int pressure_secs;
+	enum bench_format format;
+	int iterations;
+	size_t memory_size;
+	size_t chunk_size;
+	enum backend backend;
+	enum release release;
+};
+
+/* One hierarchy test, times in ms */
+struct phase_result {
+	int depth;
+	double charge_ms;	/* allocation and first touch */
+	long faults;		/* minor faults while charging */
+	long long charged;	/* anon pages charged, from memory.stat */
+	long long current;	/* memory.current delta, bytes */
+	long long uncharged;	/* memory.current drop on release, bytes */
+	double release_ms;
+	double free_ms;
+	unsigned long failed;	/* release calls that returned an error */
 };
 
 struct perf_result {
-	double single_level_ms;
-	double shallow_hierarchy_ms;
-	double deep_hierarchy_ms;
-	double stress_test_ms;
+	struct phase_result hierarchy[MAX_DEPTHS];
 	double parallel_test_ms;
 };
 
+/* A set of chunks, and the mapping they live in for the mmap backends */
+struct region {
+	void **chunks;
+	int nr_chunks;
+	size_t chunk_size;
+	void *map;
+	size_t map_size;
+	unsigned long failed;
+};
+
 static struct test_config config;
 static struct perf_result results;
+/* The curve runs hundreds of hierarchies, don't log every mkdir */
+static int verbose = 1;
 
 /*
  * Utility functions
@@ -58,6 +141,14 @@ static double timespec_to_ms(struct timespec *ts)
 	return ts->tv_sec * 1000.0 + ts->tv_nsec / 1000000.0;
 }
 
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_to_ms(&ts);
+}
+
 static int write_to_file(const char *path, const char *content)
 {
 	FILE *f = fopen(path, "w");
@@ -76,16 +167,104 @@ static int write_to_file(const char *path, const char *content)
 	return 0;
 }
 
+/* The value of key in a "key value" file, or -1 */
+static long long read_key(const char *cgroup_path, const char *file,
+			  const char *key)
+{
+	char path[MAX_PATH_LEN + 32], name[64];
+	long long value, ret = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", cgroup_path, file);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fscanf(f, "%63s %lld", name, &value) == 2)
+		if (!strcmp(name, key)) {
+			ret = value;
+			break;
+		}
+	fclose(f);
+
+	return ret;
+}
+
+/* A single value file (memory.current, ...), or -1 */
+static long long read_value(const char *cgroup_path, const char *file)
+{
+	char path[MAX_PATH_LEN + 32];
+	long long value = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", cgroup_path, file);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%lld", &value) != 1)
+		value = -1;
+	fclose(f);
+
+	return value;
+}
+
+static long minor_faults(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt;
+}
+
+/* 4096, 64K, 2M, 5G */
+static size_t parse_size(const char *str)
+{
+	char *end;
+	size_t size = strtoul(str, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/* fallthrough */
+	case 'm': case 'M':
+		size <<= 10;
+		/* fallthrough */
+	case 'k': case 'K':
+		size <<= 10;
+	}
+
+	return size;
+}
+
+static size_t huge_page_size(void)
+{
+	size_t size = 2 * 1024 * 1024;
+	char line[128];
+	FILE *f = fopen("/proc/meminfo", "r");
+
+	if (!f)
+		return size;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "Hugepagesize: %zu kB", &size) == 1) {
+			size *= 1024;
+			break;
+		}
+	fclose(f);
+
+	return size;
+}
+
 
 /*
  * Cgroup setup (cgroup v2 only)
  */
 
+/* Create a chain of depth cgroups, paths[depth - 1] is the deepest */
 static int setup_cgroup_hierarchy(int depth, char paths[][MAX_PATH_LEN])
 {
 	int i;
 
-	printf("Setting up cgroup hierarchy with depth %d\n", depth);
+	if (verbose)
+		printf("Setting up cgroup hierarchy with depth %d\n", depth);
 
 	for (i = 0; i < depth; i++) {
 		if (i == 0) {
@@ -111,9 +290,33 @@ static int setup_cgroup_hierarchy(int depth, char paths[][MAX_PATH_LEN])
 			write_to_file(subtree_control, "+memory");
 		}
 
-		printf("Created cgroup level %d: %s\n", i, paths[i]);
+		if (verbose)
+			printf("Created cgroup level %d: %s\n", i, paths[i]);
+	}
+
+	return 0;
+}
+
+/* Siblings of the deepest level, leaves[0] is paths[depth - 1] itself */
+static int setup_cgroup_leaves(int depth, char paths[][MAX_PATH_LEN],
+			       int fanout, char leaves[][MAX_PATH_LEN])
+{
+	int i;
+
+	snprintf(leaves[0], MAX_PATH_LEN, "%s", paths[depth - 1]);
+	for (i = 1; i < fanout; i++) {
+		snprintf(leaves[i], MAX_PATH_LEN, "%.*s_%d",
+			 MAX_PATH_LEN - 12, paths[depth - 1], i);
+		if (mkdir(leaves[i], 0755) < 0 && errno != EEXIST) {
+			fprintf(stderr, "Failed to create cgroup %s: %s\n",
+					leaves[i], strerror(errno));
+			return -1;
+		}
 	}
 
+	if (fanout > 1 && verbose)
+		printf("Created %d sibling leaves under level %d\n", fanout, depth - 2);
+
 	return 0;
 }
 
@@ -129,6 +332,19 @@ static int move_out_cgroup()
 	return write_to_file(procs_path, pid_str);
 }
 
+static void cleanup_cgroup_leaves(int fanout, char leaves[][MAX_PATH_LEN])
+{
+	int i;
+
+	for (i = fanout - 1; i > 0; i--) {
+		if (rmdir(leaves[i]) < 0 && errno != ENOENT) {
+			fprintf(stderr, "Failed to remove cgroup %s: %s\n",
+					leaves[i], strerror(errno));
+			exit(-1);
+		}
+	}
+}
+
 static void cleanup_cgroup_hierarchy(int depth, char paths[][MAX_PATH_LEN])
 {
 	int i;
@@ -160,266 +376,918 @@ static int move_to_cgroup(const char *cgroup_path)
 /*
  * Memory allocation/deallocation functions
  */
-static void **allocate_memory_chunks(int num_chunks, size_t chunk_size)
+static int map_region(struct region *r)
+{
+	size_t align = config.backend == BACKEND_THP ? huge_page_size() : 0;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	char *map;
+
+	r->map_size = r->nr_chunks * r->chunk_size;
+	if (config.backend == BACKEND_HUGETLB)
+		flags |= MAP_HUGETLB;
+	/* THP populates below, once MADV_HUGEPAGE is set */
+	if (config.populate && !align)
+		flags |= MAP_POPULATE;
+
+	/* Over allocate so the THP region can start on a huge page */
+	map = mmap(NULL, r->map_size + align, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "mmap of %zu bytes (%s) failed: %s\n", r->map_size,
+			backend_names[config.backend], strerror(errno));
+		return -1;
+	}
+
+	if (align) {
+		char *start = (char *)(((unsigned long)map + align - 1) & ~(align - 1));
+
+		if (start != map)
+			munmap(map, start - map);
+		munmap(start + r->map_size, map + align - start);
+		map = start;
+		madvise(map, r->map_size, MADV_HUGEPAGE);
+		if (config.populate && madvise(map, r->map_size, MADV_POPULATE_WRITE))
+			fprintf(stderr, "MADV_POPULATE_WRITE failed: %s\n", strerror(errno));
+	}
+
+	r->map = map;
+	for (int i = 0; i < r->nr_chunks; i++)
+		r->chunks[i] = map + (size_t)i * r->chunk_size;
+
+	return 0;
+}
+
+static int allocate_memory_chunks(struct region *r, int num_chunks, size_t chunk_size)
 {
-	void **chunks = malloc(num_chunks * sizeof(void *));
 	int i;
 
-	if (!chunks) {
-		return NULL;
+	memset(r, 0, sizeof(*r));
+	r->nr_chunks = num_chunks;
+	r->chunk_size = chunk_size;
+	r->chunks = calloc(num_chunks, sizeof(void *));
+	if (!r->chunks) {
+		return -1;
+	}
+
+	if (config.backend != BACKEND_MALLOC && map_region(r) < 0) {
+		free(r->chunks);
+		return -1;
 	}
 
 	// printf("Allocating %d chunks of %lu\n", num_chunks, chunk_size);
 	for (i = 0; i < num_chunks; i++) {
-		chunks[i] = malloc(chunk_size);
-		if (!chunks[i]) {
+		/* Page aligned, or madvise() fails with EINVAL */
+		if (config.backend == BACKEND_MALLOC &&
+		    posix_memalign(&r->chunks[i], getpagesize(), chunk_size)) {
 			/* Cleanup on failure */
 			for (i--; i >= 0; i--) {
-				free(chunks[i]);
+				free(r->chunks[i]);
 			}
-			free(chunks);
-			return NULL;
+			free(r->chunks);
+			return -1;
 		}
 
 		/* Touch the memory to ensure it's actually allocated */
-		memset(chunks[i], i % 256, chunk_size);
+		memset(r->chunks[i], i % 256, chunk_size);
 	}
 
-	return chunks;
+	return 0;
 }
 
-static void free_memory_chunks(void **chunks, int num_chunks, int chunk_size)
+static void process_madvise_chunks(struct region *r)
 {
-	int i;
+	struct iovec iov[MADVISE_BATCH];
+	int pidfd = syscall(SYS_pidfd_open, getpid(), 0);
+	int i = 0;
 
-	if (!chunks) {
+	if (pidfd < 0) {
+		r->failed += r->nr_chunks;
 		return;
 	}
 
-	/* Mimick the workload by madvise don't need */
-	for (i = 0; i < num_chunks; i++) {
-		if (chunks[i]) {
-			madvise(chunks[i], chunk_size, MADV_DONTNEED);
+	while (i < r->nr_chunks) {
+		int n = 0;
+
+		for (; n < MADVISE_BATCH && i < r->nr_chunks; n++, i++) {
+			iov[n].iov_base = r->chunks[i];
+			iov[n].iov_len = r->chunk_size;
+		}
+		/* Only the local process may get MADV_DONTNEED, Linux 6.13+ */
+		if (syscall(SYS_process_madvise, pidfd, iov, n, MADV_DONTNEED, 0) < 0)
+			r->failed += n;
+	}
+
+	close(pidfd);
+}
+
+/* Give the memory back, this is where page_counter_uncharge() runs */
+static void release_memory_chunks(struct region *r)
+{
+	int i;
+
+	switch (config.release) {
+	case RELEASE_DONTNEED:
+	case RELEASE_FREE:
+		/* Mimick the workload by madvise don't need */
+		for (i = 0; i < r->nr_chunks; i++) {
+			if (madvise(r->chunks[i], r->chunk_size,
+				    config.release == RELEASE_FREE ?
+				    MADV_FREE : MADV_DONTNEED))
+				r->failed++;
 		}
+		break;
+	case RELEASE_DONTNEED_RANGE:
+		if (madvise(r->map, r->map_size, MADV_DONTNEED))
+			r->failed++;
+		break;
+	case RELEASE_MUNMAP:
+		for (i = 0; i < r->nr_chunks; i++) {
+			if (munmap(r->chunks[i], r->chunk_size))
+				r->failed++;
+		}
+		r->map = NULL;
+		break;
+	case RELEASE_PROCESS_MADVISE:
+		process_madvise_chunks(r);
+		break;
+	}
+}
+
+static void free_memory_chunks(struct region *r)
+{
+	int i;
+
+	if (!r->chunks) {
+		return;
 	}
 
 	/* Let's free now */
-	for (i = 0; i < num_chunks; i++) {
-		if (chunks[i]) {
-			free(chunks[i]);
+	if (config.backend == BACKEND_MALLOC) {
+		for (i = 0; i < r->nr_chunks; i++) {
+			free(r->chunks[i]);
 		}
+	} else if (r->map) {
+		munmap(r->map, r->map_size);
 	}
 
-	free(chunks);
+	free(r->chunks);
+	r->chunks = NULL;
 }
 
 /*
- * Test Case 1: Single level cgroup
+ * Hierarchy test: all the memory charged to the deepest cgroup, then
+ * released and freed from there
  */
-static double test_single_level(void)
+static int test_hierarchy(int test, int depth, struct phase_result *res)
 {
-	char paths[1][MAX_PATH_LEN];
-	void **chunks;
-	struct timespec start, end;
-	double elapsed;
+	char paths[MAX_HIERARCHY_DEPTH][MAX_PATH_LEN];
+	int num_chunks = config.memory_size / config.chunk_size;
+	const char *leaf = paths[depth - 1];
+	long long anon, current;
+	struct region region;
+	double start;
+	long faults;
 
-	printf("\n=== Test 1: Single Level Cgroup ===\n");
+	printf("\n=== Test %d: Hierarchy depth %d ===\n", test, depth);
+	res->depth = depth;
 
-	if (setup_cgroup_hierarchy(1, paths) < 0) {
+	if (setup_cgroup_hierarchy(depth, paths) < 0) {
 		return -1;
 	}
 
-	if (move_to_cgroup(paths[0]) < 0) {
+	/* Move to deepest cgroup */
+	if (move_to_cgroup(paths[depth - 1]) < 0) {
 		fprintf(stderr, "Failed to move to cgroup\n");
-		cleanup_cgroup_hierarchy(1, paths);
+		cleanup_cgroup_hierarchy(depth, paths);
 		return -1;
 	}
 
-	/* Allocate memory */
-	chunks = allocate_memory_chunks(NUM_ALLOCATIONS, ALLOCATION_SIZE);
-	if (!chunks) {
+	/* Measure charge time, the faults charge every page on the way in */
+	anon = read_key(leaf, "memory.stat", "anon");
+	current = read_value(leaf, "memory.current");
+	faults = minor_faults();
+	start = now_ms();
+	if (allocate_memory_chunks(&region, num_chunks, config.chunk_size) < 0) {
 		fprintf(stderr, "Failed to allocate memory\n");
-		cleanup_cgroup_hierarchy(1, paths);
+		cleanup_cgroup_hierarchy(depth, paths);
 		return -1;
 	}
+	res->charge_ms = now_ms() - start;
+	res->faults = minor_faults() - faults;
+	res->charged = (read_key(leaf, "memory.stat", "anon") - anon) / getpagesize();
+	res->current = read_value(leaf, "memory.current") - current;
+	current = read_value(leaf, "memory.current");
+
+	/* Measure release time (this triggers page_counter_uncharge) */
+	start = now_ms();
+	release_memory_chunks(&region);
+	res->release_ms = now_ms() - start;
+	res->failed = region.failed;
+	res->uncharged = current - read_value(leaf, "memory.current");
+
+	start = now_ms();
+	free_memory_chunks(&region);
+	res->free_ms = now_ms() - start;
+
+	cleanup_cgroup_hierarchy(depth, paths);
+
+	printf("Depth %d charge time: %.2f ms, %ld minor faults, %lld pages charged (memory.current +%lld KB)\n",
+	       depth, res->charge_ms, res->faults, res->charged, res->current >> 10);
+	printf("Depth %d release time: %.2f ms, free time: %.2f ms (memory.current -%lld KB)\n",
+	       depth, res->release_ms, res->free_ms, res->uncharged >> 10);
+	if (res->failed)
+		printf("Warning: %lu %s calls failed\n", res->failed,
+		       release_names[config.release]);
+	return 0;
+}
+
+/*
+ * Stress test worker
+ */
+struct thread_data {
+	int thread_id;
+	char cgroup_path[MAX_PATH_LEN];
+	double elapsed_ms;
+};
+
+static void *stress_worker(void *arg)
+{
+	struct thread_data *data = (struct thread_data *)arg;
+	struct region region;
+	struct timespec start, end;
+	int i;
 
-	/* Measure free time (this triggers page_counter_uncharge) */
 	clock_gettime(CLOCK_MONOTONIC, &start);
-	free_memory_chunks(chunks, NUM_ALLOCATIONS, ALLOCATION_SIZE);
-	clock_gettime(CLOCK_MONOTONIC, &end);
 
-	elapsed = timespec_to_ms(&end) - timespec_to_ms(&start);
+	/* Perform many small allocations and frees */
+	for (i = 0; i < config.iterations; i++) {
+		if (!allocate_memory_chunks(&region, STRESS_CHUNKS, config.chunk_size)) {
+			release_memory_chunks(&region);
+			free_memory_chunks(&region);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-	cleanup_cgroup_hierarchy(1, paths);
+	data->elapsed_ms = timespec_to_ms(&end) - timespec_to_ms(&start);
 
-	printf("Single level free time: %.2f ms\n", elapsed);
-	return elapsed;
+	printf("Thread %d completed in %.2f ms\n", data->thread_id, data->elapsed_ms);
+	return NULL;
 }
 
 /*
- * Test Case 2: Shallow hierarchy (3 levels)
+ * A process per leaf: memcg charges follow the mm, so threads of one
+ * process always charge the same cgroup. Leaf k runs threads k, k + fanout...
  */
-static double test_shallow_hierarchy(void)
+static void run_leaf(int leaf, struct thread_data *thread_data)
 {
-	char paths[3][MAX_PATH_LEN];
-	void **chunks;
-	struct timespec start, end;
-	double elapsed;
+	pthread_t threads[NUM_THREADS];
+	int i, n = 0;
 
-	printf("\n=== Test 2: Shallow Hierarchy (3 levels) ===\n");
+	if (move_to_cgroup(thread_data[leaf].cgroup_path) < 0) {
+		fprintf(stderr, "Leaf %d: Failed to move to cgroup\n", leaf);
+		exit(1);
+	}
 
-	if (setup_cgroup_hierarchy(3, paths) < 0) {
-		return -1;
+	for (i = leaf; i < config.num_threads; i += config.fanout) {
+		if (pthread_create(&threads[n], NULL, stress_worker, &thread_data[i]) != 0) {
+			fprintf(stderr, "Failed to create thread %d\n", i);
+			break;
+		}
+		n++;
 	}
 
-	/* Move to deepest cgroup */
-	if (move_to_cgroup(paths[2]) < 0) {
-		fprintf(stderr, "Failed to move to cgroup\n");
-		cleanup_cgroup_hierarchy(3, paths);
-		return -1;
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	fflush(stdout);
+	exit(0);
+}
+
+/*
+ * Stat readers: a thread per file, like a monitoring agent, reads it at
+ * every level of the hierarchy read_rate times a second. Reading
+ * memory.stat flushes rstat, which the charge traffic keeps dirty.
+ * Latencies go in a histogram per file and level, for the idle phase and
+ * for the phase with the workload running.
+ */
+enum { READ_IDLE, READ_LOAD, READ_STOP };
+
+static const char *stat_files[] = {
+	"memory.stat", "memory.current", "memory.events",
+};
+#define NR_STAT_FILES (sizeof(stat_files) / sizeof(stat_files[0]))
+
+struct stat_reader {
+	pthread_t thread;
+	const char *file;
+	int depth;
+	char (*paths)[MAX_PATH_LEN];
+	struct bench_hist *hist[READ_STOP][MAX_HIERARCHY_DEPTH];
+};
+
+static int reader_phase;
+
+static void *stat_reader(void *arg)
+{
+	struct stat_reader *reader = arg;
+	uint64_t period = 1000000000ULL / config.read_rate;
+	int fds[MAX_HIERARCHY_DEPTH];
+	struct timespec next;
+	char buf[8192];
+	int phase, i;
+
+	for (i = 0; i < reader->depth; i++) {
+		char path[MAX_PATH_LEN + 32];
+
+		snprintf(path, sizeof(path), "%s/%s", reader->paths[i], reader->file);
+		fds[i] = open(path, O_RDONLY);
+		if (fds[i] < 0)
+			fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
 	}
 
-	chunks = allocate_memory_chunks(NUM_ALLOCATIONS, ALLOCATION_SIZE);
-	if (!chunks) {
-		fprintf(stderr, "Failed to allocate memory\n");
-		cleanup_cgroup_hierarchy(3, paths);
-		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while ((phase = __atomic_load_n(&reader_phase, __ATOMIC_RELAXED)) != READ_STOP) {
+		for (i = 0; i < reader->depth; i++) {
+			uint64_t start;
+			off_t off = 0;
+			ssize_t ret;
+
+			if (fds[i] < 0)
+				continue;
+			/* Back at 0, the seq_file is generated again */
+			start = bench_now_ns();
+			while ((ret = pread(fds[i], buf, sizeof(buf), off)) > 0)
+				off += ret;
+			bench_hist_record(reader->hist[phase][i], bench_now_ns() - start);
+		}
+
+		next.tv_nsec += period;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
 	}
 
-	clock_gettime(CLOCK_MONOTONIC, &start);
-	free_memory_chunks(chunks, NUM_ALLOCATIONS, ALLOCATION_SIZE);
-	clock_gettime(CLOCK_MONOTONIC, &end);
+	for (i = 0; i < reader->depth; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+
+	return NULL;
+}
 
-	elapsed = timespec_to_ms(&end) - timespec_to_ms(&start);
+static int start_stat_readers(struct stat_reader *readers, int depth,
+			      char paths[][MAX_PATH_LEN])
+{
+	unsigned int f;
+	int phase, i;
+
+	reader_phase = READ_IDLE;
+	for (f = 0; f < NR_STAT_FILES; f++) {
+		struct stat_reader *reader = &readers[f];
+
+		reader->file = stat_files[f];
+		reader->depth = depth;
+		reader->paths = paths;
+		for (phase = READ_IDLE; phase < READ_STOP; phase++)
+			for (i = 0; i < depth; i++) {
+				reader->hist[phase][i] = bench_hist_alloc();
+				if (!reader->hist[phase][i])
+					return -1;
+			}
+		if (pthread_create(&reader->thread, NULL, stat_reader, reader)) {
+			fprintf(stderr, "Failed to create the %s reader\n", reader->file);
+			return -1;
+		}
+	}
 
-	cleanup_cgroup_hierarchy(3, paths);
+	printf("Stat readers: %d rounds/s over %d levels, %d ms idle first\n",
+	       config.read_rate, depth, READER_IDLE_MS);
+	usleep(READER_IDLE_MS * 1000);
+	__atomic_store_n(&reader_phase, READ_LOAD, __ATOMIC_RELAXED);
 
-	printf("Shallow hierarchy free time: %.2f ms\n", elapsed);
-	return elapsed;
+	return 0;
+}
+
+static void stop_stat_readers(struct stat_reader *readers)
+{
+	static const char *phase_names[] = { "idle", "load" };
+	unsigned int f;
+	int phase, i;
+
+	__atomic_store_n(&reader_phase, READ_STOP, __ATOMIC_RELAXED);
+	for (f = 0; f < NR_STAT_FILES; f++)
+		pthread_join(readers[f].thread, NULL);
+
+	printf("\n=== Stat read latency per file and level ===\n");
+	bench_result_header(stdout, config.format);
+	for (f = 0; f < NR_STAT_FILES; f++) {
+		struct stat_reader *reader = &readers[f];
+
+		for (i = 0; i < reader->depth; i++)
+			for (phase = READ_IDLE; phase < READ_STOP; phase++) {
+				struct bench_hist *h = reader->hist[phase][i];
+				struct bench_result r;
+				char level[32];
+
+				snprintf(level, sizeof(level), "level %d/%d", i, reader->depth - 1);
+				bench_result_init(&r, "page_counter_test", reader->file);
+				r.mode = phase_names[phase];
+				r.config = level;
+				r.threads = config.num_threads;
+				if (h->count) {
+					bench_result_from_hist(&r, h);
+					bench_result_print(stdout, config.format, &r);
+				}
+				free(h);
+			}
+	}
 }
 
 /*
- * Test Case 3: Deep hierarchy (8 levels)
+ * Parallel stress test: num_threads threads spread over fanout sibling
+ * leaves at the deepest level
  */
-static double test_deep_hierarchy(void)
+static double test_parallel_stress(int test)
 {
+	int depth = config.depths[config.nr_depths - 1];
 	char paths[MAX_HIERARCHY_DEPTH][MAX_PATH_LEN];
-	void **chunks;
-	struct timespec start, end;
-	double elapsed;
+	char leaves[NUM_THREADS][MAX_PATH_LEN];
+	struct stat_reader readers[NR_STAT_FILES];
+	struct thread_data *thread_data;
+	double total_elapsed = 0;
+	int i;
 
-	printf("\n=== Test 3: Deep Hierarchy (%d levels) ===\n", MAX_HIERARCHY_DEPTH);
+	printf("\n=== Test %d: Parallel Stress Test (%d threads, %d leaves) ===\n",
+	       test, config.num_threads, config.fanout);
 
-	if (setup_cgroup_hierarchy(MAX_HIERARCHY_DEPTH, paths) < 0) {
+	if (setup_cgroup_hierarchy(depth, paths) < 0 ||
+	    setup_cgroup_leaves(depth, paths, config.fanout, leaves) < 0) {
 		return -1;
 	}
 
-	/* Move to deepest cgroup */
-	if (move_to_cgroup(paths[MAX_HIERARCHY_DEPTH-1]) < 0) {
-		fprintf(stderr, "Failed to move to cgroup\n");
-		cleanup_cgroup_hierarchy(MAX_HIERARCHY_DEPTH, paths);
+	/* Shared with the leaf processes */
+	thread_data = mmap(NULL, config.num_threads * sizeof(*thread_data),
+			   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (thread_data == MAP_FAILED) {
+		cleanup_cgroup_leaves(config.fanout, leaves);
+		cleanup_cgroup_hierarchy(depth, paths);
 		return -1;
 	}
 
-	chunks = allocate_memory_chunks(NUM_ALLOCATIONS, ALLOCATION_SIZE);
-	if (!chunks) {
-		fprintf(stderr, "Failed to allocate memory\n");
-		cleanup_cgroup_hierarchy(MAX_HIERARCHY_DEPTH, paths);
-		return -1;
+	for (i = 0; i < config.num_threads; i++) {
+		thread_data[i].thread_id = i;
+		strcpy(thread_data[i].cgroup_path, leaves[i % config.fanout]);
+		thread_data[i].elapsed_ms = 0;
 	}
 
-	clock_gettime(CLOCK_MONOTONIC, &start);
-	free_memory_chunks(chunks, NUM_ALLOCATIONS, ALLOCATION_SIZE);
-	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (config.read_rate && start_stat_readers(readers, depth, paths) < 0) {
+		fprintf(stderr, "Failed to start the stat readers\n");
+		config.read_rate = 0;
+	}
+
+	fflush(stdout);
+	for (i = 0; i < config.fanout; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			fprintf(stderr, "Failed to fork leaf %d\n", i);
+			break;
+		}
+		if (!pid)
+			run_leaf(i, thread_data);
+	}
+
+	/* Wait for the leaves to complete */
+	while (wait(NULL) > 0)
+		;
 
-	elapsed = timespec_to_ms(&end) - timespec_to_ms(&start);
+	for (i = 0; i < config.num_threads; i++) {
+		total_elapsed += thread_data[i].elapsed_ms;
+	}
+	munmap(thread_data, config.num_threads * sizeof(*thread_data));
 
-	cleanup_cgroup_hierarchy(MAX_HIERARCHY_DEPTH, paths);
+	printf("Total parallel time: %.2f ms (avg per thread: %.2f ms)\n",
+		   total_elapsed, total_elapsed / config.num_threads);
+	if (config.read_rate)
+		stop_stat_readers(readers);
 
-	printf("Deep hierarchy free time: %.2f ms\n", elapsed);
-	return elapsed;
+	cleanup_cgroup_leaves(config.fanout, leaves);
+	cleanup_cgroup_hierarchy(depth, paths);
+
+	return total_elapsed / config.num_threads;
 }
 
 /*
- * Stress test worker
+ * Depth and sibling contention curve
+ *
+ * Every charge walks page_counter from the leaf to the root, so siblings
+ * charging at the same time bounce the cache lines of all their shared
+ * ancestors. For each depth, one worker charging alone is compared to
+ * fanout workers in sibling leaves, one process per leaf, each pinned to
+ * its own CPU and released together.
+ *
+ * A worker op touches every page of a STRESS_CHUNKS * chunk_size mapping
+ * and drops it with MADV_DONTNEED. memcg charges through a per-cpu stock
+ * of MEMCG_CHARGE_BATCH (64) pages, so page_counter only sees one charge
+ * every 64 pages or so: use chunks of 256K and up to make it dominate.
  */
-struct thread_data {
-	int thread_id;
-	char cgroup_path[MAX_PATH_LEN];
+struct curve_worker {
 	double elapsed_ms;
+	uint64_t misses;
+	int has_misses;
 };
 
-static void *stress_worker(void *arg)
+struct curve_shared {
+	int ready;
+	int go;
+	struct curve_worker w[NUM_THREADS];
+};
+
+struct curve_point {
+	double ns;		/* per page charged and uncharged */
+	double misses;		/* cache misses per page, < 0 if no PMU */
+};
+
+/* Cache misses of this process, user and kernel, or -1 */
+static int open_miss_counter(void)
 {
-	struct thread_data *data = (struct thread_data *)arg;
-	void **chunks;
-	struct timespec start, end;
-	int i;
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_HARDWARE,
+		.size = sizeof(attr),
+		.config = PERF_COUNT_HW_CACHE_MISSES,
+		.disabled = 1,
+		.exclude_hv = 1,
+	};
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
 
-	/* Move to assigned cgroup */
-	if (move_to_cgroup(data->cgroup_path) < 0) {
-		fprintf(stderr, "Thread %d: Failed to move to cgroup\n", data->thread_id);
-		return NULL;
+static void run_curve_worker(int id, const char *cgroup_path,
+			     struct curve_shared *shared, size_t pages)
+{
+	struct curve_worker *w = &shared->w[id];
+	long page_size = getpagesize();
+	size_t size = pages * page_size;
+	cpu_set_t cpus;
+	double start;
+	char *map;
+	int fd, i;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+	sched_setaffinity(0, sizeof(cpus), &cpus);
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED || move_to_cgroup(cgroup_path) < 0) {
+		__atomic_add_fetch(&shared->ready, 1, __ATOMIC_RELEASE);
+		exit(1);
+	}
+	fd = open_miss_counter();
+
+	__atomic_add_fetch(&shared->ready, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&shared->go, __ATOMIC_ACQUIRE))
+		;
+
+	if (fd >= 0)
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	start = now_ms();
+	for (i = 0; i < config.iterations; i++) {
+		for (size_t off = 0; off < size; off += page_size)
+			map[off] = 1;
+		madvise(map, size, MADV_DONTNEED);
+	}
+	w->elapsed_ms = now_ms() - start;
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		w->has_misses = read(fd, &w->misses, sizeof(w->misses)) == sizeof(w->misses);
 	}
 
-	clock_gettime(CLOCK_MONOTONIC, &start);
+	exit(0);
+}
 
-	/* Perform many small allocations and frees */
-	for (i = 0; i < STRESS_ITERATIONS; i++) {
-		chunks = allocate_memory_chunks(10, ALLOCATION_SIZE);
-		if (chunks) {
-			free_memory_chunks(chunks, 10, ALLOCATION_SIZE);
-		}
+static int curve_point(int depth, int nr_leaves, struct curve_point *pt)
+{
+	char paths[MAX_HIERARCHY_DEPTH][MAX_PATH_LEN];
+	char leaves[NUM_THREADS][MAX_PATH_LEN];
+	size_t pages = STRESS_CHUNKS * config.chunk_size / getpagesize();
+	struct curve_shared *shared;
+	int i, started = 0, has_misses = 1;
+	double ns = 0, misses = 0;
+
+	if (setup_cgroup_hierarchy(depth, paths) < 0 ||
+	    setup_cgroup_leaves(depth, paths, nr_leaves, leaves) < 0)
+		return -1;
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		cleanup_cgroup_leaves(nr_leaves, leaves);
+		cleanup_cgroup_hierarchy(depth, paths);
+		return -1;
 	}
 
-	clock_gettime(CLOCK_MONOTONIC, &end);
+	fflush(stdout);
+	for (i = 0; i < nr_leaves; i++) {
+		pid_t pid = fork();
 
-	data->elapsed_ms = timespec_to_ms(&end) - timespec_to_ms(&start);
+		if (pid < 0)
+			break;
+		if (!pid)
+			run_curve_worker(i, leaves[i], shared, pages);
+		started++;
+	}
 
-	printf("Thread %d completed in %.2f ms\n", data->thread_id, data->elapsed_ms);
-	return NULL;
+	/* Everybody mapped and moved, then release them together */
+	while (__atomic_load_n(&shared->ready, __ATOMIC_ACQUIRE) < started)
+		usleep(100);
+	__atomic_store_n(&shared->go, 1, __ATOMIC_RELEASE);
+	while (wait(NULL) > 0)
+		;
+
+	for (i = 0; i < started; i++) {
+		struct curve_worker *w = &shared->w[i];
+
+		ns += w->elapsed_ms * 1e6 / ((double)config.iterations * pages);
+		misses += (double)w->misses / ((double)config.iterations * pages);
+		has_misses &= w->has_misses;
+	}
+	pt->ns = started ? ns / started : 0;
+	pt->misses = started && has_misses ? misses / started : -1;
+
+	munmap(shared, sizeof(*shared));
+	cleanup_cgroup_leaves(nr_leaves, leaves);
+	cleanup_cgroup_hierarchy(depth, paths);
+
+	return started == nr_leaves && pt->ns ? 0 : -1;
+}
+
+static void print_misses(double misses)
+{
+	if (misses < 0)
+		printf(" %11s", "-");
+	else
+		printf(" %11.2f", misses);
 }
 
 /*
- * Test Case 4: Parallel stress test
+ * A row per depth: solo and shared ns per page, their ratio (the sibling
+ * contention), shared ns per level added since the previous depth, and
+ * cache misses per page. Ends with least squares ns per level slopes.
  */
-static double test_parallel_stress(void)
+static void test_curve(void)
 {
-	char paths[MAX_HIERARCHY_DEPTH][MAX_PATH_LEN];
-	pthread_t threads[NUM_THREADS];
-	struct thread_data thread_data[NUM_THREADS];
-	double total_elapsed = 0;
-	int i;
-
-	printf("\n=== Test 4: Parallel Stress Test (%d threads) ===\n", NUM_THREADS);
+	double sx = 0, sxx = 0, sy_solo = 0, sxy_solo = 0, sy = 0, sxy = 0;
+	struct curve_point solo, shared, prev = { 0 };
+	int i, prev_depth = 0, n = 0;
+
+	verbose = 0;
+	printf("\n=== Depth curve: %d sibling leaves, %zu KB per op, %d ops ===\n",
+	       config.fanout, STRESS_CHUNKS * config.chunk_size / 1024,
+	       config.iterations);
+	if (config.fanout > sysconf(_SC_NPROCESSORS_ONLN))
+		printf("Warning: more leaves than CPUs, shared workers will time slice\n");
+	printf("%5s %10s %10s %10s %10s %11s %11s\n", "depth", "solo_ns",
+	       "shared_ns", "contention", "ns/level", "solo_miss", "shared_miss");
+
+	for (i = 0; i < config.nr_depths; i++) {
+		int depth = config.depths[i];
+		double x = depth;
+
+		if (curve_point(depth, 1, &solo) < 0 ||
+		    curve_point(depth, config.fanout, &shared) < 0) {
+			fprintf(stderr, "Depth %d failed\n", depth);
+			continue;
+		}
 
-	if (setup_cgroup_hierarchy(MAX_HIERARCHY_DEPTH, paths) < 0) {
-		return -1;
+		printf("%5d %10.1f %10.1f %10.2f", depth, solo.ns, shared.ns,
+		       shared.ns / solo.ns);
+		if (prev_depth)
+			printf(" %10.2f", (shared.ns - prev.ns) / (depth - prev_depth));
+		else
+			printf(" %10s", "-");
+		print_misses(solo.misses);
+		print_misses(shared.misses);
+		printf("\n");
+		fflush(stdout);
+
+		prev = shared;
+		prev_depth = depth;
+		n++;
+		sx += x;
+		sxx += x * x;
+		sy_solo += solo.ns;
+		sxy_solo += x * solo.ns;
+		sy += shared.ns;
+		sxy += x * shared.ns;
 	}
 
-	/* Create worker threads */
-	for (i = 0; i < NUM_THREADS; i++) {
-		thread_data[i].thread_id = i;
-		strcpy(thread_data[i].cgroup_path, paths[MAX_HIERARCHY_DEPTH-1]);
-		thread_data[i].elapsed_ms = 0;
+	if (n > 1 && n * sxx - sx * sx > 0)
+		printf("Cost per level: solo %.2f ns, %d siblings %.2f ns per page\n",
+		       (n * sxy_solo - sx * sy_solo) / (n * sxx - sx * sx),
+		       config.fanout, (n * sxy - sx * sy) / (n * sxx - sx * sx));
+}
 
-		if (pthread_create(&threads[i], NULL, stress_worker, &thread_data[i]) != 0) {
-			fprintf(stderr, "Failed to create thread %d\n", i);
+/*
+ * Pressure mode: the leaf gets memory.high or memory.max at limit_pct of
+ * the working set, and a child keeps allocating and freeing the working
+ * set in it, timing every chunk allocation (fault and charge included).
+ * Over memory.high the charge path reclaims and then throttles the task,
+ * over memory.max it reclaims and finally OOM kills. Without swap only
+ * page cache can be reclaimed, the anon working set cannot.
+ *
+ * The child is a separate process so an OOM kill only ends the test.
+ * Meanwhile the parent samples memory.events, memory.pressure and the
+ * memory.stat reclaim counters of the leaf. A child still throttled
+ * PRESSURE_GRACE_MS after the end of the run is killed.
+ */
+struct pressure_shared {
+	int stop;
+	unsigned long passes;
+	struct bench_hist hist;
+};
+
+/* memory.pressure "some" or "full" avg10 and total (us) */
+static int read_psi(const char *cgroup_path, const char *kind, double *avg10,
+		    unsigned long long *total)
+{
+	char path[MAX_PATH_LEN + 32], line[256], fmt[64];
+	int ret = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/memory.pressure", cgroup_path);
+	snprintf(fmt, sizeof(fmt), "%s avg10=%%lf avg60=%%*f avg300=%%*f total=%%llu", kind);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, fmt, avg10, total) == 2) {
+			ret = 0;
 			break;
 		}
+	fclose(f);
+
+	return ret;
+}
+
+static void run_pressure_child(const char *cgroup_path, struct pressure_shared *shared)
+{
+	int num_chunks = config.memory_size / config.chunk_size;
+	struct region region;
+	int i;
+
+	if (move_to_cgroup(cgroup_path) < 0)
+		exit(1);
+
+	memset(&region, 0, sizeof(region));
+	region.nr_chunks = num_chunks;
+	region.chunk_size = config.chunk_size;
+
+	/* A pass allocates the whole working set, then gives it back */
+	while (!__atomic_load_n(&shared->stop, __ATOMIC_RELAXED)) {
+		region.chunks = calloc(num_chunks, sizeof(void *));
+		if (!region.chunks || (config.backend != BACKEND_MALLOC && map_region(&region) < 0))
+			exit(1);
+
+		for (i = 0; i < num_chunks; i++) {
+			uint64_t start = bench_now_ns();
+
+			if (config.backend == BACKEND_MALLOC &&
+			    posix_memalign(&region.chunks[i], getpagesize(), config.chunk_size))
+				exit(1);
+			memset(region.chunks[i], i % 256, config.chunk_size);
+			bench_hist_record(&shared->hist, bench_now_ns() - start);
+			/* A throttled pass can take far longer than the run */
+			if (__atomic_load_n(&shared->stop, __ATOMIC_RELAXED))
+				exit(0);
+		}
+
+		release_memory_chunks(&region);
+		free_memory_chunks(&region);
+		shared->passes++;
 	}
 
-	/* Wait for threads to complete */
-	for (i = 0; i < NUM_THREADS; i++) {
-		pthread_join(threads[i], NULL);
-		total_elapsed += thread_data[i].elapsed_ms;
+	exit(0);
+}
+
+static void test_pressure(int test, int depth)
+{
+	static const char *events[] = { "high", "max", "oom", "oom_kill" };
+	char paths[MAX_HIERARCHY_DEPTH][MAX_PATH_LEN];
+	unsigned long long some_start = 0, full_start = 0;
+	long long scan_start, steal_start, events_start[4];
+	const char *leaf = paths[depth - 1];
+	struct pressure_shared *shared;
+	size_t limit = config.memory_size / 100 * config.limit_pct;
+	char limit_path[MAX_PATH_LEN + 32], value[32], mode[64], level[48];
+	struct bench_result r;
+	double start, now, end, avg10;
+	const char *outcome = "";
+	int status = 0, ret = 0;
+	pid_t pid;
+
+	printf("\n=== Test %d: %s at %d%% of %zu MB, depth %d ===\n", test,
+	       config.limit, config.limit_pct, config.memory_size >> 20, depth);
+
+	if (setup_cgroup_hierarchy(depth, paths) < 0)
+		return;
+
+	snprintf(value, sizeof(value), "%zu", limit);
+	snprintf(limit_path, sizeof(limit_path), "%s/%s", leaf, config.limit);
+	if (write_to_file(limit_path, value) < 0) {
+		cleanup_cgroup_hierarchy(depth, paths);
+		return;
+	}
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		cleanup_cgroup_hierarchy(depth, paths);
+		return;
+	}
+	bench_hist_reset(&shared->hist);
+
+	scan_start = read_key(leaf, "memory.stat", "pgscan");
+	steal_start = read_key(leaf, "memory.stat", "pgsteal");
+	for (int i = 0; i < 4; i++)
+		events_start[i] = read_key(leaf, "memory.events", events[i]);
+	read_psi(leaf, "some", &avg10, &some_start);
+	read_psi(leaf, "full", &avg10, &full_start);
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		munmap(shared, sizeof(*shared));
+		cleanup_cgroup_hierarchy(depth, paths);
+		return;
+	}
+	if (!pid)
+		run_pressure_child(leaf, shared);
+
+	printf("%8s %10s %8s %8s %8s %8s %10s %10s %10s %10s %10s %10s\n",
+	       "time_ms", "anon_MB", "high", "max", "oom", "oom_kill",
+	       "some_avg10", "full_avg10", "some_ms", "full_ms", "pgscan", "pgsteal");
+	start = now_ms();
+	do {
+		unsigned long long some_total = 0, full_total = 0;
+		double some_avg10 = 0, full_avg10 = 0;
+
+		usleep(PRESSURE_SAMPLE_MS * 1000);
+		now = now_ms();
+		read_psi(leaf, "some", &some_avg10, &some_total);
+		read_psi(leaf, "full", &full_avg10, &full_total);
+
+		printf("%8.0f %10lld", now - start,
+		       read_key(leaf, "memory.stat", "anon") >> 20);
+		for (int i = 0; i < 4; i++)
+			printf(" %8lld", read_key(leaf, "memory.events", events[i]) - events_start[i]);
+		printf(" %10.2f %10.2f %10.1f %10.1f %10lld %10lld\n",
+		       some_avg10, full_avg10, (some_total - some_start) / 1000.0,
+		       (full_total - full_start) / 1000.0,
+		       read_key(leaf, "memory.stat", "pgscan") - scan_start,
+		       read_key(leaf, "memory.stat", "pgsteal") - steal_start);
+		fflush(stdout);
+	} while (now - start < config.pressure_secs * 1000.0 &&
+		 (ret = waitpid(pid, &status, WNOHANG)) == 0);
+
+	__atomic_store_n(&shared->stop, 1, __ATOMIC_RELAXED);
+	end = now_ms();
+	while (!ret && (ret = waitpid(pid, &status, WNOHANG)) == 0 &&
+	       now_ms() - end < PRESSURE_GRACE_MS)
+		usleep(10 * 1000);
+	if (!ret) {
+		printf("Worker still throttled %d ms after the run, killing it\n",
+		       PRESSURE_GRACE_MS);
+		kill(pid, SIGKILL);
+		ret = waitpid(pid, &status, 0);
+		outcome = " killed";
+	} else if (ret < 0 || !WIFEXITED(status)) {
+		printf("Worker killed (%s), %s is below the working set\n",
+		       ret > 0 && WIFSIGNALED(status) ? strsignal(WTERMSIG(status)) : "?",
+		       config.limit);
+		outcome = " killed";
+	} else if (WEXITSTATUS(status)) {
+		printf("Worker failed to set up or allocate (exit %d), results are partial\n",
+		       WEXITSTATUS(status));
+		outcome = " failed";
 	}
 
-	cleanup_cgroup_hierarchy(MAX_HIERARCHY_DEPTH, paths);
+	snprintf(mode, sizeof(mode), "%s %d%%", config.limit, config.limit_pct);
+	snprintf(level, sizeof(level), "depth=%d passes=%lu%s", depth, shared->passes,
+		 outcome);
+	bench_result_init(&r, "page_counter_test", "alloc");
+	r.mode = mode;
+	r.config = level;
+	r.threads = 1;
+	if (shared->hist.count) {
+		bench_result_from_hist(&r, &shared->hist);
+		bench_result_header(stdout, config.format);
+		bench_result_print(stdout, config.format, &r);
+	}
 
-	printf("Total parallel time: %.2f ms (avg per thread: %.2f ms)\n",
-		   total_elapsed, total_elapsed / NUM_THREADS);
-	return total_elapsed / NUM_THREADS;
+	munmap(shared, sizeof(*shared));
+	cleanup_cgroup_hierarchy(depth, paths);
 }
 
 /*
@@ -427,39 +1295,247 @@ static double test_parallel_stress(void)
  */
 static void print_summary(void)
 {
-	printf("\n=== Performance Summary ===\n");
-	printf("Single level:	  %.2f ms\n", results.single_level_ms);
-	printf("Shallow hierarchy: %.2f ms\n", results.shallow_hierarchy_ms);
-	printf("Deep hierarchy:	%.2f ms\n", results.deep_hierarchy_ms);
+	int i;
+
+	printf("\n=== Performance Summary (%s, %s, %s, %zu KB chunks) ===\n",
+	       backend_names[config.backend], config.populate ? "populate" : "touch",
+	       release_names[config.release], config.chunk_size / 1024);
+	for (i = 0; i < config.nr_depths; i++) {
+		struct phase_result *res = &results.hierarchy[i];
+		/* hugetlb is not in memory.stat anon, fall back to chunks */
+		long long pages = res->charged > 0 ? res->charged :
+				  (long long)(config.memory_size / getpagesize());
+
+		printf("Depth %2d:	  charge %.2f ms (%.1f ns/page), release %.2f ms (%.1f ns/page), free %.2f ms\n",
+		       res->depth, res->charge_ms, res->charge_ms * 1e6 / pages,
+		       res->release_ms, res->release_ms * 1e6 / pages, res->free_ms);
+	}
 	printf("Parallel stress:   %.2f ms (avg per thread)\n", results.parallel_test_ms);
 }
 
+static void print_help(const char *name)
+{
+	printf("%s [options]\n", name);
+	printf("	-d <list>     hierarchy depths, comma separated (default 1,3,%d, 1..%d with -c)\n",
+	       DEFAULT_DEPTH, MAX_HIERARCHY_DEPTH);
+	printf("	-F <leaves>   sibling leaves for the parallel test (default 1, online CPUs with -c)\n");
+	printf("	-R <rate>     stat reader rounds per second during the parallel test (default off)\n");
+	printf("	-f <format>   stat reader results as text (default), csv or json\n");
+	printf("	-L <limit>    pressure mode, high:<pct> or max:<pct> of the -m working set\n");
+	printf("	-T <secs>     pressure mode duration per depth (default %d)\n", PRESSURE_SECS);
+	printf("	-c            depth/sibling contention curve instead of the tests below\n");
+	printf("	-t <threads>  parallel test threads (default %d, max %d)\n", NUM_THREADS, NUM_THREADS);
+	printf("	-i <iters>    parallel test iterations per thread (default %d)\n", STRESS_ITERATIONS);
+	printf("	-m <size>     memory per hierarchy test (default 5G)\n");
+	printf("	-s <size>     chunk size (default 4K)\n");
+	printf("	-b <backend>  malloc (default), mmap, hugetlb or thp\n");
+	printf("	-a <charge>   touch (default, first touch faults) or populate (MAP_POPULATE, mapping backends)\n");
+	printf("	-r <release>  dontneed (default), dontneed-range, free, munmap or process_madvise\n");
+}
+
+static int parse_name(const char *arg, const char **names, int nr)
+{
+	for (int i = 0; i < nr; i++)
+		if (!strcmp(arg, names[i]))
+			return i;
+
+	return -1;
+}
+
+static int parse_args(int argc, char **argv)
+{
+	char *tok, *save;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "hd:F:t:i:m:s:b:r:cR:f:L:T:a:")) != -1) {
+		switch (opt) {
+		case 'd':
+			config.nr_depths = 0;
+			for (tok = strtok_r(optarg, ",", &save); tok && config.nr_depths < MAX_DEPTHS;
+			     tok = strtok_r(NULL, ",", &save))
+				config.depths[config.nr_depths++] = atoi(tok);
+			break;
+		case 'F':
+			config.fanout = atoi(optarg);
+			break;
+		case 'c':
+			config.curve = 1;
+			break;
+		case 'a':
+			if (!strcmp(optarg, "populate"))
+				config.populate = 1;
+			else if (strcmp(optarg, "touch"))
+				return -1;
+			break;
+		case 'L':
+			if (!strncmp(optarg, "high:", 5))
+				config.limit = "memory.high";
+			else if (!strncmp(optarg, "max:", 4))
+				config.limit = "memory.max";
+			else
+				return -1;
+			config.limit_pct = atoi(strchr(optarg, ':') + 1);
+			if (config.limit_pct <= 0)
+				return -1;
+			break;
+		case 'T':
+			config.pressure_secs = atoi(optarg);
+			break;
+		case 'R':
+			config.read_rate = atoi(optarg);
+			break;
+		case 'f':
+			config.format = bench_parse_format(optarg);
+			if ((int)config.format < 0)
+				return -1;
+			break;
+		case 't':
+			config.num_threads = atoi(optarg);
+			break;
+		case 'i':
+			config.iterations = atoi(optarg);
+			break;
+		case 'm':
+			config.memory_size = parse_size(optarg);
+			break;
+		case 's':
+			config.chunk_size = parse_size(optarg);
+			break;
+		case 'b':
+			config.backend = parse_name(optarg, backend_names, 4);
+			if ((int)config.backend < 0)
+				return -1;
+			break;
+		case 'r':
+			config.release = parse_name(optarg, release_names, 5);
+			if ((int)config.release < 0)
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (!config.nr_depths && config.curve) {
+		for (int i = 0; i < MAX_HIERARCHY_DEPTH; i++)
+			config.depths[i] = i + 1;
+		config.nr_depths = MAX_HIERARCHY_DEPTH;
+	} else if (!config.nr_depths) {
+		config.nr_depths = 3;
+	}
+	for (int i = 0; i < config.nr_depths; i++)
+		if (config.depths[i] < 1 || config.depths[i] > MAX_HIERARCHY_DEPTH) {
+			fprintf(stderr, "Depths go from 1 to %d\n", MAX_HIERARCHY_DEPTH);
+			return -1;
+		}
+	if (config.curve && !config.fanout) {
+		config.fanout = sysconf(_SC_NPROCESSORS_ONLN);
+		if (config.fanout > NUM_THREADS)
+			config.fanout = NUM_THREADS;
+	}
+	if (!config.fanout)
+		config.fanout = 1;
+	if (config.curve && config.fanout <= NUM_THREADS)
+		config.num_threads = config.fanout;
+	if (config.num_threads < 1 || config.num_threads > NUM_THREADS ||
+	    config.fanout < 1 || config.fanout > config.num_threads) {
+		fprintf(stderr, "Need 1 <= leaves <= threads <= %d\n", NUM_THREADS);
+		return -1;
+	}
+	if (config.read_rate < 0 || config.read_rate > 1000000) {
+		fprintf(stderr, "Stat reader rates go from 0 to 1000000\n");
+		return -1;
+	}
+	if (!config.chunk_size || config.chunk_size % getpagesize() ||
+	    config.memory_size < config.chunk_size) {
+		fprintf(stderr, "The chunk size must be a multiple of the page size\n");
+		return -1;
+	}
+	if (config.backend == BACKEND_HUGETLB && config.chunk_size % huge_page_size()) {
+		fprintf(stderr, "hugetlb chunks must be a multiple of %zu KB\n",
+			huge_page_size() / 1024);
+		return -1;
+	}
+	if (config.backend == BACKEND_MALLOC && config.populate) {
+		fprintf(stderr, "populate needs a mapping backend (mmap, hugetlb or thp)\n");
+		return -1;
+	}
+	if (config.backend == BACKEND_MALLOC &&
+	    (config.release == RELEASE_DONTNEED_RANGE || config.release == RELEASE_MUNMAP)) {
+		fprintf(stderr, "%s needs a mapping backend (mmap, hugetlb or thp)\n",
+			release_names[config.release]);
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  * Main function
  */
-int main() {
-	printf("page_counter_uncharge Performance Test\n");
-	printf("=====================================\n");
+int main(int argc, char **argv) {
+	int i;
 
 	/* Setup configuration */
 	strcpy(config.base_path, CGROUP_V2_MOUNT);
 	config.hierarchy_depth = MAX_HIERARCHY_DEPTH;
 	config.num_threads = NUM_THREADS;
+	config.depths[0] = 1;
+	config.depths[1] = 3;
+	config.depths[2] = DEFAULT_DEPTH;
+	config.nr_depths = 0;
+	config.iterations = STRESS_ITERATIONS;
+	config.memory_size = MEMORY_SIZE;
+	config.chunk_size = ALLOCATION_SIZE;
+	config.backend = BACKEND_MALLOC;
+	config.release = RELEASE_DONTNEED;
+	config.pressure_secs = PRESSURE_SECS;
+
+	if (parse_args(argc, argv) < 0) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	printf("page_counter_uncharge Performance Test\n");
+	printf("=====================================\n");
 
 	printf("Using cgroup v2 at %s\n", config.base_path);
-	printf("Test parameters: %lu MB memory, %lu KB chunks, %lu allocations\n",
-		   MEMORY_SIZE / (1024*1024), ALLOCATION_SIZE / 1024, NUM_ALLOCATIONS);
+	printf("Test parameters: %zu MB memory, %zu KB chunks, %zu allocations, %s backend, %s release\n",
+		   config.memory_size / (1024*1024), config.chunk_size / 1024,
+		   config.memory_size / config.chunk_size,
+		   backend_names[config.backend], release_names[config.release]);
 
 	/* Check if we have permissions */
 	if (geteuid() != 0) {
 		printf("Warning: Running as non-root. Some operations may fail.\n");
 	}
 
+	if (config.curve) {
+		test_curve();
+		return 0;
+	}
+
+	if (config.limit) {
+		FILE *swaps = fopen("/proc/swaps", "r");
+		char line[256];
+		int nr_swaps = -1;
+
+		while (swaps && fgets(line, sizeof(line), swaps))
+			nr_swaps++;
+		if (swaps)
+			fclose(swaps);
+		if (nr_swaps <= 0)
+			printf("Warning: no swap, the anon working set cannot be reclaimed\n");
+
+		for (i = 0; i < config.nr_depths; i++)
+			test_pressure(i + 1, config.depths[i]);
+		return 0;
+	}
+
 	/* Run tests */
-	results.single_level_ms = test_single_level();
-	results.shallow_hierarchy_ms = test_shallow_hierarchy();
-	results.deep_hierarchy_ms = test_deep_hierarchy();
-	results.parallel_test_ms = test_parallel_stress();
+	for (i = 0; i < config.nr_depths; i++)
+		test_hierarchy(i + 1, config.depths[i], &results.hierarchy[i]);
+	results.parallel_test_ms = test_parallel_stress(i + 1);
 
 	/* Print results */
 	print_summary();
@@ -0,0 +1,646 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Shared benchmark harness - Library implementation
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#include "bench.h"
+
+/*
+ * Timing
+ */
+uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double cycles_per_ns;
+static pthread_once_t calibrate_once = PTHREAD_ONCE_INIT;
+
+#if defined(__aarch64__)
+static void calibrate(void)
+{
+	uint64_t freq;
+
+	asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+	cycles_per_ns = (freq & 0xffffffff) / 1e9;
+}
+#else
+/*
+ * The TSC frequency is not exposed to userspace, so count ticks against
+ * CLOCK_MONOTONIC for a while. Retry if we migrated in the middle, as the
+ * TSCs of different CPUs are not guaranteed to be in sync.
+ */
+static void calibrate(void)
+{
+	uint64_t t0, t1, c0, c1;
+	int cpu0, cpu1;
+
+	do {
+		cpu0 = sched_getcpu();
+		t0 = bench_now_ns();
+		c0 = bench_cycles_serial();
+		usleep(100 * 1000);
+		t1 = bench_now_ns();
+		c1 = bench_cycles_serial();
+		cpu1 = sched_getcpu();
+	} while (cpu0 != cpu1);
+
+	cycles_per_ns = (double)(c1 - c0) / (t1 - t0);
+}
+#endif
+
+double bench_cycles_per_ns(void)
+{
+	pthread_once(&calibrate_once, calibrate);
+	return cycles_per_ns;
+}
+
+/*
+ * Statistics
+ */
+int bench_cmp_double(const void *a, const void *b)
+{
+	double val_a = *(const double *)a;
+	double val_b = *(const double *)b;
+
+	if (val_a < val_b)
+		return -1;
+	if (val_a > val_b)
+		return 1;
+	return 0;
+}
+
+void bench_sort(double *array, size_t count)
+{
+	qsort(array, count, sizeof(double), bench_cmp_double);
+}
+
+double bench_percentile(const double *sorted, size_t count, double percentile)
+{
+	if (!count)
+		return 0;
+
+	return sorted[(size_t)((percentile / 100.0) * (count - 1))];
+}
+
+/*
+ * Histogram
+ */
+struct bench_hist *bench_hist_alloc(void)
+{
+	struct bench_hist *h = malloc(sizeof(*h));
+
+	if (h)
+		bench_hist_reset(h);
+	return h;
+}
+
+void bench_hist_reset(struct bench_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src)
+{
+	for (size_t i = 0; i < BENCH_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* Smallest value that lands in bucket idx */
+static uint64_t bucket_low(unsigned int idx)
+{
+	unsigned int k, shift;
+
+	if (idx < BENCH_HIST_SUB)
+		return idx;
+
+	k = idx - BENCH_HIST_SUB;
+	shift = k / BENCH_HIST_HALF + 1;
+	return (uint64_t)(k % BENCH_HIST_HALF + BENCH_HIST_HALF) << shift;
+}
+
+static uint64_t bucket_high(unsigned int idx)
+{
+	if (idx < BENCH_HIST_SUB)
+		return idx;
+
+	return bucket_low(idx) + (1ULL << ((idx - BENCH_HIST_SUB) / BENCH_HIST_HALF + 1)) - 1;
+}
+
+uint64_t bench_hist_percentile(const struct bench_hist *h, double percentile)
+{
+	uint64_t target, seen = 0;
+
+	if (!h->count)
+		return 0;
+
+	target = (uint64_t)((percentile / 100.0) * (h->count - 1)) + 1;
+
+	for (unsigned int i = 0; i < BENCH_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen < target)
+			continue;
+
+		/* Middle of the bucket, clamped to what was really seen */
+		uint64_t value = bucket_low(i) + (bucket_high(i) - bucket_low(i)) / 2;
+
+		if (value < h->min)
+			return h->min;
+		if (value > h->max)
+			return h->max;
+		return value;
+	}
+
+	return h->max;
+}
+
+double bench_hist_mean(const struct bench_hist *h)
+{
+	return h->count ? h->sum / h->count : 0;
+}
+
+void bench_hist_dump(FILE *f, const struct bench_hist *h)
+{
+	for (unsigned int i = 0; i < BENCH_HIST_BUCKETS; i++) {
+		if (!h->buckets[i])
+			continue;
+		fprintf(f, "%" PRIu64 " %" PRIu64 " %" PRIu64 "\n", bucket_low(i), bucket_high(i),
+			h->buckets[i]);
+	}
+}
+
+/*
+ * Topology
+ */
+int bench_num_cpus(void)
+{
+	return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+int bench_pin_cpu(int cpu)
+{
+	cpu_set_t mask;
+
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+
+	if (sched_setaffinity(0, sizeof(mask), &mask) == -1) {
+		perror("sched_setaffinity");
+		return -1;
+	}
+	return 0;
+}
+
+static int read_int(const char *path, int fallback)
+{
+	FILE *f = fopen(path, "r");
+	int val;
+
+	if (!f)
+		return fallback;
+	if (fscanf(f, "%d", &val) != 1)
+		val = fallback;
+	fclose(f);
+	return val;
+}
+
+/*
+ * The last level cache is the highest index under cpuN/cache. Use the first
+ * CPU of its shared_cpu_list as the id, cache/indexN/id is not present on
+ * every architecture.
+ */
+static int cpu_llc(int cpu)
+{
+	char path[128];
+	int level, best_level = -1, llc = cpu;
+
+	for (int idx = 0; ; idx++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+			 cpu, idx);
+		level = read_int(path, -1);
+		if (level < 0)
+			break;
+		if (level < best_level)
+			continue;
+
+		best_level = level;
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+			 cpu, idx);
+		llc = read_int(path, cpu);
+	}
+
+	return llc;
+}
+
+static int cpu_node(int cpu)
+{
+	char path[64];
+	struct dirent *de;
+	int node = 0;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	while ((de = readdir(dir))) {
+		if (sscanf(de->d_name, "node%d", &node) == 1)
+			break;
+	}
+	closedir(dir);
+
+	return node;
+}
+
+int bench_cpu_list(int **cpus)
+{
+	cpu_set_t mask;
+	int count = 0;
+
+	if (sched_getaffinity(0, sizeof(mask), &mask)) {
+		perror("sched_getaffinity");
+		return -1;
+	}
+
+	*cpus = malloc(CPU_COUNT(&mask) * sizeof(int));
+	if (!*cpus)
+		return -1;
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &mask))
+			(*cpus)[count++] = cpu;
+
+	return count;
+}
+
+int bench_topology(struct bench_cpu **cpus)
+{
+	char path[128];
+	int *list;
+	int count;
+
+	count = bench_cpu_list(&list);
+	if (count < 0)
+		return -1;
+
+	*cpus = calloc(count, sizeof(struct bench_cpu));
+	if (!*cpus) {
+		free(list);
+		return -1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		struct bench_cpu *c = &(*cpus)[i];
+
+		c->cpu = list[i];
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/core_id", c->cpu);
+		c->core = read_int(path, c->cpu);
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+			 c->cpu);
+		c->package = read_int(path, 0);
+		c->llc = cpu_llc(c->cpu);
+		c->node = cpu_node(c->cpu);
+	}
+
+	free(list);
+	return count;
+}
+
+/*
+ * Worker pool
+ */
+static void *worker_main(void *arg)
+{
+	struct bench_worker *w = arg;
+
+	if (w->cpu >= 0 && bench_pin_cpu(w->cpu))
+		fprintf(stderr, "Worker %d: failed to pin to CPU %d\n",
+			w->id, w->cpu);
+
+	/* Wait for the others to be created, the pool may be torn down */
+	pthread_mutex_lock(&w->pool->creating);
+	pthread_mutex_unlock(&w->pool->creating);
+	if (w->pool->failed)
+		return NULL;
+
+	pthread_barrier_wait(&w->pool->start);
+	w->pool->fn(w);
+
+	return NULL;
+}
+
+struct bench_pool *bench_pool_create(int nr_workers, const int *cpus,
+				     int nr_cpus, bench_worker_fn fn, void *arg)
+{
+	struct bench_pool *pool;
+	int i, ret;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->workers = calloc(nr_workers, sizeof(struct bench_worker));
+	if (!pool->workers) {
+		free(pool);
+		return NULL;
+	}
+
+	pool->nr_workers = nr_workers;
+	pool->fn = fn;
+	/* the workers plus the controlling thread */
+	pthread_barrier_init(&pool->start, NULL, nr_workers + 1);
+	pthread_barrier_init(&pool->sync, NULL, nr_workers);
+	pthread_mutex_init(&pool->creating, NULL);
+	pthread_mutex_lock(&pool->creating);
+
+	for (i = 0; i < nr_workers; i++) {
+		struct bench_worker *w = &pool->workers[i];
+
+		w->id = i;
+		w->cpu = cpus ? cpus[i % nr_cpus] : -1;
+		w->arg = arg;
+		w->pool = pool;
+
+		ret = pthread_create(&w->thread, NULL, worker_main, w);
+		if (ret) {
+			fprintf(stderr, "pthread_create failed: %s\n",
+				strerror(ret));
+			pool->failed = true;
+			pthread_mutex_unlock(&pool->creating);
+			for (int j = 0; j < i; j++)
+				pthread_join(pool->workers[j].thread, NULL);
+			bench_pool_destroy(pool);
+			errno = ret;
+			return NULL;
+		}
+	}
+	pthread_mutex_unlock(&pool->creating);
+
+	return pool;
+}
+
+void bench_pool_start(struct bench_pool *pool)
+{
+	__atomic_store_n(&pool->stop, false, __ATOMIC_RELAXED);
+	pthread_barrier_wait(&pool->start);
+}
+
+void bench_pool_stop(struct bench_pool *pool)
+{
+	__atomic_store_n(&pool->stop, true, __ATOMIC_RELAXED);
+}
+
+void bench_pool_join(struct bench_pool *pool)
+{
+	for (int i = 0; i < pool->nr_workers; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+}
+
+void bench_pool_destroy(struct bench_pool *pool)
+{
+	pthread_barrier_destroy(&pool->start);
+	pthread_barrier_destroy(&pool->sync);
+	pthread_mutex_destroy(&pool->creating);
+	free(pool->workers);
+	free(pool);
+}
+
+uint64_t bench_pool_run_for(struct bench_pool *pool, unsigned int msecs)
+{
+	uint64_t ops = 0;
+
+	bench_pool_start(pool);
+	usleep(msecs * 1000);
+	bench_pool_stop(pool);
+	bench_pool_join(pool);
+
+	for (int i = 0; i < pool->nr_workers; i++)
+		ops += pool->workers[i].ops;
+
+	return ops;
+}
+
+void bench_pool_sync(struct bench_worker *w)
+{
+	pthread_barrier_wait(&w->pool->sync);
+}
+
+/*
+ * Results
+ */
+int bench_parse_format(const char *name)
+{
+	if (!strcmp(name, "text"))
+		return BENCH_FMT_TEXT;
+	if (!strcmp(name, "csv"))
+		return BENCH_FMT_CSV;
+	if (!strcmp(name, "json"))
+		return BENCH_FMT_JSON;
+	return -1;
+}
+
+void bench_result_init(struct bench_result *r, const char *tool,
+		       const char *test)
+{
+	memset(r, 0, sizeof(*r));
+	r->tool = tool;
+	r->test = test;
+	r->threads = 1;
+	r->cpu = -1;
+}
+
+void bench_result_from_hist(struct bench_result *r, const struct bench_hist *h)
+{
+	r->samples = h->count;
+	r->min_ns = h->count ? h->min : 0;
+	r->mean_ns = bench_hist_mean(h);
+	r->p50_ns = bench_hist_percentile(h, 50);
+	r->p90_ns = bench_hist_percentile(h, 90);
+	r->p99_ns = bench_hist_percentile(h, 99);
+	r->max_ns = h->max;
+}
+
+void bench_result_from_sorted(struct bench_result *r, const double *sorted,
+			      size_t count)
+{
+	double sum = 0;
+
+	for (size_t i = 0; i < count; i++)
+		sum += sorted[i];
+
+	r->samples = count;
+	r->min_ns = count ? sorted[0] : 0;
+	r->mean_ns = count ? sum / count : 0;
+	r->p50_ns = bench_percentile(sorted, count, 50);
+	r->p90_ns = bench_percentile(sorted, count, 90);
+	r->p99_ns = bench_percentile(sorted, count, 99);
+	r->max_ns = count ? sorted[count - 1] : 0;
+}
+
+static const char *hostname(void)
+{
+	static struct utsname uts;
+
+	if (!uts.nodename[0])
+		uname(&uts);
+	return uts.nodename;
+}
+
+static const char *kernel_release(void)
+{
+	static struct utsname uts;
+
+	if (!uts.release[0])
+		uname(&uts);
+	return uts.release;
+}
+
+/* Not cached, a run may switch it (vdso_bench -S) */
+static const char *clocksource(void)
+{
+	static char name[32];
+	FILE *f;
+
+	f = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+	if (!f || !fgets(name, sizeof(name), f))
+		snprintf(name, sizeof(name), "unknown");
+	if (f)
+		fclose(f);
+	name[strcspn(name, "\n")] = '\0';
+
+	return name;
+}
+
+void bench_result_header(FILE *f, enum bench_format fmt)
+{
+	if (fmt != BENCH_FMT_CSV)
+		return;
+
+	fprintf(f, "tool,test,mode,config,host,kernel,clocksource,threads,cpu,"
+		   "ops_per_sec,samples,min_ns,mean_ns,p50_ns,p90_ns,p99_ns,max_ns\n");
+}
+
+/* A CSV field, quoted and with inner quotes doubled */
+static void print_csv_str(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; str++) {
+		if (*str == '"')
+			fputc('"', f);
+		fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+/* A JSON string, quoted and escaped */
+static void print_json_str(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+/* The string fields of a record, in CSV column order */
+#define RESULT_STRS	7
+
+static void result_strs(const struct bench_result *r, const char **strs)
+{
+	strs[0] = r->tool;
+	strs[1] = r->test;
+	strs[2] = r->mode ? r->mode : "";
+	strs[3] = r->config ? r->config : "";
+	strs[4] = hostname();
+	strs[5] = kernel_release();
+	strs[6] = clocksource();
+}
+
+void bench_result_print(FILE *f, enum bench_format fmt,
+			const struct bench_result *r)
+{
+	static const char *keys[RESULT_STRS] = {
+		"tool", "test", "mode", "config", "host", "kernel", "clocksource",
+	};
+	const char *strs[RESULT_STRS];
+
+	switch (fmt) {
+	case BENCH_FMT_CSV:
+		result_strs(r, strs);
+		for (int i = 0; i < RESULT_STRS; i++) {
+			print_csv_str(f, strs[i]);
+			fputc(',', f);
+		}
+		fprintf(f, "%d,%d,%.2f,%" PRIu64 ",%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+			r->threads, r->cpu, r->ops_per_sec, r->samples,
+			r->min_ns, r->mean_ns, r->p50_ns, r->p90_ns, r->p99_ns,
+			r->max_ns);
+		break;
+	case BENCH_FMT_JSON:
+		result_strs(r, strs);
+		fputc('{', f);
+		for (int i = 0; i < RESULT_STRS; i++) {
+			fprintf(f, "\"%s\": ", keys[i]);
+			print_json_str(f, strs[i]);
+			fputs(", ", f);
+		}
+		fprintf(f, "\"threads\": %d, \"cpu\": %d, "
+			   "\"ops_per_sec\": %.2f, \"samples\": %" PRIu64 ", "
+			   "\"min_ns\": %.2f, \"mean_ns\": %.2f, \"p50_ns\": %.2f, "
+			   "\"p90_ns\": %.2f, \"p99_ns\": %.2f, \"max_ns\": %.2f}\n",
+			r->threads, r->cpu, r->ops_per_sec, r->samples,
+			r->min_ns, r->mean_ns, r->p50_ns, r->p90_ns, r->p99_ns,
+			r->max_ns);
+		break;
+	default:
+		fprintf(f, "%-24s threads=%d", r->test, r->threads);
+		if (r->cpu >= 0)
+			fprintf(f, " cpu=%d", r->cpu);
+		if (r->mode)
+			fprintf(f, " %s", r->mode);
+		if (r->config)
+			fprintf(f, " [%s]", r->config);
+		if (r->ops_per_sec)
+			fprintf(f, "\t%.2f M/s", r->ops_per_sec / 1e6);
+		fprintf(f, "\tmin=%.2f\tp50=%.2f\tp90=%.2f\tp99=%.2f\tmax=%.2f ns\n",
+			r->min_ns, r->p50_ns, r->p90_ns, r->p99_ns, r->max_ns);
+		break;
+	}
+}
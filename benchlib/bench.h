@@ -0,0 +1,246 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Shared benchmark harness - Library header
+ *
+ * Helpers used by the microbenchmarks in this repository, so their numbers
+ * are collected and reported the same way:
+ *
+ *  - raw counter timing (TSC / CNTVCT_EL0) with a calibrated ns conversion
+ *  - HDR style log-linear latency histograms
+ *  - a pool of pinned workers released together by a start barrier
+ *  - CPU topology discovery (core, package, LLC, NUMA node)
+ *  - a common result record printed as text, CSV or JSON lines
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * Timing
+ */
+
+/* CLOCK_MONOTONIC in ns */
+uint64_t bench_now_ns(void);
+
+/* Raw counter read, may be reordered with the surrounding code */
+static inline uint64_t bench_cycles(void)
+{
+#if defined(__aarch64__)
+	uint64_t val;
+
+	asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+	return val;
+#elif defined(__x86_64__)
+	uint32_t lo, hi;
+
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+#else
+	return bench_now_ns();
+#endif
+}
+
+/* Raw counter read that waits for the previous instructions to complete */
+static inline uint64_t bench_cycles_serial(void)
+{
+#if defined(__aarch64__)
+	uint64_t val;
+
+	asm volatile("isb" : : : "memory");
+	asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+	return val;
+#elif defined(__x86_64__)
+	uint32_t lo, hi, cpu;
+
+	asm volatile("rdtscp" : "=a"(lo), "=d"(hi), "=c"(cpu) : : "memory");
+	asm volatile("lfence" : : : "memory");
+	return ((uint64_t)hi << 32) | lo;
+#else
+	return bench_now_ns();
+#endif
+}
+
+/* Counter ticks per ns, calibrated on first use */
+double bench_cycles_per_ns(void);
+
+static inline double bench_cycles_to_ns(uint64_t cycles)
+{
+	return cycles / bench_cycles_per_ns();
+}
+
+/*
+ * Statistics on arrays of samples
+ */
+int bench_cmp_double(const void *a, const void *b);
+void bench_sort(double *array, size_t count);
+/* array must be sorted, percentile in [0, 100] */
+double bench_percentile(const double *sorted, size_t count, double percentile);
+
+/*
+ * HDR style histogram: values below BENCH_HIST_SUB are exact, larger ones
+ * are kept with BENCH_HIST_SUB_BITS - 1 bits of precision (< 1.6% error).
+ * Recording is a couple of instructions, so it can sit in the measured loop.
+ * Values are in whatever unit the caller records, usually ns.
+ */
+#define BENCH_HIST_SUB_BITS	7
+#define BENCH_HIST_SUB		(1UL << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_HALF		(BENCH_HIST_SUB / 2)
+#define BENCH_HIST_BUCKETS	(BENCH_HIST_SUB + \
+				 (64 - BENCH_HIST_SUB_BITS) * BENCH_HIST_HALF)
+
+struct bench_hist {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	double sum;
+	uint64_t buckets[BENCH_HIST_BUCKETS];
+};
+
+struct bench_hist *bench_hist_alloc(void);
+void bench_hist_reset(struct bench_hist *h);
+void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src);
+uint64_t bench_hist_percentile(const struct bench_hist *h, double percentile);
+double bench_hist_mean(const struct bench_hist *h);
+/* Print non-empty buckets as "<low> <high> <count>" lines */
+void bench_hist_dump(FILE *f, const struct bench_hist *h);
+
+static inline unsigned int bench_hist_index(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < BENCH_HIST_SUB)
+		return value;
+
+	/* value >> shift lands in [BENCH_HIST_HALF, BENCH_HIST_SUB) */
+	shift = 64 - __builtin_clzll(value) - BENCH_HIST_SUB_BITS;
+	return BENCH_HIST_SUB + (shift - 1) * BENCH_HIST_HALF +
+	       ((value >> shift) - BENCH_HIST_HALF);
+}
+
+static inline void bench_hist_record(struct bench_hist *h, uint64_t value)
+{
+	h->buckets[bench_hist_index(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+/*
+ * CPU topology
+ */
+struct bench_cpu {
+	int cpu;
+	int core;	/* topology/core_id */
+	int package;	/* topology/physical_package_id */
+	int llc;	/* first CPU sharing the last level cache */
+	int node;	/* NUMA node, 0 without NUMA */
+};
+
+int bench_num_cpus(void);
+/* CPUs this process may run on, returns the count or -1 */
+int bench_topology(struct bench_cpu **cpus);
+int bench_pin_cpu(int cpu);
+
+/*
+ * Worker pool: workers are created, pinned and then wait on a barrier, so
+ * thread creation and migration are not part of the measurement.
+ */
+struct bench_pool;
+
+struct bench_worker {
+	int id;
+	int cpu;		/* -1 when not pinned */
+	void *arg;		/* shared argument given to bench_pool_create() */
+	void *priv;		/* per worker data, owned by the caller */
+	uint64_t ops;		/* operations done, filled by the worker */
+	struct bench_pool *pool;
+	pthread_t thread;
+};
+
+typedef void (*bench_worker_fn)(struct bench_worker *w);
+
+struct bench_pool {
+	int nr_workers;
+	struct bench_worker *workers;
+	bench_worker_fn fn;
+	pthread_barrier_t start;
+	pthread_barrier_t sync;
+	pthread_mutex_t creating;	/* held until every worker exists */
+	bool failed;			/* a worker could not be created */
+	volatile bool stop;
+};
+
+/*
+ * Create nr_workers threads running fn. Worker i is pinned to
+ * cpus[i % nr_cpus], or not pinned at all when cpus is NULL. Returns NULL,
+ * with the workers already created joined, when one cannot be created.
+ */
+struct bench_pool *bench_pool_create(int nr_workers, const int *cpus,
+				     int nr_cpus, bench_worker_fn fn, void *arg);
+/* Release all workers at once */
+void bench_pool_start(struct bench_pool *pool);
+void bench_pool_stop(struct bench_pool *pool);
+void bench_pool_join(struct bench_pool *pool);
+void bench_pool_destroy(struct bench_pool *pool);
+/* start, sleep msecs, stop and join, returns the sum of the workers' ops */
+uint64_t bench_pool_run_for(struct bench_pool *pool, unsigned int msecs);
+/* Barrier between the workers only, for multi phase benchmarks */
+void bench_pool_sync(struct bench_worker *w);
+
+static inline bool bench_pool_stopping(struct bench_worker *w)
+{
+	return __atomic_load_n(&w->pool->stop, __ATOMIC_RELAXED);
+}
+
+/* Fill cpus with the allowed CPUs, one per entry, returns the count */
+int bench_cpu_list(int **cpus);
+
+/*
+ * Results: every tool reports the same record, so output from different
+ * tools can be concatenated and compared.
+ */
+enum bench_format {
+	BENCH_FMT_TEXT = 0,
+	BENCH_FMT_CSV,
+	BENCH_FMT_JSON,
+};
+
+struct bench_result {
+	const char *tool;	/* sbench, vdso_bench, ... */
+	const char *test;	/* getpid, CLOCK_MONOTONIC, LSE (stadd), ... */
+	const char *mode;	/* how the test was served (vdso, syscall, ...), or NULL */
+	const char *config;	/* system setup it ran under (clocksource, ...), or NULL */
+	int threads;
+	int cpu;		/* -1 for results aggregated across CPUs */
+	double ops_per_sec;	/* per thread, 0 when not measured */
+	uint64_t samples;
+	double min_ns;
+	double mean_ns;
+	double p50_ns;
+	double p90_ns;
+	double p99_ns;
+	double max_ns;
+};
+
+/* "text", "csv" or "json", returns -1 otherwise */
+int bench_parse_format(const char *name);
+void bench_result_init(struct bench_result *r, const char *tool,
+		       const char *test);
+void bench_result_from_hist(struct bench_result *r, const struct bench_hist *h);
+void bench_result_from_sorted(struct bench_result *r, const double *sorted,
+			      size_t count);
+/* CSV header, nothing for the other formats */
+void bench_result_header(FILE *f, enum bench_format fmt);
+void bench_result_print(FILE *f, enum bench_format fmt,
+			const struct bench_result *r);
+
+#endif /* BENCH_H */
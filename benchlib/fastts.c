@@ -0,0 +1,162 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Fast timestamps - Library implementation
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fastts.h"
+
+#define NSEC_PER_SEC	1000000000ULL
+/* Same as the kernel clocksources, the conversion must not overflow before */
+#define FASTTS_MAXSEC	600
+
+struct fastts fastts;
+
+static pthread_mutex_t resync_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t resync_ns;
+static uint64_t max_cycles;	/* largest delta mult and shift can convert */
+
+/* As clocks_calc_mult_shift() in kernel/time/clocksource.c */
+void fastts_calc_mult_shift(uint32_t *mult, uint32_t *shift, uint32_t from,
+			    uint32_t to, uint32_t maxsec)
+{
+	uint64_t tmp;
+	uint32_t sft, sftacc = 32;
+
+	/* How many bits the largest delta, maxsec worth of from, needs */
+	tmp = ((uint64_t)maxsec * from) >> 32;
+	while (tmp) {
+		tmp >>= 1;
+		sftacc--;
+	}
+
+	/* Largest shift whose mult still fits in sftacc bits */
+	for (sft = 32; sft > 0; sft--) {
+		tmp = (uint64_t)to << sft;
+		tmp += from / 2;
+		tmp /= from;
+		if ((tmp >> sftacc) == 0)
+			break;
+	}
+
+	*mult = tmp;
+	*shift = sft;
+}
+
+/*
+ * A (cycles, CLOCK_MONOTONIC) pair. The counter is read on both sides of
+ * clock_gettime() and the tightest of a few tries is kept, the pair error
+ * is half of that window.
+ */
+static void sample(uint64_t *cycles, uint64_t *ns)
+{
+	uint64_t best = UINT64_MAX;
+
+	for (int i = 0; i < 8; i++) {
+		uint64_t c0, c1, now;
+
+		c0 = bench_cycles_serial();
+		now = bench_now_ns();
+		c1 = bench_cycles_serial();
+
+		if (c1 - c0 < best) {
+			best = c1 - c0;
+			*cycles = c0 + (c1 - c0) / 2;
+			*ns = now;
+		}
+	}
+}
+
+static uint32_t freq_mult(uint64_t freq)
+{
+	return (((uint64_t)NSEC_PER_SEC << fastts.shift) + freq / 2) / freq;
+}
+
+static void fastts_update(uint32_t mult, uint64_t cycles, uint64_t ns)
+{
+	__atomic_store_n(&fastts.seq, fastts.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	fastts.mult = mult;
+	fastts.base_cycles = cycles;
+	fastts.base_ns = ns;
+	__atomic_store_n(&fastts.seq, fastts.seq + 1, __ATOMIC_RELEASE);
+}
+
+int fastts_init(unsigned int resync_ms)
+{
+	uint64_t freq = bench_cycles_per_ns() * NSEC_PER_SEC;
+	uint64_t khz = (freq + 500) / 1000;
+	uint32_t mult, shift, maxsec = FASTTS_MAXSEC;
+	uint64_t cycles, ns;
+
+	if (!khz || khz > UINT32_MAX || !resync_ms)
+		return -1;
+
+	if (maxsec < 2 * resync_ms / 1000)
+		maxsec = 2 * resync_ms / 1000;
+	/* In kHz like clocksource_register_khz(), Hz overflows above 4.29 GHz */
+	fastts_calc_mult_shift(&mult, &shift, khz, NSEC_PER_SEC / 1000, maxsec * 1000);
+
+	pthread_mutex_lock(&resync_lock);
+	sample(&cycles, &ns);
+	resync_ns = resync_ms * 1000000ULL;
+	fastts.shift = shift;
+	fastts.resync_cycles = resync_ns * bench_cycles_per_ns();
+	max_cycles = maxsec * freq;
+	fastts.sync_cycles = cycles;
+	fastts.sync_ns = ns;
+	fastts_update(mult, cycles, ns);
+	pthread_mutex_unlock(&resync_lock);
+
+	return 0;
+}
+
+/*
+ * Measure the counter frequency since the last resync and aim mult at
+ * closing the current error over the next interval, like NTP slews the
+ * kernel clock. The conversion stays continuous at the new base.
+ */
+void fastts_resync(void)
+{
+	uint64_t cycles, mono, ns, freq;
+	int64_t err;
+	uint32_t mult;
+
+	if (pthread_mutex_trylock(&resync_lock))
+		return;
+
+	sample(&cycles, &mono);
+	/* Someone else got here first */
+	if (cycles - fastts.base_cycles < fastts.resync_cycles ||
+	    mono <= fastts.sync_ns) {
+		pthread_mutex_unlock(&resync_lock);
+		return;
+	}
+
+	ns = fastts.base_ns +
+	     (((cycles - fastts.base_cycles) * fastts.mult) >> fastts.shift);
+	err = mono - ns;
+
+	freq = (cycles - fastts.sync_cycles) * (double)NSEC_PER_SEC /
+	       (mono - fastts.sync_ns);
+	mult = freq_mult(freq);
+	fastts.sync_cycles = cycles;
+	fastts.sync_ns = mono;
+
+	/* After a long gap ns overflowed, step */
+	if (cycles - fastts.base_cycles >= max_cycles ||
+	    llabs(err) > FASTTS_MAX_SLEW_NS) {
+		fastts_update(mult, cycles, mono);
+	} else {
+		mult = mult * (double)(resync_ns + err) / resync_ns;
+		fastts_update(mult, cycles, ns);
+	}
+
+	pthread_mutex_unlock(&resync_lock);
+}
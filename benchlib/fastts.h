@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Fast timestamps - Library header
+ *
+ * CLOCK_MONOTONIC-like ns timestamps straight from the raw counter (TSC /
+ * CNTVCT_EL0), without the vDSO. The counter is converted like the kernel
+ * does it, ns = base_ns + ((cycles - base_cycles) * mult) >> shift, and the
+ * conversion is resynced against CLOCK_MONOTONIC every resync interval.
+ * Resyncs slew mult so the timestamps stay continuous, unless the error is
+ * above FASTTS_MAX_SLEW_NS, then they step.
+ *
+ * Assumes a constant rate counter in sync across CPUs (invariant TSC, arm
+ * generic timer).
+ */
+
+#ifndef FASTTS_H
+#define FASTTS_H
+
+#include <stdint.h>
+
+#include "bench.h"
+
+#define FASTTS_MAX_SLEW_NS	1000000
+
+struct fastts {
+	uint32_t seq;		/* odd while a resync updates the fields below */
+	uint32_t mult;
+	uint32_t shift;
+	uint64_t base_cycles;
+	uint64_t base_ns;
+	uint64_t resync_cycles;	/* resync once a read is this far from base */
+	/* last CLOCK_MONOTONIC sample, to measure the counter frequency */
+	uint64_t sync_cycles;
+	uint64_t sync_ns;
+};
+
+extern struct fastts fastts;
+
+/* Calibrate, resync_ms is the resync interval. Returns 0 or -1 */
+int fastts_init(unsigned int resync_ms);
+/* Resync now, a no-op if another thread is already doing it */
+void fastts_resync(void);
+/*
+ * Compute mult and shift converting rate from to rate to, for deltas up to
+ * maxsec. fastts_init() passes kHz and ms like clocksource_register_khz(),
+ * so counters above 4.29 GHz still fit
+ */
+void fastts_calc_mult_shift(uint32_t *mult, uint32_t *shift, uint32_t from,
+			    uint32_t to, uint32_t maxsec);
+
+static inline uint64_t fastts_cycles_to_ns(uint64_t cycles)
+{
+	uint64_t delta, ns;
+	uint32_t seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&fastts.seq, __ATOMIC_ACQUIRE);
+		delta = cycles - fastts.base_cycles;
+		/* delta * mult is only safe up to FASTTS_MAXSEC, rebase first */
+		if (!(seq & 1) && (int64_t)delta > (int64_t)fastts.resync_cycles) {
+			fastts_resync();
+			continue;
+		}
+		/* cycles read before a concurrent resync moved base */
+		if ((int64_t)delta < 0)
+			ns = fastts.base_ns - ((-delta * fastts.mult) >> fastts.shift);
+		else
+			ns = fastts.base_ns + ((delta * fastts.mult) >> fastts.shift);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!(seq & 1) && seq == __atomic_load_n(&fastts.seq, __ATOMIC_RELAXED))
+			return ns;
+	}
+}
+
+/* A counter delta in ns, for deltas below the resync interval or so */
+static inline uint64_t fastts_delta_ns(uint64_t cycles)
+{
+	return (cycles * fastts.mult) >> fastts.shift;
+}
+
+/* Unserialised read, may be reordered with the surrounding code */
+static inline uint64_t fastts_ns(void)
+{
+	return fastts_cycles_to_ns(bench_cycles());
+}
+
+/* Waits for the previous instructions before reading the counter */
+static inline uint64_t fastts_ns_serial(void)
+{
+	return fastts_cycles_to_ns(bench_cycles_serial());
+}
+
+#endif /* FASTTS_H */
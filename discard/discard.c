@@ -1,3 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * File churn benchmark, to see what online discard (-o discard) and
+ * periodic fstrim do to create/unlink heavy services.
+ *
+ * A pool of workers creates files, writes them, makes them durable as the
+ * policy says and deletes them again, round after round. Every create,
+ * write(), sync, close and unlink is timed into a per operation histogram,
+ * and so is every file from create to unlink ("chain").
+ *
+ * The defaults are the old fixed workload: 100 threads, one ~4 KB file
+ * each per round written 36 bytes at a time, a sync() every 1000 files.
+ */
+
 #include <stdio.h>
 #include <pthread.h>
 #include <stdlib.h> //exit
@@ -5,74 +19,768 @@
 #include <unistd.h> // write
 #include <stdbool.h> // bool
 #include <string.h> // strdup
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
+#include "bench.h"
 
 #define MAXPATH 1024
 #define THREADS 100
-#define SYNC_AFTER_FILES 1000/THREADS
+#define SYNC_AFTER_FILES 1000
+#define DURATION_MS 10000
 
-char *dstdir = "/tmp";
+enum op {
+	OP_CREATE,
+	OP_WRITE,
+	OP_SYNC,
+	OP_CLOSE,
+	OP_UNLINK,
+	OP_CHAIN,		/* a whole file, create to unlink */
+	NR_OPS,
+};
 
-void *do_it(void *ptr)
-{
-	const int buffer[] = {1,2,3,4,5,6,7,8,9};
-	int sz = 4096 / sizeof(buffer) + 1;
-	char filename[MAXPATH];
+static const char *op_names[NR_OPS] = {
+	"create", "write", "sync", "close", "unlink", "chain",
+};
+
+enum policy {
+	POLICY_NONE,
+	POLICY_FSYNC,		/* per file */
+	POLICY_FDATASYNC,	/* per file */
+	POLICY_SYNC_FILE_RANGE,	/* per file, write and wait */
+	POLICY_SYNCFS,		/* every sync_every files */
+	POLICY_SYNC,		/* sync() every sync_every files */
+	NR_POLICIES,
+};
+
+static const char *policy_names[NR_POLICIES] = {
+	"none", "fsync", "fdatasync", "sync_file_range", "syncfs", "sync",
+};
+
+struct config {
+	char *dstdir;
+	int threads;
+	size_t file_size;
+	size_t write_size;
+	int files;		/* per thread per round */
+	int fanout;		/* subdirectories, 0 for dstdir itself */
+	bool tmpfile;		/* O_TMPFILE, nothing to unlink */
+	enum policy policy;
+	unsigned long sync_every;
+	unsigned int msecs;
+	enum bench_format fmt;
+	int engine;		/* ENGINE_SYNC, ENGINE_URING or both */
+	unsigned int queue_depth;	/* io_uring chains in flight per worker */
+	bool sqpoll;
+};
+
+#define ENGINE_SYNC	(1 << 0)
+#define ENGINE_URING	(1 << 1)
+
+static struct config config = {
+	.dstdir = "/tmp",
+	.threads = THREADS,
+	.file_size = 4096,
+	.write_size = 36,
+	.files = 1,
+	.policy = POLICY_SYNC,
+	.sync_every = SYNC_AFTER_FILES,
+	.msecs = DURATION_MS,
+	.engine = ENGINE_SYNC,
+	.queue_depth = 32,
+};
+
+/* Files done by all the workers, for the periodic sync policies */
+static unsigned long files_done;
+/* dstdir, for syncfs() */
+static int dir_fd;
+
+struct file {
+	char name[MAXPATH + 16];
 	int fd;
+	uint64_t start;
+};
 
-	snprintf(filename, MAXPATH, "%s/tmp_XXXXXX", dstdir);
+struct worker_stats {
+	struct bench_hist *hist[NR_OPS];
+	struct file *files;
+	char *buf;
+};
+
+static char *worker_dir(int id, char *dir, size_t len)
+{
+	if (config.fanout)
+		snprintf(dir, len, "%s/discard.%d", config.dstdir, id % config.fanout);
+	else
+		snprintf(dir, len, "%s", config.dstdir);
+	return dir;
+}
 
-	fd = mkstemp(filename);
-	if (fd < 0){
+/* Time one call into the op histogram, returns what the call returned */
+#define TIMED(stats, op, call) ({					\
+	uint64_t __start = bench_now_ns();				\
+	long __ret = (call);						\
+	bench_hist_record((stats)->hist[op], bench_now_ns() - __start);	\
+	__ret;								\
+})
+
+static void create_file(struct bench_worker *w, struct file *f, int i)
+{
+	struct worker_stats *stats = w->priv;
+	char dir[MAXPATH];
+
+	worker_dir(w->id + i, dir, sizeof(dir));
+	if (config.tmpfile) {
+		f->fd = TIMED(stats, OP_CREATE, open(dir, O_TMPFILE | O_WRONLY, 0600));
+	} else {
+		snprintf(f->name, sizeof(f->name), "%s/tmp_XXXXXX", dir);
+		f->fd = TIMED(stats, OP_CREATE, mkstemp(f->name));
+	}
+
+	if (f->fd < 0) {
 		perror("Failed to open tmp file");
 		exit(1);
 	}
+}
+
+static void write_file(struct worker_stats *stats, struct file *f)
+{
+	size_t left = config.file_size;
+
+	while (left) {
+		size_t len = left < config.write_size ? left : config.write_size;
+
+		if (TIMED(stats, OP_WRITE, write(f->fd, stats->buf, len)) != (long)len) {
+			perror("write");
+			exit(1);
+		}
+		left -= len;
+	}
+}
+
+static void sync_file(struct worker_stats *stats, struct file *f)
+{
+	switch (config.policy) {
+	case POLICY_FSYNC:
+		TIMED(stats, OP_SYNC, fsync(f->fd));
+		break;
+	case POLICY_FDATASYNC:
+		TIMED(stats, OP_SYNC, fdatasync(f->fd));
+		break;
+	case POLICY_SYNC_FILE_RANGE:
+		TIMED(stats, OP_SYNC, sync_file_range(f->fd, 0, 0,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER));
+		break;
+	default:
+		break;
+	}
+}
+
+/* Whoever completes the sync_every-th file syncs for everybody */
+static void sync_periodic(struct worker_stats *stats, int files)
+{
+	unsigned long before, after;
+
+	if (config.policy != POLICY_SYNCFS && config.policy != POLICY_SYNC)
+		return;
+
+	after = __atomic_add_fetch(&files_done, files, __ATOMIC_RELAXED);
+	before = after - files;
+	if (before / config.sync_every == after / config.sync_every)
+		return;
+
+	if (config.policy == POLICY_SYNCFS)
+		TIMED(stats, OP_SYNC, syncfs(dir_fd));
+	else
+		TIMED(stats, OP_SYNC, (sync(), 0));
+}
+
+static void do_it(struct bench_worker *w)
+{
+	struct worker_stats *stats = w->priv;
+	int i;
+
+	while (!bench_pool_stopping(w)) {
+		for (i = 0; i < config.files; i++) {
+			struct file *f = &stats->files[i];
+
+			f->start = bench_now_ns();
+			create_file(w, f, i);
+			write_file(stats, f);
+			sync_file(stats, f);
+		}
+
+		sync_periodic(stats, config.files);
+
+		for (i = 0; i < config.files; i++) {
+			struct file *f = &stats->files[i];
+
+			TIMED(stats, OP_CLOSE, close(f->fd));
+			if (!config.tmpfile)
+				TIMED(stats, OP_UNLINK, unlink(f->name));
+			bench_hist_record(stats->hist[OP_CHAIN], bench_now_ns() - f->start);
+		}
+
+		w->ops += config.files;
+	}
+}
+
+/*
+ * io_uring engine: every file is one linked chain, openat (into a fixed
+ * file slot) -> write(s) on the fixed file -> fsync/sync_file_range ->
+ * close -> unlinkat, and a worker keeps queue_depth chains in flight on
+ * its own ring. The rings are driven with the raw syscalls, no liburing.
+ *
+ * The ops of a chain run back to back in the kernel and their completions
+ * are reaped together, so only the whole chain is timed: "chain", from
+ * submission to the last completion, next to create to unlink of the
+ * synchronous engine.
+ */
+#define MAX_CHAIN	256
+
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int sq_entries;
+	unsigned int tail;		/* local SQ tail, published on submit */
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+struct chain {
+	char name[MAXPATH + 32];
+	uint64_t submitted;
+	int nr_ops;
+	int done;
+	enum op ops[MAX_CHAIN];
+};
+
+static int uring_setup(struct uring *ring, unsigned int entries, unsigned int slots)
+{
+	struct io_uring_rsrc_register reg = {
+		.nr = slots,
+		.flags = IORING_RSRC_REGISTER_SPARSE,
+	};
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	if (config.sqpoll) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 100;
+	}
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -1;
+	if (p.sq_entries < entries) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+	    ring->sqes == MAP_FAILED)
+		return -1;
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_flags = ring->sq_ring + p.sq_off.flags;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	ring->sq_entries = p.sq_entries;
+	ring->tail = *ring->sq_tail;
+
+	/* An empty fixed file table, openat fills the slots */
+	return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES2,
+		       &reg, sizeof(reg)) < 0 ? -1 : 0;
+}
+
+static void uring_exit(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *ring, uint64_t user_data,
+				      unsigned char opcode, unsigned char flags)
+{
+	unsigned int index = ring->tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->flags = flags;
+	sqe->user_data = user_data;
+	ring->sq_array[index] = index;
+	ring->tail++;
+
+	return sqe;
+}
+
+static int uring_submit(struct uring *ring, unsigned int wait)
+{
+	unsigned int submit = ring->tail - *ring->sq_tail;
+	unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
 
-	/* printf("filename=%s sizeof=%d\n", filename, sizeof(buffer)); */
-	while (sz--)
-		write(fd, &buffer, sizeof(buffer));
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+	if (config.sqpoll) {
+		if (__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		else if (!wait)
+			return 0;
+		submit = 0;
+	}
+
+	return syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags, NULL, 0);
+}
 
-	close(fd);
-	unlink(filename);
+/* Ops queue_chain() links for one file, must stay in sync with it */
+static unsigned int chain_ops(void)
+{
+	unsigned int n = 2;		/* open, close */
 
-	return NULL;
+	n += (config.file_size + config.write_size - 1) / config.write_size;
+	if (config.policy == POLICY_FSYNC || config.policy == POLICY_FDATASYNC ||
+	    config.policy == POLICY_SYNC_FILE_RANGE)
+		n++;
+	if (!config.tmpfile)
+		n++;			/* unlink */
+	return n;
 }
 
+/* Queue the chain of file slot */
+static void queue_chain(struct bench_worker *w, struct uring *ring,
+			struct chain *chain, unsigned int slot, unsigned long seq)
+{
+	struct worker_stats *stats = w->priv;
+	uint64_t data = (uint64_t)slot << 32;
+	struct io_uring_sqe *sqe;
+	char dir[MAXPATH];
+	size_t off;
+	int n = 0;
+
+	worker_dir(w->id + seq, dir, sizeof(dir));
+	sqe = uring_sqe(ring, data | n, IORING_OP_OPENAT, IOSQE_IO_LINK);
+	sqe->fd = AT_FDCWD;
+	sqe->len = 0600;
+	sqe->file_index = slot + 1;
+	if (config.tmpfile) {
+		sqe->addr = (unsigned long)strcpy(chain->name, dir);
+		sqe->open_flags = O_TMPFILE | O_WRONLY;
+	} else {
+		snprintf(chain->name, sizeof(chain->name), "%s/uring_%d_%lu", dir, w->id, seq);
+		sqe->addr = (unsigned long)chain->name;
+		sqe->open_flags = O_CREAT | O_EXCL | O_WRONLY;
+	}
+	chain->ops[n++] = OP_CREATE;
+
+	for (off = 0; off < config.file_size; off += config.write_size) {
+		size_t len = config.file_size - off;
+
+		sqe = uring_sqe(ring, data | n, IORING_OP_WRITE,
+				IOSQE_IO_LINK | IOSQE_FIXED_FILE);
+		sqe->fd = slot;
+		sqe->addr = (unsigned long)stats->buf;
+		sqe->len = len < config.write_size ? len : config.write_size;
+		sqe->off = off;
+		chain->ops[n++] = OP_WRITE;
+	}
+
+	if (config.policy == POLICY_FSYNC || config.policy == POLICY_FDATASYNC) {
+		sqe = uring_sqe(ring, data | n, IORING_OP_FSYNC,
+				IOSQE_IO_LINK | IOSQE_FIXED_FILE);
+		sqe->fd = slot;
+		if (config.policy == POLICY_FDATASYNC)
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		chain->ops[n++] = OP_SYNC;
+	} else if (config.policy == POLICY_SYNC_FILE_RANGE) {
+		sqe = uring_sqe(ring, data | n, IORING_OP_SYNC_FILE_RANGE,
+				IOSQE_IO_LINK | IOSQE_FIXED_FILE);
+		sqe->fd = slot;
+		sqe->sync_range_flags = SYNC_FILE_RANGE_WAIT_BEFORE |
+					SYNC_FILE_RANGE_WRITE |
+					SYNC_FILE_RANGE_WAIT_AFTER;
+		chain->ops[n++] = OP_SYNC;
+	}
+
+	sqe = uring_sqe(ring, data | n, IORING_OP_CLOSE,
+			config.tmpfile ? 0 : IOSQE_IO_LINK);
+	sqe->file_index = slot + 1;
+	chain->ops[n++] = OP_CLOSE;
+
+	if (!config.tmpfile) {
+		sqe = uring_sqe(ring, data | n, IORING_OP_UNLINKAT, 0);
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long)chain->name;
+		chain->ops[n++] = OP_UNLINK;
+	}
+
+	chain->nr_ops = n;
+	chain->done = 0;
+	chain->submitted = bench_now_ns();
+}
+
+/* Reap completions, returns the number of chains that finished */
+static int reap_chains(struct bench_worker *w, struct uring *ring,
+		       struct chain *chains, unsigned int *free_slots,
+		       unsigned int *nr_free)
+{
+	struct worker_stats *stats = w->priv;
+	unsigned int head = *ring->cq_head;
+	uint64_t now = bench_now_ns();
+	int finished = 0;
+
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		unsigned int slot = cqe->user_data >> 32;
+		struct chain *chain = &chains[slot];
+		enum op op = chain->ops[(uint32_t)cqe->user_data];
+
+		if (cqe->res < 0 && cqe->res != -ECANCELED) {
+			fprintf(stderr, "io_uring %s: %s\n", op_names[op], strerror(-cqe->res));
+			exit(1);
+		}
+
+		if (++chain->done == chain->nr_ops) {
+			bench_hist_record(stats->hist[OP_CHAIN], now - chain->submitted);
+			free_slots[(*nr_free)++] = slot;
+			finished++;
+		}
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return finished;
+}
+
+static void do_it_uring(struct bench_worker *w)
+{
+	unsigned int slots = config.queue_depth, nr_free = 0, inflight = 0;
+	unsigned int chain_len = chain_ops();
+	unsigned int free_slots[slots];
+	struct chain *chains;
+	struct uring ring;
+	unsigned long seq = 0;
+	int ret;
+
+	chains = calloc(slots, sizeof(*chains));
+	if (!chains || uring_setup(&ring, slots * chain_len, slots)) {
+		fprintf(stderr, "io_uring setup failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	for (unsigned int i = 0; i < slots; i++)
+		free_slots[nr_free++] = slots - 1 - i;
+
+	while (!bench_pool_stopping(w) || inflight) {
+		unsigned int queued = 0;
+		int finished;
+
+		while (nr_free && !bench_pool_stopping(w)) {
+			unsigned int slot = free_slots[--nr_free];
+
+			queue_chain(w, &ring, &chains[slot], slot, seq++);
+			queued++;
+		}
+		inflight += queued;
+
+		do {
+			ret = uring_submit(&ring, 1);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0) {
+			perror("io_uring_enter");
+			exit(1);
+		}
+
+		finished = reap_chains(w, &ring, chains, free_slots, &nr_free);
+		inflight -= finished;
+		w->ops += finished;
+		sync_periodic(w->priv, finished);
+	}
+
+	uring_exit(&ring);
+	free(chains);
+}
+
+static int setup_dirs(void)
+{
+	char dir[MAXPATH];
+
+	for (int i = 0; i < config.fanout; i++) {
+		worker_dir(i, dir, sizeof(dir));
+		if (mkdir(dir, 0755) && errno != EEXIST) {
+			fprintf(stderr, "Failed to create %s: %s\n", dir, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void cleanup_dirs(void)
+{
+	char dir[MAXPATH];
+
+	for (int i = 0; i < config.fanout; i++)
+		rmdir(worker_dir(i, dir, sizeof(dir)));
+}
+
+static void print_results(struct bench_pool *pool, uint64_t files, int engine)
+{
+	char setup[256], engine_name[64];
+
+	if (engine == ENGINE_URING)
+		snprintf(engine_name, sizeof(engine_name), "uring qd=%u%s",
+			 config.queue_depth, config.sqpoll ? " sqpoll" : "");
+	else
+		snprintf(engine_name, sizeof(engine_name), "sync files=%d", config.files);
+	snprintf(setup, sizeof(setup), "%s size=%zu write=%zu fanout=%d%s",
+		 engine_name, config.file_size, config.write_size, config.fanout,
+		 config.tmpfile ? " tmpfile" : "");
+
+	if (config.fmt == BENCH_FMT_TEXT)
+		printf("%s: %lu files in %u ms, %.0f files/s\n", engine_name, files,
+		       config.msecs, files * 1000.0 / config.msecs);
+
+	for (int op = 0; op < NR_OPS; op++) {
+		struct bench_hist *total = bench_hist_alloc();
+		struct bench_result r;
+
+		for (int i = 0; i < pool->nr_workers; i++) {
+			struct worker_stats *stats = pool->workers[i].priv;
+
+			bench_hist_merge(total, stats->hist[op]);
+		}
+
+		if (total->count) {
+			bench_result_init(&r, "discard", op_names[op]);
+			bench_result_from_hist(&r, total);
+			r.mode = policy_names[config.policy];
+			r.config = setup;
+			r.threads = pool->nr_workers;
+			r.ops_per_sec = total->count * 1000.0 / config.msecs /
+					pool->nr_workers;
+			bench_result_print(stdout, config.fmt, &r);
+		}
+		free(total);
+	}
+}
+
+static int run(int engine)
+{
+	struct worker_stats *stats;
+	struct bench_pool *pool;
+	uint64_t files;
+	int i, op;
+
+	stats = calloc(config.threads, sizeof(*stats));
+	if (!stats)
+		return -1;
+
+	for (i = 0; i < config.threads; i++) {
+		for (op = 0; op < NR_OPS; op++)
+			if (!(stats[i].hist[op] = bench_hist_alloc()))
+				return -1;
+		stats[i].files = calloc(config.files, sizeof(struct file));
+		stats[i].buf = malloc(config.write_size);
+		if (!stats[i].files || !stats[i].buf)
+			return -1;
+		memset(stats[i].buf, i, config.write_size);
+	}
+
+	pool = bench_pool_create(config.threads, NULL, 0,
+				 engine == ENGINE_URING ? do_it_uring : do_it, NULL);
+	if (!pool) {
+		fprintf(stderr, "Failed to create the worker pool\n");
+		return -1;
+	}
+	for (i = 0; i < config.threads; i++)
+		pool->workers[i].priv = &stats[i];
+
+	files = bench_pool_run_for(pool, config.msecs);
+	print_results(pool, files, engine);
+	fflush(stdout);
+	bench_pool_destroy(pool);
+
+	for (i = 0; i < config.threads; i++) {
+		for (op = 0; op < NR_OPS; op++)
+			free(stats[i].hist[op]);
+		free(stats[i].files);
+		free(stats[i].buf);
+	}
+	free(stats);
+
+	return 0;
+}
+
+/* 4096, 64K, 1M */
+static size_t parse_size(const char *str)
+{
+	char *end;
+	size_t size = strtoul(str, &end, 0);
+
+	switch (*end) {
+	case 'm': case 'M':
+		size <<= 10;
+		/* fallthrough */
+	case 'k': case 'K':
+		size <<= 10;
+	}
+
+	return size;
+}
+
+static void usage(const char *name)
+{
+	printf("%s [options]\n", name);
+	printf("	-d <dir>      directory to churn files in (default /tmp)\n");
+	printf("	-t <threads>  workers (default %d)\n", THREADS);
+	printf("	-s <size>     file size (default 4096)\n");
+	printf("	-w <size>     write() size (default 36)\n");
+	printf("	-n <files>    files per worker per round (default 1)\n");
+	printf("	-F <dirs>     spread the files over this many subdirectories\n");
+	printf("	-o            O_TMPFILE files, closing them frees them\n");
+	printf("	-p <policy>   none, fsync, fdatasync, sync_file_range, syncfs or sync (default)\n");
+	printf("	-S <files>    files between syncfs/sync calls (default %d)\n", SYNC_AFTER_FILES);
+	printf("	-T <secs>     duration of a run (default %d)\n", DURATION_MS / 1000);
+	printf("	-l            run forever, printing every run\n");
+	printf("	-f <format>   text (default), csv or json\n");
+	printf("	-e <engine>   sync (default), uring, or both one after the other\n");
+	printf("	-q <depth>    io_uring files in flight per worker (default 32)\n");
+	printf("	-P            io_uring with SQPOLL\n");
+}
 
 int main (int argc, char **argv)
 {
-	pthread_t threads[THREADS];
-	int ret[THREADS];
-	bool loop;
-	int i, c, counter = 0;
+	bool loop = false;
+	int c;
 
-	while ((c = getopt(argc, argv, "l-d:")) != -1) {
+	while ((c = getopt(argc, argv, "hld:t:s:w:n:F:op:S:T:f:e:q:P")) != -1) {
 		switch (c) {
 			case 'l':
 				printf("Running in infinite loop\n");
 				loop = true;
 				break;
 			case 'd':
-				dstdir = strdup(optarg);
+				config.dstdir = strdup(optarg);
+				break;
+			case 't':
+				config.threads = atoi(optarg);
+				break;
+			case 's':
+				config.file_size = parse_size(optarg);
+				break;
+			case 'w':
+				config.write_size = parse_size(optarg);
+				break;
+			case 'n':
+				config.files = atoi(optarg);
+				break;
+			case 'F':
+				config.fanout = atoi(optarg);
+				break;
+			case 'o':
+				config.tmpfile = true;
+				break;
+			case 'p':
+				for (c = 0; c < NR_POLICIES; c++)
+					if (!strcmp(optarg, policy_names[c]))
+						break;
+				if (c == NR_POLICIES) {
+					usage(argv[0]);
+					return 1;
+				}
+				config.policy = c;
+				break;
+			case 'S':
+				config.sync_every = strtoul(optarg, NULL, 0);
+				break;
+			case 'T':
+				config.msecs = atoi(optarg) * 1000;
+				break;
+			case 'e':
+				if (!strcmp(optarg, "sync"))
+					config.engine = ENGINE_SYNC;
+				else if (!strcmp(optarg, "uring"))
+					config.engine = ENGINE_URING;
+				else if (!strcmp(optarg, "both"))
+					config.engine = ENGINE_SYNC | ENGINE_URING;
+				else {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'q':
+				config.queue_depth = atoi(optarg);
+				break;
+			case 'P':
+				config.sqpoll = true;
+				break;
+			case 'f':
+				config.fmt = bench_parse_format(optarg);
+				if ((int)config.fmt < 0) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return c != 'h';
 		}
+	}
 
+	if (config.threads < 1 || config.files < 1 || config.fanout < 0 ||
+	    !config.write_size || !config.sync_every || !config.msecs ||
+	    !config.queue_depth || config.queue_depth > 4096) {
+		usage(argv[0]);
+		return 1;
+	}
+	if ((config.engine & ENGINE_URING) && chain_ops() > MAX_CHAIN) {
+		fprintf(stderr, "io_uring chains are at most %d ops, %u needed, use a larger -w\n",
+			MAX_CHAIN, chain_ops());
+		return 1;
 	}
 
-	do {
-		for (i = 0 ; i < THREADS; i++) {
-			ret[i] = pthread_create(&threads[i], NULL, do_it, NULL);
-		}
+	dir_fd = open(config.dstdir, O_RDONLY | O_DIRECTORY);
+	if (dir_fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", config.dstdir, strerror(errno));
+		return 1;
+	}
 
-		for (i = 0 ; i < THREADS; i++) {
-			pthread_join(threads[i], NULL);
-		}
+	if (setup_dirs())
+		return 1;
 
-		if (counter++ % SYNC_AFTER_FILES == 0) {
-			printf("Issuing a sync()\n");
-			sync();
-		}
+	bench_result_header(stdout, config.fmt);
+	do {
+		if ((config.engine & ENGINE_SYNC) && run(ENGINE_SYNC))
+			return 1;
+		if ((config.engine & ENGINE_URING) && run(ENGINE_URING))
+			return 1;
 	} while (loop);
 
+	cleanup_dirs();
 
 	return 0;
 }
@@ -0,0 +1,117 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+# Loop device playground for trim_bench and discard, everything local.
+#
+#   ./loop_setup.sh up [fs] [size] [mount options]  sparse file -> loop -> mkfs -> mount
+#   ./loop_setup.sh down                            unmount, detach, remove the file
+#   ./loop_setup.sh sweep [fs] [discard_max_bytes...]
+#       BLKDISCARD latency on the raw loop device for every discard_max_bytes,
+#       then FITRIM on a fresh filesystem, all with a foreground writer.
+#
+# IMAGE, MOUNT_DIR, DIRECT_IO (on/off) and TRIM_ARGS (extra trim_bench
+# options) can be set from the environment. Results go to results/.
+
+set -euo pipefail
+
+IMAGE=${IMAGE:-/var/tmp/trim_bench.img}
+MOUNT_DIR=${MOUNT_DIR:-/mnt/trim_bench}
+DIRECT_IO=${DIRECT_IO:-off}
+TRIM_ARGS=${TRIM_ARGS:-}
+STATE=/tmp/trim_bench.loop
+TRIM_BENCH=$(dirname "$0")/trim_bench
+
+die() { echo "ERROR: $*" >&2; exit 1; }
+[[ $EUID -eq 0 ]] || die "must run as root"
+
+loop_dev() {
+	[[ -f "$STATE" ]] || die "no loop device, run '$0 up' first"
+	cat "$STATE"
+}
+
+attach() {
+	local size=$1
+
+	truncate -s "$size" "$IMAGE"
+	losetup --find --show --direct-io="$DIRECT_IO" "$IMAGE" > "$STATE"
+	echo "==> $(loop_dev) on $IMAGE ($size, direct-io=$DIRECT_IO)"
+}
+
+make_fs() {
+	local fs=$1 opts=$2 dev
+
+	dev=$(loop_dev)
+	case "$fs" in
+	ext4)	mkfs.ext4 -q -F -E nodiscard "$dev" ;;
+	xfs)	mkfs.xfs -q -f -K "$dev" ;;
+	btrfs)	mkfs.btrfs -q -f -K "$dev" ;;
+	*)	die "unknown filesystem $fs" ;;
+	esac
+
+	mkdir -p "$MOUNT_DIR"
+	mount -o "$opts" "$dev" "$MOUNT_DIR"
+	echo "==> $fs on $MOUNT_DIR ($opts)"
+}
+
+up() {
+	local fs=${1:-ext4} size=${2:-8G} opts=${3:-nodiscard}
+
+	attach "$size"
+	make_fs "$fs" "$opts"
+}
+
+down() {
+	mountpoint -q "$MOUNT_DIR" && umount "$MOUNT_DIR"
+	if [[ -f "$STATE" ]]; then
+		losetup -d "$(cat "$STATE")" || true
+		rm -f "$STATE"
+	fi
+	rm -f "$IMAGE"
+	echo "==> Removed $IMAGE"
+}
+
+sweep() {
+	local fs=${1:-ext4}
+	shift || true
+	local limits=("${@:-}") dev queue hw orig out
+
+	[[ -x "$TRIM_BENCH" ]] || die "build trim_bench first (make)"
+	[[ -f "$STATE" ]] || attach 8G
+	dev=$(loop_dev)
+	mountpoint -q "$MOUNT_DIR" && umount "$MOUNT_DIR"
+
+	queue=/sys/block/$(basename "$dev")/queue
+	hw=$(cat "$queue/discard_max_hw_bytes")
+	orig=$(cat "$queue/discard_max_bytes")
+	[[ "$hw" -gt 0 ]] || die "$dev does not support discard"
+	[[ -n "${limits[0]}" ]] || limits=(1048576 16777216 268435456 "$orig")
+	# expanded now, the locals are gone by the time the trap runs
+	trap "echo $orig > $queue/discard_max_bytes" EXIT
+
+	mkdir -p results
+	out=results/trim_$(uname -r)_$(date +%Y%m%d_%H%M%S).jsonl
+
+	for limit in "${limits[@]}"; do
+		[[ "$limit" -le "$hw" ]] || { echo "skipping $limit, above $hw"; continue; }
+		echo "$limit" > "$queue/discard_max_bytes"
+		echo "==> BLKDISCARD, discard_max_bytes=$limit"
+		# trim_bench config carries the range size, tag the limit in mode
+		"$TRIM_BENCH" -m discard -w -f json $TRIM_ARGS "$dev" |
+			sed "s/\"mode\": \"\\([^\"]*\\)\"/\"mode\": \"\\1 max=$limit\"/" | tee -a "$out"
+	done
+	echo "$orig" > "$queue/discard_max_bytes"
+
+	make_fs "$fs" nodiscard
+	echo "==> FITRIM on $fs"
+	"$TRIM_BENCH" -m fitrim -w -f json -s 64M,1G -n 8 $TRIM_ARGS "$MOUNT_DIR" | tee -a "$out"
+
+	echo "==> Results in $out"
+}
+
+cmd=${1:-}
+shift || true
+case "$cmd" in
+up)	up "$@" ;;
+down)	down ;;
+sweep)	sweep "$@" ;;
+*)	die "usage: $0 up [fs] [size] [mount options] | down | sweep [fs] [discard_max_bytes...]" ;;
+esac
@@ -0,0 +1,601 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Direct discard latency, to choose discard_max_bytes and fstrim schedules.
+ *
+ * discard mode: BLKDISCARD on a block device (a loop device made by
+ * loop_setup.sh), for every range size and queue depth. queue depth N is N
+ * threads discarding their own region at the same time. Each range is
+ * written before it is discarded, so there is something to free.
+ *
+ * fitrim mode: FITRIM on a mounted filesystem after leaving its free space
+ * contiguous (one large file written and deleted) or fragmented (small
+ * files written and every other one deleted).
+ *
+ * With -w a foreground writer does 4K writes meanwhile, O_DIRECT on the
+ * device or pwrite + fdatasync on the filesystem. Its latency is recorded
+ * for a second before every run (idle), while a timed discard or FITRIM is
+ * in flight (trim, the max is the longest a write was blocked by it) and
+ * during the rest of the run (busy, prefill and free space setup).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "bench.h"
+
+#define MAX_LIST	16
+#define IO_SIZE		(1 << 20)	/* prefill write size */
+#define WRITER_SIZE	4096
+#define WRITER_REGION	(64 << 20)	/* last bytes of the device */
+#define IDLE_MS		1000
+#define FRAGMENT_FILE	(64 << 10)
+
+enum mode {
+	MODE_DISCARD,
+	MODE_FITRIM,
+};
+
+struct config {
+	enum mode mode;
+	const char *target;	/* block device or mountpoint */
+	size_t sizes[MAX_LIST];
+	int nr_sizes;
+	int depths[MAX_LIST];
+	int nr_depths;
+	int samples;
+	uint64_t minlen;	/* FITRIM minimum extent */
+	bool writer;
+	enum bench_format fmt;
+};
+
+static struct config config = {
+	.mode = MODE_DISCARD,
+	.sizes = { 4 << 10, 64 << 10, 1 << 20, 16 << 20, 256 << 20 },
+	.nr_sizes = 5,
+	.depths = { 1, 4, 16 },
+	.nr_depths = 3,
+	.samples = 32,
+};
+
+/*
+ * Foreground writer, records into hist[WRITER_IDLE] before a run. During
+ * the run, writes that overlap a timed BLKDISCARD/FITRIM go to
+ * hist[WRITER_TRIM] and the others (prefill, free space setup, cleanup
+ * and their writeback) to hist[WRITER_BUSY], until phase is WRITER_STOP.
+ */
+enum { WRITER_IDLE, WRITER_TRIM, WRITER_BUSY, WRITER_STOP };
+
+struct writer {
+	pthread_t thread;
+	int fd;
+	off_t offset;
+	bool sync;		/* fdatasync after every write */
+	int phase;		/* WRITER_IDLE, WRITER_BUSY (running) or WRITER_STOP */
+	int trims_in_flight;
+	unsigned long trims;	/* timed trims started */
+	struct bench_hist *hist[WRITER_STOP];
+};
+
+static struct writer writer;
+
+struct discard_job {
+	int fd;
+	size_t size;
+	char *buf;
+	struct bench_hist *hist[];
+};
+
+static size_t parse_size(const char *str)
+{
+	char *end;
+	size_t size = strtoul(str, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/* fallthrough */
+	case 'm': case 'M':
+		size <<= 10;
+		/* fallthrough */
+	case 'k': case 'K':
+		size <<= 10;
+	}
+
+	return size;
+}
+
+static const char *size_name(size_t size, char *buf, size_t len)
+{
+	if (size >= (1 << 30) && !(size % (1 << 30)))
+		snprintf(buf, len, "%zuG", size >> 30);
+	else if (size >= (1 << 20) && !(size % (1 << 20)))
+		snprintf(buf, len, "%zuM", size >> 20);
+	else
+		snprintf(buf, len, "%zuK", size >> 10);
+	return buf;
+}
+
+static void print_hist(const char *test, const char *mode, const char *setup,
+		       int threads, struct bench_hist *h)
+{
+	struct bench_result r;
+
+	if (!h->count)
+		return;
+
+	bench_result_init(&r, "trim_bench", test);
+	bench_result_from_hist(&r, h);
+	r.mode = mode;
+	r.config = setup;
+	r.threads = threads;
+	bench_result_print(stdout, config.fmt, &r);
+}
+
+/*
+ * Foreground writer
+ */
+static void *writer_main(void *arg)
+{
+	struct writer *wr = arg;
+	void *buf;
+	int phase;
+
+	if (posix_memalign(&buf, 4096, WRITER_SIZE))
+		return NULL;
+	memset(buf, 0x5a, WRITER_SIZE);
+
+	while ((phase = __atomic_load_n(&wr->phase, __ATOMIC_RELAXED)) != WRITER_STOP) {
+		unsigned long trims = __atomic_load_n(&wr->trims, __ATOMIC_RELAXED);
+		int in_flight = __atomic_load_n(&wr->trims_in_flight, __ATOMIC_RELAXED);
+		uint64_t start = bench_now_ns();
+
+		if (pwrite(wr->fd, buf, WRITER_SIZE, wr->offset) != WRITER_SIZE ||
+		    (wr->sync && fdatasync(wr->fd))) {
+			perror("writer");
+			break;
+		}
+		/* A trim was in flight at some point of the write */
+		if (phase != WRITER_IDLE &&
+		    (in_flight || __atomic_load_n(&wr->trims_in_flight, __ATOMIC_RELAXED) ||
+		     trims != __atomic_load_n(&wr->trims, __ATOMIC_RELAXED)))
+			phase = WRITER_TRIM;
+		bench_hist_record(wr->hist[phase], bench_now_ns() - start);
+		usleep(1000);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Start the writer and let it record the idle phase */
+static int writer_start(void)
+{
+	if (!config.writer)
+		return 0;
+
+	writer.phase = WRITER_IDLE;
+	for (int i = 0; i < WRITER_STOP; i++)
+		bench_hist_reset(writer.hist[i]);
+	if (pthread_create(&writer.thread, NULL, writer_main, &writer))
+		return -1;
+	usleep(IDLE_MS * 1000);
+	__atomic_store_n(&writer.phase, WRITER_BUSY, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/* Around a timed trim ioctl, the writer attributes overlapping writes to it */
+static void writer_trim_begin(void)
+{
+	__atomic_add_fetch(&writer.trims_in_flight, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&writer.trims, 1, __ATOMIC_RELAXED);
+}
+
+static void writer_trim_end(void)
+{
+	__atomic_sub_fetch(&writer.trims_in_flight, 1, __ATOMIC_RELAXED);
+}
+
+static void writer_stop(const char *setup)
+{
+	if (!config.writer)
+		return;
+
+	__atomic_store_n(&writer.phase, WRITER_STOP, __ATOMIC_RELAXED);
+	pthread_join(writer.thread, NULL);
+	print_hist("write", "idle", setup, 1, writer.hist[WRITER_IDLE]);
+	print_hist("write", "trim", setup, 1, writer.hist[WRITER_TRIM]);
+	print_hist("write", "busy", setup, 1, writer.hist[WRITER_BUSY]);
+}
+
+static int writer_init(int fd, off_t offset, bool sync)
+{
+	writer.fd = fd;
+	writer.offset = offset;
+	writer.sync = sync;
+	for (int i = 0; i < WRITER_STOP; i++) {
+		writer.hist[i] = bench_hist_alloc();
+		if (!writer.hist[i])
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * BLKDISCARD
+ */
+static void discard_worker(struct bench_worker *w)
+{
+	struct discard_job *job = w->arg;
+	uint64_t range[2] = { (uint64_t)w->id * job->size, job->size };
+
+	for (int i = 0; i < config.samples; i++) {
+		uint64_t start;
+
+		/* Untimed, give the discard something to free */
+		for (size_t off = 0; off < job->size; off += IO_SIZE) {
+			size_t len = job->size - off < IO_SIZE ? job->size - off : IO_SIZE;
+
+			if (pwrite(job->fd, job->buf, len, range[0] + off) != (ssize_t)len) {
+				perror("prefill");
+				exit(1);
+			}
+		}
+
+		writer_trim_begin();
+		start = bench_now_ns();
+		if (ioctl(job->fd, BLKDISCARD, range)) {
+			/* EBUSY: a mounted filesystem owns the device */
+			perror("BLKDISCARD");
+			exit(1);
+		}
+		bench_hist_record(job->hist[w->id], bench_now_ns() - start);
+		writer_trim_end();
+		w->ops++;
+	}
+}
+
+static int run_discard(void)
+{
+	uint64_t dev_size;
+	void *buf;
+	int fd;
+
+	fd = open(config.target, O_RDWR | O_DIRECT);
+	if (fd < 0 || ioctl(fd, BLKGETSIZE64, &dev_size)) {
+		fprintf(stderr, "%s: %s\n", config.target, strerror(errno));
+		return -1;
+	}
+	if (posix_memalign(&buf, 4096, IO_SIZE))
+		return -1;
+	memset(buf, 0xa5, IO_SIZE);
+	if (config.writer && writer_init(fd, dev_size - WRITER_REGION, false))
+		return -1;
+	for (int s = 0; s < config.nr_sizes; s++)
+		if (config.sizes[s] % 4096) {
+			fprintf(stderr, "Discard sizes must be multiples of 4K\n");
+			return -1;
+		}
+
+	for (int s = 0; s < config.nr_sizes; s++) {
+		for (int d = 0; d < config.nr_depths; d++) {
+			size_t size = config.sizes[s];
+			int depth = config.depths[d];
+			struct discard_job *job;
+			struct bench_pool *pool;
+			struct bench_hist *total;
+			char setup[64], mode[32], name[24];
+
+			snprintf(setup, sizeof(setup), "size=%s", size_name(size, name, sizeof(name)));
+			snprintf(mode, sizeof(mode), "qd=%d", depth);
+			if ((uint64_t)size * depth + WRITER_REGION > dev_size) {
+				fprintf(stderr, "Skipping %s %s, the device is too small\n", setup, mode);
+				continue;
+			}
+
+			job = calloc(1, sizeof(*job) + depth * sizeof(job->hist[0]));
+			total = bench_hist_alloc();
+			if (!job || !total)
+				return -1;
+			job->fd = fd;
+			job->size = size;
+			job->buf = buf;
+			for (int i = 0; i < depth; i++)
+				if (!(job->hist[i] = bench_hist_alloc()))
+					return -1;
+
+			pool = bench_pool_create(depth, NULL, 0, discard_worker, job);
+			if (!pool || writer_start())
+				return -1;
+			bench_pool_start(pool);
+			bench_pool_join(pool);
+
+			for (int i = 0; i < depth; i++) {
+				bench_hist_merge(total, job->hist[i]);
+				free(job->hist[i]);
+			}
+			print_hist("BLKDISCARD", mode, setup, depth, total);
+			writer_stop(setup);
+			fflush(stdout);
+
+			bench_pool_destroy(pool);
+			free(total);
+			free(job);
+		}
+	}
+
+	free(buf);
+	close(fd);
+	return 0;
+}
+
+/*
+ * FITRIM
+ */
+static int write_file(const char *path, size_t size, const char *buf)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+	if (fd < 0)
+		return -1;
+	for (size_t off = 0; off < size; off += IO_SIZE) {
+		size_t len = size - off < IO_SIZE ? size - off : IO_SIZE;
+
+		if (write(fd, buf, len) != (ssize_t)len) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	return close(fd);
+}
+
+/* Fragmented holes, smaller for free space sizes below FRAGMENT_FILE */
+static size_t fragment_size(size_t size)
+{
+	return size < FRAGMENT_FILE ? size : FRAGMENT_FILE;
+}
+
+/*
+ * Leave size bytes of free space behind, in one piece or as
+ * fragment_size() holes between files that stay until cleanup
+ */
+static int make_free_space(int dir_fd, size_t size, bool fragmented, const char *buf)
+{
+	size_t file_size = fragmented ? fragment_size(size) : size;
+	int files = fragmented ? 2 * (size / file_size) : 1;
+	char path[PATH_MAX];
+
+	for (int i = 0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/trim_bench.%d", config.target, i);
+		if (write_file(path, file_size, buf)) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			return -1;
+		}
+	}
+	syncfs(dir_fd);
+
+	for (int i = 0; i < files; i += fragmented ? 2 : 1) {
+		snprintf(path, sizeof(path), "%s/trim_bench.%d", config.target, i);
+		unlink(path);
+	}
+	syncfs(dir_fd);
+
+	return files;
+}
+
+static void cleanup_files(int dir_fd, int files)
+{
+	char path[PATH_MAX];
+
+	for (int i = 0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/trim_bench.%d", config.target, i);
+		unlink(path);
+	}
+	syncfs(dir_fd);
+}
+
+static int fitrim(int dir_fd, uint64_t *trimmed)
+{
+	struct fstrim_range range = {
+		.start = 0,
+		.len = ULLONG_MAX,
+		.minlen = config.minlen,
+	};
+
+	if (ioctl(dir_fd, FITRIM, &range))
+		return -1;
+	*trimmed = range.len;
+
+	return 0;
+}
+
+static int run_fitrim(void)
+{
+	static const char *patterns[] = { "contiguous", "fragmented" };
+	char path[PATH_MAX];
+	uint64_t trimmed;
+	char *buf;
+	int dir_fd, fd = -1;
+
+	dir_fd = open(config.target, O_RDONLY | O_DIRECTORY);
+	if (dir_fd < 0) {
+		fprintf(stderr, "%s: %s\n", config.target, strerror(errno));
+		return -1;
+	}
+	buf = malloc(IO_SIZE);
+	if (!buf)
+		return -1;
+	memset(buf, 0xa5, IO_SIZE);
+
+	if (config.writer) {
+		snprintf(path, sizeof(path), "%s/trim_bench.writer", config.target);
+		fd = open(path, O_WRONLY | O_CREAT, 0600);
+		if (fd < 0 || writer_init(fd, 0, true))
+			return -1;
+	}
+
+	/* Start from a trimmed filesystem */
+	if (fitrim(dir_fd, &trimmed)) {
+		fprintf(stderr, "FITRIM on %s: %s\n", config.target, strerror(errno));
+		return -1;
+	}
+
+	for (int s = 0; s < config.nr_sizes; s++) {
+		for (int p = 0; p < 2; p++) {
+			struct bench_hist *h = bench_hist_alloc();
+			uint64_t total = 0;
+			char setup[64], name[24], hole[24];
+
+			if (!h)
+				return -1;
+			if (p)
+				snprintf(setup, sizeof(setup), "free=%s hole=%s minlen=%lu",
+					 size_name(config.sizes[s], name, sizeof(name)),
+					 size_name(fragment_size(config.sizes[s]), hole, sizeof(hole)),
+					 config.minlen);
+			else
+				snprintf(setup, sizeof(setup), "free=%s minlen=%lu",
+					 size_name(config.sizes[s], name, sizeof(name)), config.minlen);
+			if (writer_start())
+				return -1;
+
+			for (int i = 0; i < config.samples; i++) {
+				int files = make_free_space(dir_fd, config.sizes[s], p, buf);
+				uint64_t start;
+
+				if (files < 0)
+					return -1;
+				writer_trim_begin();
+				start = bench_now_ns();
+				if (fitrim(dir_fd, &trimmed)) {
+					perror("FITRIM");
+					return -1;
+				}
+				bench_hist_record(h, bench_now_ns() - start);
+				writer_trim_end();
+				total += trimmed;
+				cleanup_files(dir_fd, files);
+				/* Untimed, trim what the cleanup freed */
+				fitrim(dir_fd, &trimmed);
+			}
+
+			print_hist("FITRIM", patterns[p], setup, 1, h);
+			if (config.fmt == BENCH_FMT_TEXT)
+				printf("%-24s %.1f MB trimmed per call\n", "",
+				       total / (double)config.samples / (1 << 20));
+			writer_stop(setup);
+			fflush(stdout);
+			free(h);
+		}
+	}
+
+	if (fd >= 0) {
+		close(fd);
+		unlink(path);
+	}
+	free(buf);
+	close(dir_fd);
+	return 0;
+}
+
+static int parse_list(char *arg, bool sizes)
+{
+	char *tok, *save;
+	int n = 0;
+
+	for (tok = strtok_r(arg, ",", &save); tok && n < MAX_LIST;
+	     tok = strtok_r(NULL, ",", &save), n++) {
+		if (sizes)
+			config.sizes[n] = parse_size(tok);
+		else
+			config.depths[n] = atoi(tok);
+		if (sizes ? !config.sizes[n] : config.depths[n] <= 0)
+			return -1;
+	}
+
+	if (sizes)
+		config.nr_sizes = n;
+	else
+		config.nr_depths = n;
+	return n ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+	printf("%s [options] <block device | mountpoint>\n", name);
+	printf("	-m <mode>     discard (default, BLKDISCARD on a device) or fitrim (on a mountpoint)\n");
+	printf("	-s <list>     discard range sizes / fitrim free space (default 4K,64K,1M,16M,256M)\n");
+	printf("	-q <list>     discard queue depths (default 1,4,16)\n");
+	printf("	-n <samples>  per size and depth (default 32)\n");
+	printf("	-l <size>     FITRIM minlen (default 0)\n");
+	printf("	-w            time a concurrent 4K foreground writer\n");
+	printf("	-f <format>   text (default), csv or json\n");
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "hm:s:q:n:l:wf:")) != -1) {
+		switch (c) {
+		case 'm':
+			if (!strcmp(optarg, "discard"))
+				config.mode = MODE_DISCARD;
+			else if (!strcmp(optarg, "fitrim"))
+				config.mode = MODE_FITRIM;
+			else
+				goto usage;
+			break;
+		case 's':
+			if (parse_list(optarg, true))
+				goto usage;
+			break;
+		case 'q':
+			if (parse_list(optarg, false))
+				goto usage;
+			break;
+		case 'n':
+			config.samples = atoi(optarg);
+			break;
+		case 'l':
+			config.minlen = parse_size(optarg);
+			break;
+		case 'w':
+			config.writer = true;
+			break;
+		case 'f':
+			config.fmt = bench_parse_format(optarg);
+			if ((int)config.fmt < 0)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind != argc - 1 || config.samples <= 0)
+		goto usage;
+	config.target = argv[optind];
+
+	bench_result_header(stdout, config.fmt);
+	if (config.mode == MODE_DISCARD)
+		return run_discard() ? 1 : 0;
+	return run_fitrim() ? 1 : 0;
+
+usage:
+	usage(argv[0]);
+	return 1;
+}
@@ -8,11 +8,34 @@
  *   HZ          : timer frequency (default: 1000)
  *   interval    : sysctl_stat_interval in jiffies (default: 1000)
  *   jiffies     : simulated current jiffies (default: HZ/2)
+ *
+ * Sweep: round_jiffies -S [-H hz,..] [-k skew,..] [-c cpus,..] [-d dist,..]
+ *   For every combination, arm one timer per CPU with
+ *   round_jiffies_relative(interval), queue it on the timer wheel like
+ *   calc_wheel_index() does (rounded up to the granularity of its level, 64
+ *   jiffies for a 1s timer at HZ=1000) and histogram how many CPUs expire
+ *   in the same jiffy (the wake storm size). Start jiffies come from -d:
+ *     same     every CPU arms at the same jiffy (boot, CPU hotplug)
+ *     uniform  every CPU arms at a random jiffy within one interval
+ *     steady   uniform, then re-armed from the expiry like vmstat_update
+ *              does, the state a long running machine converges to
+ *
+ * Replay: round_jiffies -R capture.txt [-F function] [-H hz] [-k skew]
+ *   Reads "cpu jiffies function" lines recorded by capture.bt, builds the
+ *   same histogram from the real expiries and prints it next to the steady
+ *   model for the same CPU count, to validate the model.
  */
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_LIST	16
+#define MAX_CPUS	4096
+#define STEADY_ROUNDS	8
+#define STORM_BUCKETS	14	/* log2 buckets, up to MAX_CPUS and beyond */
 
 static unsigned long hz;
 
@@ -52,18 +75,489 @@ static unsigned long round_jiffies_relative(unsigned long interval, int cpu, int
 	return round_jiffies_common(interval + j0, cpu, skew, false) - j0;
 }
 
+/* Timer wheel geometry, as in kernel/time/timer.c */
+#define LVL_CLK_SHIFT	3
+#define LVL_BITS	6
+#define LVL_SIZE	(1UL << LVL_BITS)
+#define LVL_SHIFT(n)	((n) * LVL_CLK_SHIFT)
+#define LVL_GRAN(n)	(1UL << LVL_SHIFT(n))
+#define LVL_START(n)	((LVL_SIZE - 1) << (((n) - 1) * LVL_CLK_SHIFT))
+
+static unsigned long calc_index(unsigned long expires, unsigned int lvl)
+{
+	/* Round up with level granularity, the wheel never fires early */
+	return ((expires >> LVL_SHIFT(lvl)) + 1) << LVL_SHIFT(lvl);
+}
+
+/* Jiffy a timer armed at clk for expires really fires, calc_wheel_index() */
+static unsigned long wheel_expiry(unsigned long expires, unsigned long clk)
+{
+	unsigned int depth = hz > 100 ? 9 : 8;
+	unsigned long delta = expires - clk;
+	unsigned int lvl;
+
+	if ((long)delta < 0)
+		return calc_index(clk, 0);
+	if (delta >= LVL_START(depth)) {
+		/* WHEEL_TIMEOUT_MAX */
+		expires = clk + LVL_START(depth) - LVL_GRAN(depth - 1);
+		delta = expires - clk;
+	}
+	for (lvl = 0; lvl < depth - 1 && delta >= LVL_START(lvl + 1); lvl++)
+		;
+	return calc_index(expires, lvl);
+}
+
+enum dist {
+	DIST_SAME,
+	DIST_UNIFORM,
+	DIST_STEADY,
+	NR_DIST,
+};
+
+static const char *dist_names[NR_DIST] = {
+	[DIST_SAME]	= "same",
+	[DIST_UNIFORM]	= "uniform",
+	[DIST_STEADY]	= "steady",
+};
+
+struct config {
+	unsigned long hz[MAX_LIST];
+	int nr_hz;
+	int skew[MAX_LIST];
+	int nr_skew;
+	int cpus[MAX_LIST];
+	int nr_cpus;
+	bool dist[NR_DIST];
+	unsigned long interval_ms;
+	int samples;
+	const char *replay;
+	const char *function;
+	bool quiet;
+};
+
+static struct config config = {
+	.hz = { 100, 250, 1000 },
+	.nr_hz = 3,
+	.skew = { 3 },
+	.nr_skew = 1,
+	.cpus = { 64, 512, 4096 },
+	.nr_cpus = 3,
+	.dist = { true, true, true },
+	.interval_ms = 1000,
+	.samples = 1000,
+};
+
+/*
+ * by_size[n] counts the jiffies in which exactly n CPUs fired. A CPU
+ * wakeup "sees" the storm it is part of, so percentiles are weighted by n.
+ */
+struct storm {
+	unsigned long *by_size;
+	int max_size;
+	unsigned long jiffies;		/* jiffies with at least one expiry */
+	unsigned long wakeups;
+};
+
+static int storm_init(struct storm *s, int max_size)
+{
+	memset(s, 0, sizeof(*s));
+	s->by_size = calloc(max_size + 1, sizeof(*s->by_size));
+	s->max_size = max_size;
+	return s->by_size ? 0 : -1;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* fires[] holds one expiry jiffy per CPU, sorted here */
+static void storm_account(struct storm *s, unsigned long *fires, int n)
+{
+	qsort(fires, n, sizeof(*fires), cmp_ulong);
+	for (int i = 0; i < n;) {
+		int j = i;
+
+		while (j < n && fires[j] == fires[i])
+			j++;
+		s->by_size[j - i]++;
+		s->jiffies++;
+		s->wakeups += j - i;
+		i = j;
+	}
+}
+
+static int storm_max(const struct storm *s)
+{
+	for (int n = s->max_size; n > 0; n--) {
+		if (s->by_size[n])
+			return n;
+	}
+	return 0;
+}
+
+/* Storm size the pct-th percent of CPU wakeups were part of */
+static int storm_pct(const struct storm *s, double pct)
+{
+	unsigned long want = s->wakeups * pct / 100, seen = 0;
+
+	for (int n = 1; n <= s->max_size; n++) {
+		seen += s->by_size[n] * n;
+		if (seen && seen >= want)
+			return n;
+	}
+	return 0;
+}
+
+/* Share of the CPU wakeups in storms of [lo, hi] CPUs */
+static double storm_share(const struct storm *s, int lo, int hi)
+{
+	unsigned long cpus = 0;
+
+	for (int n = lo; n <= hi && n <= s->max_size; n++)
+		cpus += s->by_size[n] * n;
+	return s->wakeups ? 100.0 * cpus / s->wakeups : 0;
+}
+
+static void storm_print(const struct storm *s)
+{
+	printf("    %-11s %12s %12s %8s\n", "storm", "jiffies", "cpu_wakeups", "share");
+	for (int b = 0; b < STORM_BUCKETS; b++) {
+		int lo = 1 << b, hi = (2 << b) - 1;
+		unsigned long count = 0, cpus = 0;
+		char range[24];
+
+		for (int n = lo; n <= hi && n <= s->max_size; n++) {
+			count += s->by_size[n];
+			cpus += s->by_size[n] * n;
+		}
+		if (!count)
+			continue;
+		if (lo == hi)
+			snprintf(range, sizeof(range), "%d", lo);
+		else
+			snprintf(range, sizeof(range), "%d-%d", lo, hi);
+		printf("    %-11s %12lu %12lu %7.1f%%\n", range, count, cpus,
+		       storm_share(s, lo, hi));
+	}
+}
+
+/*
+ * Arm one timer per CPU for every sample and account the expiries. hz is
+ * global, like in the kernel, and jiffies is moved to each CPU's arm time,
+ * then to the jiffy the wheel fires the timer, where steady re-arms it.
+ */
+static int simulate(struct storm *s, enum dist dist, int cpus, int skew,
+		    unsigned long interval, int samples)
+{
+	unsigned long *fires = malloc(cpus * sizeof(*fires));
+	unsigned long start;
+
+	if (!fires)
+		return -1;
+
+	for (int i = 0; i < samples; i++) {
+		/* Anywhere in the first hour, only the phase within HZ matters */
+		start = hz + random() % (3600 * hz);
+
+		for (int cpu = 0; cpu < cpus; cpu++) {
+			int rounds = dist == DIST_STEADY ? STEADY_ROUNDS : 1;
+
+			jiffies = start;
+			if (dist != DIST_SAME)
+				jiffies += random() % interval;
+			for (int r = 0; r < rounds; r++)
+				jiffies = wheel_expiry(jiffies +
+						       round_jiffies_relative(interval, cpu, skew),
+						       jiffies);
+			fires[cpu] = jiffies;
+		}
+		storm_account(s, fires, cpus);
+	}
+
+	free(fires);
+	return 0;
+}
+
+static int run_sweep(void)
+{
+	printf("interval=%lums samples=%d, storm percentiles weighted by CPU wakeups\n\n",
+	       config.interval_ms, config.samples);
+	printf("%-6s %-5s %-5s %-8s %12s %6s %6s %6s %9s\n", "HZ", "skew", "cpus",
+	       "start", "jiffies/smp", "max", "p50", "p99", ">=16cpus");
+
+	for (int h = 0; h < config.nr_hz; h++) {
+		unsigned long interval;
+
+		hz = config.hz[h];
+		interval = config.interval_ms * hz / 1000 ? : 1;
+		for (int k = 0; k < config.nr_skew; k++) {
+			for (int c = 0; c < config.nr_cpus; c++) {
+				for (int d = 0; d < NR_DIST; d++) {
+					struct storm s;
+
+					if (!config.dist[d])
+						continue;
+					srandom(1);
+					if (storm_init(&s, config.cpus[c]) ||
+					    simulate(&s, d, config.cpus[c], config.skew[k],
+						     interval, config.samples))
+						return -1;
+
+					printf("%-6lu %-5d %-5d %-8s %12.1f %6d %6d %6d %8.1f%%\n",
+					       hz, config.skew[k], config.cpus[c], dist_names[d],
+					       (double)s.jiffies / config.samples, storm_max(&s),
+					       storm_pct(&s, 50), storm_pct(&s, 99),
+					       storm_share(&s, 16, s.max_size));
+					if (!config.quiet)
+						storm_print(&s);
+					free(s.by_size);
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+struct expiry {
+	unsigned long jiffies;
+	int cpu;
+};
+
+static int cmp_expiry(const void *a, const void *b)
+{
+	const struct expiry *x = a, *y = b;
+
+	if (x->jiffies != y->jiffies)
+		return x->jiffies > y->jiffies ? 1 : -1;
+	return x->cpu - y->cpu;
+}
+
+static int run_replay(void)
+{
+	struct expiry *ev = NULL;
+	size_t nr = 0, alloc = 0;
+	unsigned long *fires;
+	struct storm real, model;
+	char line[512], func[256];
+	int max_cpu = -1, cpus;
+	FILE *f;
+
+	f = fopen(config.replay, "r");
+	if (!f) {
+		perror(config.replay);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		struct expiry e;
+
+		/* Skips bpftrace's "Attaching N probes..." and friends */
+		if (sscanf(line, "%d %lu %255s", &e.cpu, &e.jiffies, func) != 3)
+			continue;
+		if (config.function && strcmp(func, config.function))
+			continue;
+		if (nr == alloc) {
+			alloc = alloc ? alloc * 2 : 4096;
+			ev = realloc(ev, alloc * sizeof(*ev));
+			if (!ev)
+				return -1;
+		}
+		ev[nr++] = e;
+		if (e.cpu > max_cpu)
+			max_cpu = e.cpu;
+	}
+	fclose(f);
+	if (!nr) {
+		fprintf(stderr, "no expiries%s%s in %s\n", config.function ? " of " : "",
+			config.function ? config.function : "", config.replay);
+		return -1;
+	}
+
+	/* The same CPU twice in one jiffy is one wakeup */
+	qsort(ev, nr, sizeof(*ev), cmp_expiry);
+	cpus = max_cpu + 1;
+	if (config.nr_cpus == 1 && config.cpus[0] > cpus)
+		cpus = config.cpus[0];
+	fires = malloc(nr * sizeof(*fires));
+	if (!fires || storm_init(&real, cpus))
+		return -1;
+	for (size_t i = 0, n = 0; i < nr; i++) {
+		if (i && ev[i].jiffies == ev[i - 1].jiffies && ev[i].cpu == ev[i - 1].cpu)
+			continue;
+		fires[n++] = ev[i].jiffies;
+		if (i == nr - 1 || ev[i + 1].jiffies != ev[i].jiffies) {
+			storm_account(&real, fires, n);
+			n = 0;
+		}
+	}
+
+	hz = config.hz[config.nr_hz - 1];
+	srandom(1);
+	if (storm_init(&model, cpus) ||
+	    simulate(&model, DIST_STEADY, cpus, config.skew[0],
+		     config.interval_ms * hz / 1000 ? : 1, config.samples))
+		return -1;
+
+	printf("%s: %zu expiries%s%s over %lu jiffies, %d CPUs\n", config.replay, nr,
+	       config.function ? " of " : "", config.function ? config.function : "",
+	       ev[nr - 1].jiffies - ev[0].jiffies + 1, cpus);
+	printf("model: steady, HZ=%lu skew=%d interval=%lums\n\n", hz,
+	       config.skew[0], config.interval_ms);
+	printf("%-11s %12s %12s\n", "storm", "real", "model");
+	for (int b = 0; b < STORM_BUCKETS && (1 << b) <= cpus; b++) {
+		int lo = 1 << b, hi = (2 << b) - 1;
+		char range[24];
+
+		if (lo == hi)
+			snprintf(range, sizeof(range), "%d", lo);
+		else
+			snprintf(range, sizeof(range), "%d-%d", lo, hi);
+		printf("%-11s %11.1f%% %11.1f%%\n", range, storm_share(&real, lo, hi),
+		       storm_share(&model, lo, hi));
+	}
+	printf("%-11s %12d %12d\n", "max", storm_max(&real), storm_max(&model));
+	printf("%-11s %12d %12d\n", "p99", storm_pct(&real, 99), storm_pct(&model, 99));
+
+	free(real.by_size);
+	free(model.by_size);
+	free(fires);
+	free(ev);
+	return 0;
+}
+
+static int parse_list(char *arg, char opt)
+{
+	char *tok, *save;
+	int n = 0;
+
+	for (tok = strtok_r(arg, ",", &save); tok && n < MAX_LIST;
+	     tok = strtok_r(NULL, ",", &save), n++) {
+		long val = atol(tok);
+
+		if (val <= 0 || (opt == 'c' && val > MAX_CPUS))
+			return -1;
+		if (opt == 'H')
+			config.hz[n] = val;
+		else if (opt == 'k')
+			config.skew[n] = val;
+		else
+			config.cpus[n] = val;
+	}
+
+	if (opt == 'H')
+		config.nr_hz = n;
+	else if (opt == 'k')
+		config.nr_skew = n;
+	else
+		config.nr_cpus = n;
+	return n ? 0 : -1;
+}
+
+static int parse_dist(char *arg)
+{
+	char *tok, *save;
+	int n = 0;
+
+	memset(config.dist, 0, sizeof(config.dist));
+	for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		int d;
+
+		for (d = 0; d < NR_DIST; d++) {
+			if (!strcmp(tok, dist_names[d]))
+				break;
+		}
+		if (d == NR_DIST)
+			return -1;
+		config.dist[d] = true;
+		n++;
+	}
+	return n ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s <max_cpu> [skew] [HZ] [interval] [jiffies]\n", name);
+	fprintf(stderr, "  skew     : jiffies per CPU offset (default: 3)\n");
+	fprintf(stderr, "  HZ       : timer frequency (default: 1000)\n");
+	fprintf(stderr, "  interval : sysctl_stat_interval in jiffies (default: 1000)\n");
+	fprintf(stderr, "  jiffies  : simulated current jiffies (default: HZ/2)\n");
+	fprintf(stderr, "   or: %s -S [options]             wake storm sweep\n", name);
+	fprintf(stderr, "   or: %s -R <capture> [options]   compare capture.bt output to the model\n", name);
+	fprintf(stderr, "  -H <list> : HZ (default: 100,250,1000, -R uses the last)\n");
+	fprintf(stderr, "  -k <list> : skew (default: 3, -R uses the first)\n");
+	fprintf(stderr, "  -c <list> : CPU counts, up to %d (default: 64,512,4096, -R: from the capture)\n", MAX_CPUS);
+	fprintf(stderr, "  -d <list> : start jiffies same,uniform,steady (default: all)\n");
+	fprintf(stderr, "  -i <ms>   : timer interval (default: 1000)\n");
+	fprintf(stderr, "  -n <num>  : start jiffies samples per point (default: 1000)\n");
+	fprintf(stderr, "  -F <func> : -R, only expiries of this function\n");
+	fprintf(stderr, "  -q        : -S, summary lines only, no histograms\n");
+}
+
+static int run_options(int argc, char *argv[])
+{
+	bool sweep = false;
+	int c;
+
+	while ((c = getopt(argc, argv, "SR:H:k:c:d:i:n:F:qh")) != -1) {
+		switch (c) {
+		case 'S':
+			sweep = true;
+			break;
+		case 'R':
+			config.replay = optarg;
+			break;
+		case 'H':
+		case 'k':
+		case 'c':
+			if (parse_list(optarg, c))
+				goto usage;
+			break;
+		case 'd':
+			if (parse_dist(optarg))
+				goto usage;
+			break;
+		case 'i':
+			config.interval_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			config.samples = atoi(optarg);
+			break;
+		case 'F':
+			config.function = optarg;
+			break;
+		case 'q':
+			config.quiet = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || sweep == !!config.replay ||
+	    !config.interval_ms || config.samples <= 0)
+		goto usage;
+
+	if (config.replay)
+		return run_replay() ? 1 : 0;
+	return run_sweep() ? 1 : 0;
+
+usage:
+	usage(argv[0]);
+	return 1;
+}
+
 int main(int argc, char *argv[])
 {
 	unsigned long interval, result, prev_result, min_result, max_result;
 	int n, cpu, skew;
 
+	if (argc > 1 && argv[1][0] == '-')
+		return run_options(argc, argv);
+
 	if (argc < 2) {
-		fprintf(stderr, "Usage: %s <max_cpu> [skew] [HZ] [interval] [jiffies]\n",
-			argv[0]);
-		fprintf(stderr, "  skew     : jiffies per CPU offset (default: 3)\n");
-		fprintf(stderr, "  HZ       : timer frequency (default: 1000)\n");
-		fprintf(stderr, "  interval : sysctl_stat_interval in jiffies (default: 1000)\n");
-		fprintf(stderr, "  jiffies  : simulated current jiffies (default: HZ/2)\n");
+		usage(argv[0]);
 		return 1;
 	}
 
@@ -0,0 +1,859 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * THP fault latency, to decide the THP policy of a service.
+ *
+ * Maps a region aligned to the PMD size and times the first touch of every
+ * PMD extent (2M on x86 and arm64 with 4K pages), then the rest of the
+ * extent at page stride, under:
+ *
+ *   4k        MADV_NOHUGEPAGE, the 512 small faults a THP replaces
+ *   hugepage  MADV_HUGEPAGE, one huge fault (and maybe compaction)
+ *   collapse  4K faults, then MADV_COLLAPSE timed per extent
+ *   populate  mmap(MAP_FIXED | MAP_POPULATE) per extent, under the
+ *             system policy since there is no VMA to advise beforehand
+ *
+ * Next to the latency percentiles it reports the /proc/vmstat deltas of
+ * every mode (thp_fault_alloc, thp_fault_fallback, compact_stall, ...) and
+ * how much of the region AnonHugePages covered, from /proc/self/smaps.
+ *
+ * -M sweeps multi-size THP instead: every hugepages-<size>kB/enabled is set
+ * to always in turn (all the others to never, plus a 4K baseline with all
+ * of them off) and, for every working set size, it measures
+ *
+ *   fault     MB/s faulting the working set at page stride, and the folios
+ *             the size's stats/anon_fault_alloc and _fallback counted
+ *   bloat     RSS over touched memory after touching one page every 64K
+ *   chase     ns per hop of a random pointer chase with one node per page,
+ *             and dTLB load misses per hop from perf_event_open
+ *
+ * then prints the folio size with the fastest chase for each working set.
+ * The enabled files are restored on exit. Needs root.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "bench.h"
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE	25
+#endif
+
+#define THP_SYSFS	"/sys/kernel/mm/transparent_hugepage"
+#define MAX_MTHP	16
+#define MAX_WS		16
+#define BLOAT_STRIDE	(64 << 10)
+#define CHASE_HOPS	(1 << 22)	/* at least, per chase round */
+
+enum mode {
+	MODE_4K,
+	MODE_HUGEPAGE,
+	MODE_COLLAPSE,
+	MODE_POPULATE,
+	NR_MODES,
+};
+
+static const char *mode_names[NR_MODES] = {
+	[MODE_4K]	= "4k",
+	[MODE_HUGEPAGE]	= "hugepage",
+	[MODE_COLLAPSE]	= "collapse",
+	[MODE_POPULATE]	= "populate",
+};
+
+static const char *vmstat_keys[] = {
+	"thp_fault_alloc",
+	"thp_fault_fallback",
+	"thp_fault_fallback_charge",
+	"compact_stall",
+	"thp_collapse_alloc",
+	"thp_collapse_alloc_failed",
+};
+#define NR_VMSTAT	(sizeof(vmstat_keys) / sizeof(vmstat_keys[0]))
+
+struct config {
+	size_t size;
+	size_t stride;
+	int rounds;
+	bool modes[NR_MODES];
+	bool mthp;
+	size_t ws[MAX_WS];		/* mTHP working set sizes */
+	int nr_ws;
+	unsigned long only_kb[MAX_MTHP];	/* -z, mTHP sizes to sweep */
+	int nr_only;
+	enum bench_format fmt;
+};
+
+static struct config config = {
+	.size = 512 << 20,
+	.rounds = 4,
+	.modes = { true, true, true, true },
+	.ws = { 16 << 20, 256 << 20 },
+	.nr_ws = 2,
+};
+
+/* One hugepages-<kb>kB directory, kb is 0 for the 4K baseline */
+struct mthp {
+	unsigned long kb;
+	char saved[16];
+};
+
+struct mthp_result {
+	double fault_mbs;
+	uint64_t alloc;
+	uint64_t fallback;
+	double bloat;
+	double ns_hop;
+	double miss_hop;	/* < 0 without a PMU */
+};
+
+static struct mthp mthp[MAX_MTHP + 1];
+static int nr_mthp;
+
+struct mode_stats {
+	struct bench_hist *first;	/* first touch of an extent */
+	struct bench_hist *extent;	/* whole extent at page stride */
+	struct bench_hist *collapse;
+	uint64_t vmstat[NR_VMSTAT];
+	uint64_t huge_kb;		/* AnonHugePages, summed over rounds */
+	uint64_t collapse_failed;
+	uint64_t fault_ns;		/* first touch or populate of every extent */
+};
+
+static size_t hpage_size;
+static char thp_setup[64];
+
+static uint64_t read_ulong(const char *path, uint64_t def)
+{
+	unsigned long val;
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return def;
+	if (fscanf(f, "%lu", &val) != 1)
+		val = def;
+	fclose(f);
+	return val;
+}
+
+/* The [selected] word of a sysfs policy file */
+static void read_policy(const char *name, char *buf, size_t len)
+{
+	char path[128], line[256], *start, *end;
+	FILE *f;
+
+	snprintf(buf, len, "?");
+	snprintf(path, sizeof(path), THP_SYSFS "/%s", name);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	if (fgets(line, sizeof(line), f) && (start = strchr(line, '[')) &&
+	    (end = strchr(start, ']'))) {
+		*end = '\0';
+		snprintf(buf, len, "%s", start + 1);
+	}
+	fclose(f);
+}
+
+static void read_vmstat(uint64_t *vals)
+{
+	char key[64];
+	unsigned long val;
+	FILE *f = fopen("/proc/vmstat", "r");
+
+	memset(vals, 0, NR_VMSTAT * sizeof(*vals));
+	if (!f)
+		return;
+	while (fscanf(f, "%63s %lu", key, &val) == 2) {
+		for (size_t i = 0; i < NR_VMSTAT; i++) {
+			if (!strcmp(key, vmstat_keys[i]))
+				vals[i] = val;
+		}
+	}
+	fclose(f);
+}
+
+/* smaps field key in kB, summed over the VMAs inside [start, start + size) */
+static uint64_t smaps_kb(char *start, size_t size, const char *key)
+{
+	unsigned long lo, hi, kb;
+	uintptr_t begin = (uintptr_t)start, end = begin + size;
+	bool inside = false;
+	uint64_t total = 0;
+	char line[256], name[64];
+	FILE *f = fopen("/proc/self/smaps", "r");
+
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+			inside = lo >= begin && hi <= end;
+		else if (inside && sscanf(line, "%63[^:]: %lu kB", name, &kb) == 2 &&
+			 !strcmp(name, key))
+			total += kb;
+	}
+	fclose(f);
+	return total;
+}
+
+/* size bytes aligned to the PMD size, so every extent can be a THP */
+static char *map_aligned(size_t size)
+{
+	size_t len = size + hpage_size;
+	uintptr_t addr, aligned;
+	char *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	addr = (uintptr_t)p;
+	aligned = (addr + hpage_size - 1) & ~(hpage_size - 1);
+	if (aligned > addr)
+		munmap(p, aligned - addr);
+	if (aligned + size < addr + len)
+		munmap((char *)aligned + size, addr + len - aligned - size);
+	return (char *)aligned;
+}
+
+static void touch(char *p, size_t from, size_t to)
+{
+	for (size_t off = from; off < to; off += config.stride)
+		((volatile char *)p)[off] = 1;
+}
+
+static int run_round(enum mode mode, struct mode_stats *st)
+{
+	size_t extents = config.size / hpage_size;
+	uint64_t start;
+	char *region;
+
+	region = map_aligned(config.size);
+	if (!region) {
+		perror("mmap");
+		return -1;
+	}
+
+	if (mode == MODE_HUGEPAGE) {
+		if (madvise(region, config.size, MADV_HUGEPAGE)) {
+			perror("madvise(MADV_HUGEPAGE)");
+			return -1;
+		}
+	} else if (mode == MODE_4K || mode == MODE_COLLAPSE) {
+		if (madvise(region, config.size, MADV_NOHUGEPAGE)) {
+			perror("madvise(MADV_NOHUGEPAGE)");
+			return -1;
+		}
+	}
+
+	start = bench_now_ns();
+	for (size_t e = 0; e < extents; e++) {
+		char *ext = region + e * hpage_size;
+		uint64_t t0, t1;
+
+		if (mode == MODE_POPULATE) {
+			t0 = bench_now_ns();
+			if (mmap(ext, hpage_size, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_POPULATE,
+				 -1, 0) == MAP_FAILED) {
+				perror("mmap(MAP_POPULATE)");
+				return -1;
+			}
+			bench_hist_record(st->extent, bench_now_ns() - t0);
+			continue;
+		}
+
+		t0 = bench_now_ns();
+		touch(ext, 0, 1);
+		t1 = bench_now_ns();
+		touch(ext, config.stride, hpage_size);
+		bench_hist_record(st->first, t1 - t0);
+		bench_hist_record(st->extent, bench_now_ns() - t0);
+	}
+	st->fault_ns += bench_now_ns() - start;
+
+	if (mode == MODE_COLLAPSE) {
+		/* MADV_HUGEPAGE clears VM_NOHUGEPAGE, which would refuse the collapse */
+		if (madvise(region, config.size, MADV_HUGEPAGE)) {
+			perror("madvise(MADV_HUGEPAGE)");
+			return -1;
+		}
+		for (size_t e = 0; e < extents; e++) {
+			uint64_t t0 = bench_now_ns();
+
+			if (madvise(region + e * hpage_size, hpage_size, MADV_COLLAPSE)) {
+				if (errno == EINVAL) {
+					fprintf(stderr, "MADV_COLLAPSE not supported (needs 6.1)\n");
+					return -1;
+				}
+				st->collapse_failed++;
+			}
+			bench_hist_record(st->collapse, bench_now_ns() - t0);
+		}
+	}
+
+	st->huge_kb += smaps_kb(region, config.size, "AnonHugePages");
+	munmap(region, config.size);
+	return 0;
+}
+
+static void print_hist(const char *test, enum mode mode, struct bench_hist *h)
+{
+	struct bench_result r;
+
+	if (!h->count)
+		return;
+	bench_result_init(&r, "thp_bench", test);
+	r.mode = mode_names[mode];
+	r.config = thp_setup;
+	r.threads = 1;
+	r.cpu = -1;
+	bench_result_from_hist(&r, h);
+	bench_result_print(stdout, config.fmt, &r);
+}
+
+static int run_mode(enum mode mode, struct mode_stats *st)
+{
+	uint64_t before[NR_VMSTAT], after[NR_VMSTAT];
+
+	st->first = bench_hist_alloc();
+	st->extent = bench_hist_alloc();
+	st->collapse = bench_hist_alloc();
+	if (!st->first || !st->extent || !st->collapse)
+		return -1;
+
+	read_vmstat(before);
+	for (int i = 0; i < config.rounds; i++) {
+		if (run_round(mode, st))
+			return -1;
+	}
+	read_vmstat(after);
+	for (size_t i = 0; i < NR_VMSTAT; i++)
+		st->vmstat[i] = after[i] - before[i];
+
+	print_hist("first_touch", mode, st->first);
+	print_hist(mode == MODE_POPULATE ? "populate" : "fault", mode, st->extent);
+	print_hist("collapse", mode, st->collapse);
+	fflush(stdout);
+	return 0;
+}
+
+static void print_summary(struct mode_stats *stats)
+{
+	/* Keep csv and json streams parseable */
+	FILE *f = config.fmt == BENCH_FMT_TEXT ? stdout : stderr;
+	uint64_t region_kb = config.size / 1024 * config.rounds;
+
+	fprintf(f, "\n%-10s", "mode");
+	for (size_t i = 0; i < NR_VMSTAT; i++)
+		fprintf(f, " %*s", (int)strlen(vmstat_keys[i]), vmstat_keys[i]);
+	fprintf(f, " %8s %9s %8s\n", "huge%", "collapse!", "MB/s");
+
+	for (int m = 0; m < NR_MODES; m++) {
+		if (!config.modes[m])
+			continue;
+		fprintf(f, "%-10s", mode_names[m]);
+		for (size_t i = 0; i < NR_VMSTAT; i++)
+			fprintf(f, " %*lu", (int)strlen(vmstat_keys[i]),
+				stats[m].vmstat[i]);
+		fprintf(f, " %7.1f%% %9lu %8.0f\n", 100.0 * stats[m].huge_kb / region_kb,
+			stats[m].collapse_failed,
+			region_kb * 1e9 / 1024 / stats[m].fault_ns);
+	}
+	fprintf(f, "vmstat deltas are system wide, huge%% is AnonHugePages over the region,\n");
+	fprintf(f, "collapse! counts failed MADV_COLLAPSE, MB/s is the fault (or populate) rate\n");
+}
+
+static const char *size_name(unsigned long kb, char *buf, size_t len)
+{
+	if (!kb)
+		snprintf(buf, len, "4k");
+	else if (kb >= 1024 && !(kb % 1024))
+		snprintf(buf, len, "%luM", kb / 1024);
+	else
+		snprintf(buf, len, "%luK", kb);
+	return buf;
+}
+
+static int write_policy(const char *name, const char *value)
+{
+	char path[128];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), THP_SYSFS "/%s", name);
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	ret = fputs(value, f) < 0 ? -1 : 0;
+	if (fclose(f))
+		ret = -1;
+	return ret;
+}
+
+static int cmp_mthp(const void *a, const void *b)
+{
+	const struct mthp *x = a, *y = b;
+
+	return (x->kb > y->kb) - (x->kb < y->kb);
+}
+
+static bool mthp_wanted(unsigned long kb)
+{
+	if (!config.nr_only)
+		return true;
+	for (int i = 0; i < config.nr_only; i++) {
+		if (config.only_kb[i] == kb)
+			return true;
+	}
+	return false;
+}
+
+/* Every hugepages-<kb>kB directory, sorted, with its enabled setting */
+static int mthp_scan(void)
+{
+	struct dirent *de;
+	DIR *dir = opendir(THP_SYSFS);
+	unsigned long kb;
+
+	if (!dir) {
+		perror(THP_SYSFS);
+		return -1;
+	}
+	nr_mthp = 0;
+	mthp[nr_mthp++].kb = 0;
+	while ((de = readdir(dir)) && nr_mthp <= MAX_MTHP) {
+		char name[300];
+
+		if (sscanf(de->d_name, "hugepages-%lukB", &kb) != 1)
+			continue;
+		/* hugepages-8kB is shmem only, anon order 1 folios don't exist */
+		snprintf(name, sizeof(name), THP_SYSFS "/%s/enabled", de->d_name);
+		if (access(name, W_OK))
+			continue;
+		snprintf(name, sizeof(name), "%s/enabled", de->d_name);
+		read_policy(name, mthp[nr_mthp].saved, sizeof(mthp[nr_mthp].saved));
+		mthp[nr_mthp++].kb = kb;
+	}
+	closedir(dir);
+
+	if (nr_mthp == 1) {
+		fprintf(stderr, "no hugepages-*kB in " THP_SYSFS ", mTHP needs 6.8\n");
+		return -1;
+	}
+	qsort(mthp, nr_mthp, sizeof(mthp[0]), cmp_mthp);
+	return 0;
+}
+
+static void mthp_restore(void)
+{
+	char name[64];
+
+	for (int i = 1; i < nr_mthp; i++) {
+		snprintf(name, sizeof(name), "hugepages-%lukB/enabled", mthp[i].kb);
+		write_policy(name, mthp[i].saved);
+	}
+}
+
+static void mthp_signal(int sig)
+{
+	mthp_restore();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/* Only mthp[idx] is on, everything off for the baseline */
+static int mthp_select(int idx)
+{
+	char name[64];
+
+	for (int i = 1; i < nr_mthp; i++) {
+		snprintf(name, sizeof(name), "hugepages-%lukB/enabled", mthp[i].kb);
+		if (write_policy(name, i == idx ? "always" : "never")) {
+			fprintf(stderr, "writing %s: %s\n", name, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static uint64_t mthp_stat(unsigned long kb, const char *stat)
+{
+	char path[128];
+
+	if (!kb)
+		return 0;
+	snprintf(path, sizeof(path), THP_SYSFS "/hugepages-%lukB/stats/%s", kb, stat);
+	return read_ulong(path, 0);
+}
+
+/* dTLB load misses of this thread, user space only, or -1 */
+static int open_dtlb_counter(void)
+{
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_HW_CACHE,
+		.size = sizeof(attr),
+		.config = PERF_COUNT_HW_CACHE_DTLB |
+			  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		.disabled = 1,
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+	};
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Link one node per page in a random cycle. The node sits on a different
+ * cache line in every page, so the chase is not limited to a few L1 sets.
+ */
+static void **chase_build(char *region, size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE), n = size / page;
+	size_t *order = malloc(n * sizeof(*order));
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	void **first;
+
+	if (!order)
+		return NULL;
+	for (size_t i = 0; i < n; i++)
+		order[i] = i;
+	for (size_t i = n - 1; i > 0; i--) {
+		size_t j, tmp;
+
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		j = seed % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+#define NODE(i)	((void **)(region + order[i] * page + (order[i] * 64) % page))
+	for (size_t i = 0; i < n; i++)
+		*NODE(i) = NODE((i + 1) % n);
+	first = NODE(0);
+#undef NODE
+	free(order);
+	return first;
+}
+
+static void *chase(void **p, size_t hops)
+{
+	while (hops--)
+		p = *p;
+	return p;
+}
+
+static int mthp_point(unsigned long kb, size_t ws, int counter,
+		      struct mthp_result *res)
+{
+	size_t hops = ws / sysconf(_SC_PAGESIZE);
+	uint64_t alloc, fallback, start, touched;
+	double *ns = calloc(config.rounds, sizeof(*ns));
+	struct bench_result r;
+	char name[24], setup[32];
+	long long misses = 0;
+	void **first;
+	char *region;
+
+	if (!ns)
+		return -1;
+	if (hops < CHASE_HOPS)
+		hops *= (CHASE_HOPS + hops - 1) / hops;
+
+	/* Fault throughput */
+	region = map_aligned(ws);
+	if (!region) {
+		perror("mmap");
+		return -1;
+	}
+	alloc = mthp_stat(kb, "anon_fault_alloc");
+	fallback = mthp_stat(kb, "anon_fault_fallback");
+	start = bench_now_ns();
+	touch(region, 0, ws);
+	res->fault_mbs = ws * 1e9 / (1 << 20) / (bench_now_ns() - start);
+	res->alloc = mthp_stat(kb, "anon_fault_alloc") - alloc;
+	res->fallback = mthp_stat(kb, "anon_fault_fallback") - fallback;
+
+	/* Random access over the faulted working set */
+	first = chase_build(region, ws);
+	if (!first)
+		return -1;
+	chase(first, hops / 4);		/* warm up caches and TLB */
+	for (int i = 0; i < config.rounds; i++) {
+		long long count = 0;
+
+		if (counter >= 0) {
+			ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+			ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+		}
+		start = bench_now_ns();
+		asm volatile("" : : "r"(chase(first, hops)) : "memory");
+		ns[i] = (double)(bench_now_ns() - start) / hops;
+		if (counter >= 0) {
+			ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(counter, &count, sizeof(count)) != sizeof(count))
+				count = 0;
+			misses += count;
+		}
+	}
+	res->miss_hop = counter >= 0 ? (double)misses / hops / config.rounds : -1;
+	munmap(region, ws);
+
+	bench_sort(ns, config.rounds);
+	res->ns_hop = bench_percentile(ns, config.rounds, 50);
+	snprintf(setup, sizeof(setup), "ws=%zuM", ws >> 20);
+	bench_result_init(&r, "thp_bench", "chase");
+	r.mode = size_name(kb, name, sizeof(name));
+	r.config = setup;
+	r.threads = 1;
+	r.cpu = -1;
+	bench_result_from_sorted(&r, ns, config.rounds);
+	r.ops_per_sec = 1e9 / res->ns_hop;
+	bench_result_print(stdout, config.fmt, &r);
+	free(ns);
+
+	/* Bloat: RSS after touching one page every BLOAT_STRIDE */
+	region = map_aligned(ws);
+	if (!region) {
+		perror("mmap");
+		return -1;
+	}
+	for (size_t off = 0; off < ws; off += BLOAT_STRIDE)
+		((volatile char *)region)[off] = 1;
+	touched = ws / BLOAT_STRIDE * (sysconf(_SC_PAGESIZE) >> 10);
+	res->bloat = (double)smaps_kb(region, ws, "Rss") / touched;
+	munmap(region, ws);
+	return 0;
+}
+
+static int run_mthp(void)
+{
+	static struct mthp_result res[MAX_MTHP + 1][MAX_WS];
+	FILE *f = config.fmt == BENCH_FMT_TEXT ? stdout : stderr;
+	int counter = open_dtlb_counter();
+	char name[24];
+
+	if (mthp_scan())
+		return -1;
+	atexit(mthp_restore);
+	signal(SIGINT, mthp_signal);
+	signal(SIGTERM, mthp_signal);
+	if (counter < 0)
+		fprintf(stderr, "no dTLB miss counter (%s), misses not reported\n",
+			strerror(errno));
+
+	bench_result_header(stdout, config.fmt);
+	for (int i = 0; i < nr_mthp; i++) {
+		if (!mthp_wanted(mthp[i].kb))
+			continue;
+		if (mthp_select(i))
+			return -1;
+		for (int w = 0; w < config.nr_ws; w++) {
+			if (mthp_point(mthp[i].kb, config.ws[w], counter, &res[i][w]))
+				return -1;
+		}
+		fflush(stdout);
+	}
+
+	fprintf(f, "\n%-6s %6s %10s %8s %8s %7s %9s %10s\n", "folio", "ws",
+		"fault_MB/s", "alloc", "fallback", "bloat", "chase_ns", "dtlb/hop");
+	for (int w = 0; w < config.nr_ws; w++) {
+		int best = -1;
+
+		for (int i = 0; i < nr_mthp; i++) {
+			struct mthp_result *p = &res[i][w];
+
+			if (!mthp_wanted(mthp[i].kb))
+				continue;
+			fprintf(f, "%-6s %5zuM %10.0f %8lu %8lu %6.2fx %9.2f ",
+				size_name(mthp[i].kb, name, sizeof(name)),
+				config.ws[w] >> 20, p->fault_mbs, p->alloc,
+				p->fallback, p->bloat, p->ns_hop);
+			if (p->miss_hop < 0)
+				fprintf(f, "%10s\n", "-");
+			else
+				fprintf(f, "%10.3f\n", p->miss_hop);
+			if (best < 0 || p->ns_hop < res[best][w].ns_hop)
+				best = i;
+		}
+		fprintf(f, "best folio for %zuM: %s (%.2f ns/hop)\n\n", config.ws[w] >> 20,
+			size_name(mthp[best].kb, name, sizeof(name)), res[best][w].ns_hop);
+	}
+	if (counter >= 0)
+		close(counter);
+	return 0;
+}
+
+static size_t parse_size(const char *arg)
+{
+	char *end;
+	size_t val = strtoull(arg, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		val <<= 10;
+		/* fallthrough */
+	case 'm': case 'M':
+		val <<= 10;
+		/* fallthrough */
+	case 'k': case 'K':
+		val <<= 10;
+		break;
+	case '\0':
+		break;
+	default:
+		return 0;
+	}
+	return val;
+}
+
+static int parse_modes(char *arg)
+{
+	char *tok, *save;
+	int n = 0;
+
+	memset(config.modes, 0, sizeof(config.modes));
+	for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		int m;
+
+		for (m = 0; m < NR_MODES; m++) {
+			if (!strcmp(tok, mode_names[m]))
+				break;
+		}
+		if (m == NR_MODES)
+			return -1;
+		config.modes[m] = true;
+		n++;
+	}
+	return n ? 0 : -1;
+}
+
+/* -w working sets or, with kb, -z mTHP sizes */
+static int parse_sizes(char *arg, bool kb)
+{
+	char *tok, *save;
+	int n = 0;
+
+	for (tok = strtok_r(arg, ",", &save); tok && n < (kb ? MAX_MTHP : MAX_WS);
+	     tok = strtok_r(NULL, ",", &save), n++) {
+		size_t size = parse_size(tok);
+
+		if (!size)
+			return -1;
+		if (kb)
+			config.only_kb[n] = size >> 10;
+		else
+			config.ws[n] = size;
+	}
+	if (kb)
+		config.nr_only = n;
+	else
+		config.nr_ws = n;
+	return n ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+	printf("%s [options]\n", name);
+	printf("	-s <size>     region faulted per round (default 512M)\n");
+	printf("	-m <list>     modes: 4k,hugepage,collapse,populate (default all)\n");
+	printf("	-r <rounds>   map, fault and unmap the region this many times (default 4)\n");
+	printf("	-S <stride>   touch stride (default the page size)\n");
+	printf("	-M            sweep mTHP sizes instead (root, changes hugepages-*kB/enabled)\n");
+	printf("	-w <list>     -M working set sizes (default 16M,256M)\n");
+	printf("	-z <list>     -M folio sizes to sweep, 4K is the baseline (default all)\n");
+	printf("	-f <format>   text (default), csv or json\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct mode_stats stats[NR_MODES] = { 0 };
+	char enabled[16], defrag[16];
+	int c;
+
+	config.stride = sysconf(_SC_PAGESIZE);
+	while ((c = getopt(argc, argv, "hs:m:r:S:Mw:z:f:")) != -1) {
+		switch (c) {
+		case 's':
+			config.size = parse_size(optarg);
+			break;
+		case 'm':
+			if (parse_modes(optarg))
+				goto usage;
+			break;
+		case 'r':
+			config.rounds = atoi(optarg);
+			break;
+		case 'S':
+			config.stride = parse_size(optarg);
+			break;
+		case 'M':
+			config.mthp = true;
+			break;
+		case 'w':
+			if (parse_sizes(optarg, false))
+				goto usage;
+			break;
+		case 'z':
+			if (parse_sizes(optarg, true))
+				goto usage;
+			break;
+		case 'f':
+			config.fmt = bench_parse_format(optarg);
+			if ((int)config.fmt < 0)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	hpage_size = read_ulong(THP_SYSFS "/hpage_pmd_size", 2 << 20);
+	config.size -= config.size % hpage_size;
+	if (optind != argc || !config.size || config.rounds <= 0 ||
+	    !config.stride || config.stride > hpage_size)
+		goto usage;
+	for (int w = 0; w < config.nr_ws; w++) {
+		config.ws[w] -= config.ws[w] % hpage_size;
+		if (!config.ws[w])
+			goto usage;
+	}
+
+	if (config.mthp)
+		return run_mthp() ? 1 : 0;
+
+	read_policy("enabled", enabled, sizeof(enabled));
+	read_policy("defrag", defrag, sizeof(defrag));
+	snprintf(thp_setup, sizeof(thp_setup), "enabled=%s defrag=%s", enabled, defrag);
+	if (config.fmt == BENCH_FMT_TEXT)
+		printf("%zu MB x %d rounds, %zu kB extents, stride %zu, %s\n",
+		       config.size >> 20, config.rounds, hpage_size >> 10,
+		       config.stride, thp_setup);
+
+	bench_result_header(stdout, config.fmt);
+	for (int m = 0; m < NR_MODES; m++) {
+		if (config.modes[m] && run_mode(m, &stats[m]))
+			return 1;
+	}
+	print_summary(stats);
+	return 0;
+
+usage:
+	usage(argv[0]);
+	return 1;
+}
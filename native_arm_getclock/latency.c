@@ -5,10 +5,24 @@
 #include <sys/time.h>
 #include <time.h> // Ensure this is included
 
+#include "fastts.h"
+
+#define LOOPS 1000000
+
 static inline uint64_t get_cntvct() {
+#ifdef __aarch64__
   uint64_t val;
   asm volatile("mrs %0, cntvct_el0" : "=r"(val));
   return val;
+#else
+  return bench_cycles();
+#endif
+}
+
+/* Average counter ticks per call, and the same in ns */
+static void report(const char *name, uint64_t cycles) {
+  printf("%s Average Cycles: %" PRIu64 " (%.2f ns)\n", name, cycles / LOOPS,
+         (double)fastts_delta_ns(cycles) / LOOPS);
 }
 
 uint64_t get_clock_gettime(clockid_t clockid) {
@@ -22,36 +36,53 @@ int main() {
   /* used to avoid compiler optiomization */
   uint64_t tmp = 0;
 
+  if (fastts_init(1000)) {
+    fprintf(stderr, "Cannot calibrate the counter\n");
+    return 1;
+  }
+
   // Benchmark CNTVCT_EL0
   start = get_cntvct();
-  for (int i = 0; i < 1000000; i++) {
+  for (int i = 0; i < LOOPS; i++) {
     tmp += get_cntvct();
   }
   end = get_cntvct();
 
   cycles = end - start;
-  printf("CNTVCT_EL0 Average Cycles: %" PRIu64 "\n", cycles / 1000000);
+  report("CNTVCT_EL0", cycles);
+
+  // Benchmark the counter converted to ns
+  start = get_cntvct();
+  for (int i = 0; i < LOOPS; i++) {
+    tmp += fastts_ns();
+  }
+  end = get_cntvct();
+  report("fastts_ns()", end - start);
+
+  start = get_cntvct();
+  for (int i = 0; i < LOOPS; i++) {
+    tmp += fastts_ns_serial();
+  }
+  end = get_cntvct();
+  report("fastts_ns_serial()", end - start);
 
   // Benchmark clock_gettime()
   start = get_cntvct();
-  for (int i = 0; i < 1000000; i++) {
+  for (int i = 0; i < LOOPS; i++) {
     tmp += get_clock_gettime(CLOCK_MONOTONIC_COARSE);
   }
   end = get_cntvct();
   cycles = end - start;
-  printf("clock_gettime(CLOCK_MONOTONIC_COARSE) Average Cycles: %" PRIu64 "\n",
-         cycles / 1000000);
+  report("clock_gettime(CLOCK_MONOTONIC_COARSE)", cycles);
 
   // Benchmark clock_gettime(REALTIME)
   start = get_cntvct();
-  for (int i = 0; i < 1000000; i++) {
+  for (int i = 0; i < LOOPS; i++) {
     tmp += get_clock_gettime(CLOCK_REALTIME);
   }
   end = get_cntvct();
   cycles = end - start;
-
-  printf("clock_gettime(CLOCK_REALTIME) Average Cycles: %" PRIu64 "\n",
-         cycles / 1000000);
+  report("clock_gettime(CLOCK_REALTIME)", cycles);
 
   if (tmp < 1)
     printf("%" PRIu64 "\n", tmp);
@@ -3,6 +3,8 @@
 NAME=${1:-"default"}
 MAX=${2:-100}
 PER_RUN=${3:-60}
+# thread count step for the scalability sweep, 0 skips it
+STEP=${4:-0}
 
 
 set -e
@@ -13,6 +15,8 @@ mkdir ${NAME} || true
 cd ${NAME}
 zcat /proc/config.gz > kernel_config
 cat /proc/cmdline > cmdline
+# IRQ placement, to match against CPUs flagged as NOISY
+cat /proc/interrupts > interrupts
 
 # remove if it exists
 rm -fr results.txt || true
@@ -21,6 +25,11 @@ for i in `seq $MAX`
 do
         echo -n .
         set -x
-        ../sbench -r -t ${PER_RUN} p `nproc` >> results.txt
+        ../sbench -r -c -t ${PER_RUN} -p `nproc` >> results.txt
 done
 echo
+
+if [ ${STEP} -gt 0 ]
+then
+        ../sbench -r -t ${PER_RUN} -p `nproc` -s ${STEP} > usl.txt
+fi
@@ -8,121 +8,224 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sched.h>
+#include <math.h>
+
+#include "bench.h"
 
 struct thread_data {
 	bool print;
 	bool raw;
+	/* Pin workers and report throughput per CPU */
+	bool percpu;
+	/* Percentage below the host median that flags a CPU as noisy */
+	double outlier_pct;
+	enum bench_format fmt;
 };
 
-typedef unsigned long *(*thread_func)(void *);
-
-volatile bool stopping = false;
-
 #define USE_LIBC_SYSCALL 1
 
-unsigned long *get_pid() {
+/* CPUs this process is allowed to run on, workers are pinned round robin */
+static int *cpu_list;
+static int nr_cpus;
+
+static void get_pid(struct bench_worker *w)
+{
 	unsigned long count = 0;
-	unsigned long *ret;
 
-	while (!stopping) {
+	while (!bench_pool_stopping(w)) {
 		pid_t pid = getpid();
 		// Hack to avoid compiler optimization
 		if (pid)
 			count += 1;
 	}
 
-	ret = malloc(sizeof(unsigned long));;
-	if (!ret) {
-		fprintf(stderr, "Failed to allocate memory (get_pid)\n");
-		return NULL;
-	}
-	*ret = count;
-	return ret;
+	w->ops = count;
 }
 
-float create_threads(int thread_count, int msecs, thread_func func, struct thread_data *td)
+/*
+ * Run thread_count workers for msecs and return the number of calls executed
+ * (in millions). If per_thread is not NULL, it receives the calls executed by
+ * each worker, also in millions.
+ */
+float create_threads(int thread_count, int msecs, bench_worker_fn func,
+		     struct thread_data *td, double *per_thread)
 {
-	unsigned long **counts;
-	float syscalls_executed = 0;
-        pthread_t *threads;
-        int ret;
-
-	threads = malloc(thread_count * sizeof(pthread_t));
-	counts = malloc(thread_count * sizeof(unsigned long *));
-
-        stopping = false;
-	for (int i = 0 ; i < thread_count; i++) {
-		ret = pthread_create(&threads[i], NULL, (void *)func, td);
-		if (ret) {
-			fprintf(stderr, "pthread_create failed: %d\n", ret);
-			return -1;
-		}
+	struct bench_pool *pool;
+	float syscalls_executed;
+
+	pool = bench_pool_create(thread_count, td->percpu ? cpu_list : NULL,
+				 nr_cpus, func, td);
+	if (!pool) {
+		fprintf(stderr, "Failed to create the worker pool\n");
+		return -1;
 	}
-        usleep(1000 * msecs);
-        stopping = true;
-	for (int i = 0 ; i < thread_count; i++) {
-		unsigned long count_per_thread = 0;
 
-		pthread_join(threads[i], (void **)&counts[i]);
-		if (!counts[i]) {
-			fprintf(stderr, "something wrong with thread %d\n", i);
-			continue;
-		}
-		count_per_thread = *counts[i];
-		/* return in Millions */
-		syscalls_executed += count_per_thread / (1000.0 * 1000.0);
-	}
+	/* return in Millions */
+	syscalls_executed = bench_pool_run_for(pool, msecs) / (1000.0 * 1000.0);
 
-	free(threads);
-	free(counts);
+	for (int i = 0 ; i < thread_count && per_thread; i++)
+		per_thread[i] = pool->workers[i].ops / (1000.0 * 1000.0);
+
+	bench_pool_destroy(pool);
 	return syscalls_executed;
 }
 
 
 #define DATAPOINTS 100
 
-// Comparator function for qsort
-int compare_doubles(const void *a, const void *b) {
-    double da = *(const double *)a;
-    double db = *(const double *)b;
+static void sort(double *arr) {
+	bench_sort(arr, DATAPOINTS);
+}
 
-    if (da < db) return -1;
-    if (da > db) return 1;
-    return 0;
+static double median(double *arr, int count)
+{
+	bench_sort(arr, count);
+	return arr[count / 2];
 }
 
-static void sort(double *arr) {
-	qsort(arr, DATAPOINTS, sizeof(double), compare_doubles);
+/* sbench's own index, not bench_percentile()'s (count - 1) scaling */
+#define P(arr, pct)	((arr)[DATAPOINTS * (pct) / 100])
+
+/*
+ * Jain's fairness index: 1 when every worker did the same amount of work,
+ * 1/n when a single worker did all of it.
+ */
+static double fairness_index(double *arr, int count)
+{
+	double sum = 0, sum_sq = 0;
+
+	for (int i = 0; i < count; i++) {
+		sum += arr[i];
+		sum_sq += arr[i] * arr[i];
+	}
+
+	if (!sum_sq)
+		return 0;
+
+	return (sum * sum) / (count * sum_sq);
 }
 
+/* Structured record for one set of DATAPOINTS samples (sorted) */
+static void print_result(double *throughput_array, double *latency_array,
+			 int threads, int cpu, struct thread_data *td)
+{
+	struct bench_result r;
+
+	bench_result_init(&r, "sbench", "getpid");
+	bench_result_from_sorted(&r, latency_array, DATAPOINTS);
+	r.threads = threads;
+	r.cpu = cpu;
+	r.ops_per_sec = P(throughput_array, 50) * 1000 * 1000;
+	bench_result_print(stdout, td->fmt, &r);
+}
 
-static void print_data(double *throughput_array, double *latency_array, bool raw)
+/*
+ * percpu is a DATAPOINTS x thread_count matrix with the throughput (M calls/s)
+ * of every worker on every epoch. Report each worker's distribution over the
+ * epochs and flag the ones whose p50 is outlier_pct below the host median.
+ */
+static void print_percpu(double *percpu, double *fairness, int thread_count,
+			 struct thread_data *td)
+{
+	double *p50 = malloc(thread_count * sizeof(double));
+	double *tmp = malloc(thread_count * sizeof(double));
+	double epoch[DATAPOINTS];
+	double host_median;
+	int noisy = 0;
+
+	for (int t = 0; t < thread_count; t++) {
+		for (int e = 0; e < DATAPOINTS; e++)
+			epoch[e] = percpu[e * thread_count + t];
+		sort(epoch);
+		p50[t] = P(epoch, 50);
+		tmp[t] = p50[t];
+	}
+	host_median = median(tmp, thread_count);
+
+	if (td->fmt != BENCH_FMT_TEXT) {
+		double latency[DATAPOINTS];
+
+		for (int t = 0; t < thread_count; t++) {
+			for (int e = 0; e < DATAPOINTS; e++)
+				epoch[e] = percpu[e * thread_count + t];
+			sort(epoch);
+			/* sorted throughput gives sorted (reversed) latency */
+			for (int e = 0; e < DATAPOINTS; e++)
+				latency[e] = 1000 / epoch[DATAPOINTS - 1 - e];
+			print_result(epoch, latency, thread_count,
+				     cpu_list[t % nr_cpus], td);
+		}
+		goto out;
+	}
+
+	if (!td->raw) {
+		printf("\nPer CPU throughput (M syscalls/s), host median p50=%.2f\n",
+		       host_median);
+		if (thread_count > nr_cpus)
+			printf("Warning: %d threads on %d CPUs, CPUs are shared\n",
+			       thread_count, nr_cpus);
+	}
+
+	for (int t = 0; t < thread_count; t++) {
+		double ratio = host_median ? p50[t] / host_median : 0;
+		bool outlier = ratio < 1 - td->outlier_pct / 100;
+
+		for (int e = 0; e < DATAPOINTS; e++)
+			epoch[e] = percpu[e * thread_count + t];
+		sort(epoch);
+
+		printf(" cpu=%d\tmin=%.2f\tp50=%.2f\tp95=%.2f\tratio=%.2f%s\n",
+		       cpu_list[t % nr_cpus], epoch[0], p50[t],
+		       P(epoch, 95), ratio, outlier ? "\tNOISY" : "");
+		noisy += outlier;
+	}
+
+	sort(fairness);
+	printf(" fairness min=%.4f\tp50=%.4f\tp95=%.4f\tnoisy=%d/%d\n",
+	       fairness[0], P(fairness, 50),
+	       P(fairness, 95), noisy, thread_count);
+
+out:
+	free(p50);
+	free(tmp);
+}
+
+
+static void print_data(double *throughput_array, double *latency_array,
+		       int threads, struct thread_data *td)
 {
 
 	sort(throughput_array);
 	sort(latency_array);
 
+	if (td->fmt != BENCH_FMT_TEXT) {
+		print_result(throughput_array, latency_array, threads, -1, td);
+		return;
+	}
 
-
-	if (!raw) {
+	if (!td->raw) {
 		printf("Throughput (Number of syscalls /s)");
 		printf("\t\tLatency (Per syscall in nanoseconds):\n");
 	}
 
 	printf(" min=%.2f\tp50=%.2f\tp95=%.2f", 
 			throughput_array[0],
-		       	throughput_array[DATAPOINTS*50/100],
-		       	throughput_array[DATAPOINTS*95/100]);
+		       	P(throughput_array, 50),
+		       	P(throughput_array, 95));
 	printf("\t | \t");
 	printf("min=%.2f\tp50=%.2f\tp95=%.2f\n",
 		       	latency_array[0],
-		       	latency_array[DATAPOINTS*50/100],
-		       	latency_array[DATAPOINTS*95/100]);
+		       	P(latency_array, 50),
+		       	P(latency_array, 95));
 }
-void run_for_secs(int thread_count, int secs, thread_func func, struct thread_data *td)
+/* Returns the p50 throughput per thread, in M calls/s */
+double run_for_secs(int thread_count, int secs, bench_worker_fn func, struct thread_data *td)
 {
 	double latency_array[DATAPOINTS];
 	double throughput_array[DATAPOINTS];
+	double fairness[DATAPOINTS];
+	double *percpu = NULL;
 
 	double throughput_s, calls, latency;
 	double timeslice_ms;
@@ -130,8 +233,18 @@ void run_for_secs(int thread_count, int secs, thread_func func, struct thread_da
 
 	timeslice_ms = 1000*secs / DATAPOINTS;
 
+	if (td->percpu) {
+		percpu = malloc(DATAPOINTS * thread_count * sizeof(double));
+		if (!percpu) {
+			fprintf(stderr, "Failed to allocate per CPU data\n");
+			return 0;
+		}
+	}
+
 	for(i = 0; i < DATAPOINTS ; i++) {
-		calls = create_threads(thread_count, timeslice_ms, func, td);
+		double *epoch = percpu ? &percpu[i * thread_count] : NULL;
+
+		calls = create_threads(thread_count, timeslice_ms, func, td, epoch);
 		throughput_s = 1000 * (calls / (thread_count * timeslice_ms));
 
 		latency = 1000/(throughput_s); // in ns
@@ -139,11 +252,167 @@ void run_for_secs(int thread_count, int secs, thread_func func, struct thread_da
 		if (td->print)
 			printf("Number of calls: %.2f M/s per thread. Avg Latency: %.2f ns\n", throughput_s, latency);
 
+		if (epoch) {
+			/* M calls per epoch -> M calls/s */
+			for (int t = 0; t < thread_count; t++)
+				epoch[t] = 1000 * epoch[t] / timeslice_ms;
+			fairness[i] = fairness_index(epoch, thread_count);
+
+			if (td->print) {
+				printf(" epoch %d:", i);
+				for (int t = 0; t < thread_count; t++)
+					printf(" cpu%d=%.2f", cpu_list[t % nr_cpus], epoch[t]);
+				printf(" fairness=%.4f\n", fairness[i]);
+			}
+		}
+
 		latency_array[i] = latency;
 		throughput_array[i] = throughput_s;
 	}
 
-	print_data(throughput_array, latency_array, td->raw);
+	print_data(throughput_array, latency_array, thread_count, td);
+
+	if (percpu) {
+		print_percpu(percpu, fairness, thread_count, td);
+		free(percpu);
+	}
+
+	/* print_data() sorted the array */
+	return P(throughput_array, 50);
+}
+
+/*
+ * Universal Scalability Law:
+ *
+ *	X(N) = lambda * N / (1 + sigma * (N - 1) + kappa * N * (N - 1))
+ *
+ * sigma is the contention (serialisation) coefficient and kappa the
+ * coherency (crosstalk) one. With lambda = X(1) and C(N) = X(N) / X(1), the
+ * model is linear in both coefficients:
+ *
+ *	N / C(N) - 1 = sigma * (N - 1) + kappa * N * (N - 1)
+ *
+ * so they are fitted with least squares, clamping to zero any coefficient
+ * that comes out negative and refitting the other one alone.
+ */
+struct usl_fit {
+	double lambda;
+	double sigma;
+	double kappa;
+};
+
+static void usl_fit(int *threads, double *x, int count, struct usl_fit *fit)
+{
+	double s11 = 0, s12 = 0, s22 = 0, s1y = 0, s2y = 0, det;
+
+	fit->lambda = x[0] / threads[0];
+	fit->sigma = fit->kappa = 0;
+
+	for (int i = 0; i < count; i++) {
+		double n = threads[i];
+		double x1 = n - 1;
+		double x2 = n * (n - 1);
+		double y = n * fit->lambda / x[i] - 1;
+
+		s11 += x1 * x1;
+		s12 += x1 * x2;
+		s22 += x2 * x2;
+		s1y += x1 * y;
+		s2y += x2 * y;
+	}
+
+	if (!s11)
+		return;
+
+	det = s11 * s22 - s12 * s12;
+	if (fabs(det) > 1e-9 * s11 * s22) {
+		fit->sigma = (s1y * s22 - s2y * s12) / det;
+		fit->kappa = (s2y * s11 - s1y * s12) / det;
+	}
+
+	if (fit->sigma < 0 || fabs(det) <= 1e-9 * s11 * s22) {
+		fit->sigma = 0;
+		fit->kappa = s2y / s22;
+	}
+
+	if (fit->kappa < 0) {
+		fit->kappa = 0;
+		fit->sigma = s1y / s11 > 0 ? s1y / s11 : 0;
+	}
+}
+
+static double usl_predict(struct usl_fit *fit, double n)
+{
+	return fit->lambda * n / (1 + fit->sigma * (n - 1) + fit->kappa * n * (n - 1));
+}
+
+/*
+ * Run the benchmark with 1, step, 2 * step, ... max_threads threads and fit
+ * the Universal Scalability Law to the total throughput.
+ */
+static void run_sweep(int max_threads, int step, int secs, bench_worker_fn func,
+		      struct thread_data *td)
+{
+	int *threads = malloc((max_threads + 1) * sizeof(int));
+	double *x = malloc((max_threads + 1) * sizeof(double));
+	/* the fit is a summary, keep it out of structured output */
+	FILE *out = td->fmt == BENCH_FMT_TEXT ? stdout : stderr;
+	struct usl_fit fit;
+	int count = 0;
+
+	if (!threads || !x) {
+		fprintf(stderr, "Failed to allocate sweep data\n");
+		goto out;
+	}
+
+	threads[count++] = 1;
+	for (int n = step; n <= max_threads; n += step)
+		if (n > 1)
+			threads[count++] = n;
+	if (threads[count - 1] != max_threads)
+		threads[count++] = max_threads;
+
+	for (int i = 0; i < count; i++) {
+		if (!td->raw)
+			printf("\n== %d threads ==\n", threads[i]);
+		x[i] = threads[i] * run_for_secs(threads[i], secs, func, td);
+		fprintf(out, " threads=%d\ttotal=%.2f M/s\n", threads[i], x[i]);
+	}
+
+	if (count < 3) {
+		fprintf(stderr, "Need at least 3 thread counts to fit the USL\n");
+		goto out;
+	}
+
+	usl_fit(threads, x, count, &fit);
+
+	if (!td->raw)
+		fprintf(out, "\nUniversal Scalability Law fit (throughput in M syscalls/s):\n");
+	fprintf(out, " lambda=%.4f\tsigma=%.6f\tkappa=%.8f\n",
+		fit.lambda, fit.sigma, fit.kappa);
+	for (int i = 0; i < count; i++)
+		fprintf(out, " threads=%d\tmeasured=%.2f\tpredicted=%.2f\n",
+			threads[i], x[i], usl_predict(&fit, threads[i]));
+
+	if (fit.sigma >= 1) {
+		/* Contention alone makes every added thread a loss */
+		fprintf(out, " peak threads=1\tpeak throughput=%.2f M/s\n",
+			usl_predict(&fit, 1));
+	} else if (fit.kappa > 0) {
+		double peak = fmax(sqrt((1 - fit.sigma) / fit.kappa), 1);
+
+		fprintf(out, " peak threads=%.1f\tpeak throughput=%.2f M/s\n",
+			peak, usl_predict(&fit, peak));
+	} else if (fit.sigma > 0) {
+		fprintf(out, " no coherency cost, throughput ceiling=%.2f M/s\n",
+			fit.lambda / fit.sigma);
+	} else {
+		fprintf(out, " linear scalability, no predicted peak\n");
+	}
+
+out:
+	free(threads);
+	free(x);
 }
 
 
@@ -157,6 +426,10 @@ void print_help(const char *name)
 	fprintf(stderr, "	-p <threads_count> : Number of threads\n");
 	fprintf(stderr, "	-v		   : verbose\n");
 	fprintf(stderr, "	-r		   : raw output\n");
+	fprintf(stderr, "	-c		   : pin workers and report throughput per CPU\n");
+	fprintf(stderr, "	-o <percent>       : flag CPUs this much below the host median (default 10)\n");
+	fprintf(stderr, "	-s <step>          : sweep 1..threads_count in steps and fit the USL\n");
+	fprintf(stderr, "	-f <format>        : text (default), csv or json records\n");
 
 	fprintf(stderr, "\n");
 }
@@ -170,10 +443,14 @@ int main(int argc, char **argv)
 	int timeout = 1;
 	/* print all */
 	int arg;
+	/* thread count step for the USL sweep, 0 disables it */
+	int step = 0;
 
-	struct thread_data td = {};
+	struct thread_data td = {
+		.outlier_pct = 10,
+	};
 
-	while ((arg = getopt (argc, argv, "ht:p:vr")) != -1) {
+	while ((arg = getopt (argc, argv, "ht:p:vrco:s:f:")) != -1) {
 		switch (arg)
 		{
 			case 'h':
@@ -192,11 +469,45 @@ int main(int argc, char **argv)
 			case 'r':
 				td.raw = true;
 				break;
+			case 'c':
+				td.percpu = true;
+				break;
+			case 'o':
+				td.outlier_pct = atof(optarg);
+				break;
+			case 's':
+				step = atoi(optarg);
+				break;
+			case 'f':
+				if (bench_parse_format(optarg) < 0) {
+					print_help(argv[0]);
+					return 1;
+				}
+				td.fmt = bench_parse_format(optarg);
+				break;
 		}
 	}
 
+	nr_cpus = bench_cpu_list(&cpu_list);
+	if (nr_cpus <= 0)
+		return 1;
+
+	bench_result_header(stdout, td.fmt);
+	/* keep structured output parseable */
+	if (td.fmt != BENCH_FMT_TEXT)
+		td.raw = true;
+
+
+	if (step > 0) {
+		fprintf(td.fmt == BENCH_FMT_TEXT ? stdout : stderr,
+			"sweeping 1..%d threads in steps of %d, %d seconds each\n",
+			threads_count, step, timeout);
+		run_sweep(threads_count, step, timeout, get_pid, &td);
+		return 0;
+	}
 
-	printf("running %d threads for %d seconds\n", threads_count, timeout);
+	if (td.fmt == BENCH_FMT_TEXT)
+		printf("running %d threads for %d seconds\n", threads_count, timeout);
 
 	run_for_secs(threads_count, timeout, get_pid, &td);
 
@@ -0,0 +1,474 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Cost of returning memory to the kernel in a process with many threads.
+ *
+ * N background threads share the mm, spread over the allowed CPUs, while
+ * the main thread (pinned to the first CPU) times one call at a time of:
+ *
+ *   munmap    map, touch every page, munmap
+ *   dontneed  touch every page, MADV_DONTNEED
+ *   mprotect  make writable and touch every page, mprotect(PROT_READ)
+ *
+ * Only the call is timed. Each of them has to flush the TLB of every CPU
+ * the mm may be live on, which on x86 means an IPI per CPU counted in the
+ * TLB line of /proc/interrupts (arm64 broadcasts TLBI instead, no IPIs).
+ *
+ * The background threads either spin (mm always live on their CPU), sleep
+ * (their CPUs idle, lazy TLB may skip them) or touch their own buffer in
+ * the shared mm (mm live, TLB busy with the mm's entries).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bench.h"
+
+#define MAX_LIST	16
+#define TOUCH_SIZE	(1 << 20)	/* per touching thread */
+#define POINT_BYTES	(1UL << 30)	/* fewer samples for large sizes */
+#define MIN_SAMPLES	8
+
+enum op {
+	OP_MUNMAP,
+	OP_DONTNEED,
+	OP_MPROTECT,
+	NR_OPS,
+};
+
+enum behaviour {
+	BG_SPIN,
+	BG_SLEEP,
+	BG_TOUCH,
+	NR_BG,
+};
+
+static const char *op_names[NR_OPS] = {
+	[OP_MUNMAP]	= "munmap",
+	[OP_DONTNEED]	= "dontneed",
+	[OP_MPROTECT]	= "mprotect",
+};
+
+static const char *bg_names[NR_BG] = {
+	[BG_SPIN]	= "spin",
+	[BG_SLEEP]	= "sleep",
+	[BG_TOUCH]	= "touch",
+};
+
+struct config {
+	int threads[MAX_LIST];
+	int nr_threads;
+	size_t sizes[MAX_LIST];
+	int nr_sizes;
+	bool ops[NR_OPS];
+	bool bgs[NR_BG];
+	int samples;
+	enum bench_format fmt;
+};
+
+static struct config config = {
+	.sizes = { 4 << 10, 64 << 10, 2 << 20, 32 << 20 },
+	.nr_sizes = 4,
+	.ops = { true, true, true },
+	.bgs = { true, true, true },
+	.samples = 1000,
+};
+
+static size_t page_size;
+static bool have_tlb_irq = true;
+
+/* Sum of the TLB shootdown line of /proc/interrupts */
+static uint64_t tlb_ipis(void)
+{
+	char line[8192], *p, *end;
+	uint64_t total = 0;
+	FILE *f;
+
+	if (!have_tlb_irq)
+		return 0;
+	f = fopen("/proc/interrupts", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		p = line + strspn(line, " ");
+		if (strncmp(p, "TLB:", 4))
+			continue;
+		for (p += 4;; p = end) {
+			unsigned long val = strtoul(p, &end, 10);
+
+			if (end == p)
+				break;
+			total += val;
+		}
+		fclose(f);
+		return total;
+	}
+	fclose(f);
+	have_tlb_irq = false;
+	return 0;
+}
+
+static void background(struct bench_worker *w)
+{
+	enum behaviour bg = *(enum behaviour *)w->arg;
+	struct timespec ts = { 0, 1000000 };
+	volatile char *buf = w->priv;
+
+	while (!bench_pool_stopping(w)) {
+		switch (bg) {
+		case BG_SPIN:
+			asm volatile("" ::: "memory");
+			break;
+		case BG_SLEEP:
+			nanosleep(&ts, NULL);
+			break;
+		case BG_TOUCH:
+			for (size_t off = 0; off < TOUCH_SIZE; off += page_size)
+				buf[off]++;
+			break;
+		default:
+			break;
+		}
+		w->ops++;
+	}
+}
+
+static void touch(char *p, size_t size)
+{
+	for (size_t off = 0; off < size; off += page_size)
+		((volatile char *)p)[off] = 1;
+}
+
+/* Time one call of op on size bytes, -1 on failure */
+static int64_t timed_op(enum op op, char **region, size_t size)
+{
+	uint64_t start;
+	int ret = 0;
+
+	switch (op) {
+	case OP_MUNMAP:
+		*region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (*region == MAP_FAILED)
+			return -1;
+		touch(*region, size);
+		start = bench_now_ns();
+		ret = munmap(*region, size);
+		break;
+	case OP_DONTNEED:
+		touch(*region, size);
+		start = bench_now_ns();
+		ret = madvise(*region, size, MADV_DONTNEED);
+		break;
+	case OP_MPROTECT:
+		if (mprotect(*region, size, PROT_READ | PROT_WRITE))
+			return -1;
+		touch(*region, size);
+		start = bench_now_ns();
+		ret = mprotect(*region, size, PROT_READ);
+		break;
+	default:
+		return -1;
+	}
+
+	return ret ? -1 : (int64_t)(bench_now_ns() - start);
+}
+
+static const char *size_name(size_t size, char *buf, size_t len)
+{
+	if (size >= (1 << 20) && !(size % (1 << 20)))
+		snprintf(buf, len, "%zuM", size >> 20);
+	else
+		snprintf(buf, len, "%zuK", size >> 10);
+	return buf;
+}
+
+static int run_point(enum op op, enum behaviour bg, int threads, size_t size,
+		     FILE *summary)
+{
+	int samples = config.samples;
+	struct bench_hist *h = bench_hist_alloc();
+	char *region = NULL, name[24], setup[32];
+	struct bench_result r;
+	uint64_t ipis;
+
+	if (!h)
+		return -1;
+	if (size * samples > POINT_BYTES)
+		samples = POINT_BYTES / size > MIN_SAMPLES ? POINT_BYTES / size : MIN_SAMPLES;
+
+	if (op != OP_MUNMAP) {
+		region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (region == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+	}
+
+	ipis = tlb_ipis();
+	for (int i = 0; i < samples; i++) {
+		int64_t ns = timed_op(op, &region, size);
+
+		if (ns < 0) {
+			perror(op_names[op]);
+			return -1;
+		}
+		bench_hist_record(h, ns);
+	}
+	ipis = tlb_ipis() - ipis;
+
+	if (op != OP_MUNMAP)
+		munmap(region, size);
+
+	snprintf(setup, sizeof(setup), "size=%s", size_name(size, name, sizeof(name)));
+	bench_result_init(&r, "tlb_shootdown", op_names[op]);
+	r.mode = threads ? bg_names[bg] : "none";
+	r.config = setup;
+	r.threads = threads + 1;
+	r.cpu = -1;
+	bench_result_from_hist(&r, h);
+	bench_result_print(stdout, config.fmt, &r);
+
+	fprintf(summary, "%-9s %-6s %7d %6s %10lu %10lu %10lu ", op_names[op],
+		r.mode, threads + 1, name, bench_hist_percentile(h, 50),
+		bench_hist_percentile(h, 99), h->max);
+	if (have_tlb_irq)
+		fprintf(summary, "%10.2f\n", (double)ipis / samples);
+	else
+		fprintf(summary, "%10s\n", "-");
+
+	free(h);
+	return 0;
+}
+
+static int run_threads(int threads, enum behaviour bg, const int *cpus,
+		       int nr_cpus, FILE *summary)
+{
+	struct bench_pool *pool = NULL;
+
+	if (threads) {
+		/* Keep the first CPU for the main thread when there are others */
+		int first = nr_cpus > 1 ? 1 : 0;
+
+		pool = bench_pool_create(threads, cpus + first, nr_cpus - first,
+					 background, &bg);
+		if (!pool) {
+			perror("bench_pool_create");
+			return -1;
+		}
+		for (int i = 0; i < threads; i++) {
+			struct bench_worker *w = &pool->workers[i];
+
+			if (bg != BG_TOUCH)
+				continue;
+			w->priv = malloc(TOUCH_SIZE);
+			if (!w->priv)
+				return -1;
+			memset(w->priv, 0, TOUCH_SIZE);
+		}
+		bench_pool_start(pool);
+	}
+
+	for (int o = 0; o < NR_OPS; o++) {
+		if (!config.ops[o])
+			continue;
+		for (int s = 0; s < config.nr_sizes; s++) {
+			if (run_point(o, bg, threads, config.sizes[s], summary))
+				return -1;
+		}
+		fflush(stdout);
+	}
+
+	if (pool) {
+		bench_pool_stop(pool);
+		bench_pool_join(pool);
+		for (int i = 0; i < threads; i++)
+			free(pool->workers[i].priv);
+		bench_pool_destroy(pool);
+	}
+	return 0;
+}
+
+static size_t parse_size(const char *arg)
+{
+	char *end;
+	size_t val = strtoull(arg, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		val <<= 10;
+		/* fallthrough */
+	case 'm': case 'M':
+		val <<= 10;
+		/* fallthrough */
+	case 'k': case 'K':
+		val <<= 10;
+		break;
+	case '\0':
+		break;
+	default:
+		return 0;
+	}
+	return val;
+}
+
+/* Comma separated names into a bool array */
+static int parse_names(char *arg, const char **names, bool *set, int nr)
+{
+	char *tok, *save;
+	int n = 0;
+
+	memset(set, 0, nr * sizeof(*set));
+	for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		int i;
+
+		for (i = 0; i < nr; i++) {
+			if (!strcmp(tok, names[i]))
+				break;
+		}
+		if (i == nr)
+			return -1;
+		set[i] = true;
+		n++;
+	}
+	return n ? 0 : -1;
+}
+
+static int parse_list(char *arg, bool sizes)
+{
+	char *tok, *save;
+	int n = 0;
+
+	for (tok = strtok_r(arg, ",", &save); tok && n < MAX_LIST;
+	     tok = strtok_r(NULL, ",", &save), n++) {
+		if (sizes) {
+			config.sizes[n] = parse_size(tok);
+			if (!config.sizes[n] || config.sizes[n] % page_size)
+				return -1;
+		} else {
+			config.threads[n] = atoi(tok);
+			if (config.threads[n] < 0)
+				return -1;
+		}
+	}
+
+	if (sizes)
+		config.nr_sizes = n;
+	else
+		config.nr_threads = n;
+	return n ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+	printf("%s [options]\n", name);
+	printf("	-t <list>     background threads (default 0, CPUs - 1, 2 x CPUs)\n");
+	printf("	-b <list>     background threads spin,sleep,touch (default all)\n");
+	printf("	-o <list>     munmap,dontneed,mprotect (default all)\n");
+	printf("	-s <list>     sizes (default 4K,64K,2M,32M)\n");
+	printf("	-n <samples>  calls per point, fewer above 1G in total (default 1000)\n");
+	printf("	-f <format>   text (default), csv or json\n");
+}
+
+int main(int argc, char **argv)
+{
+	char *table = NULL;
+	size_t table_len;
+	FILE *summary;
+	int *cpus, nr_cpus, first_bg = -1;
+	int c;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	while ((c = getopt(argc, argv, "ht:b:o:s:n:f:")) != -1) {
+		switch (c) {
+		case 't':
+			if (parse_list(optarg, false))
+				goto usage;
+			break;
+		case 'b':
+			if (parse_names(optarg, bg_names, config.bgs, NR_BG))
+				goto usage;
+			break;
+		case 'o':
+			if (parse_names(optarg, op_names, config.ops, NR_OPS))
+				goto usage;
+			break;
+		case 's':
+			if (parse_list(optarg, true))
+				goto usage;
+			break;
+		case 'n':
+			config.samples = atoi(optarg);
+			break;
+		case 'f':
+			config.fmt = bench_parse_format(optarg);
+			if ((int)config.fmt < 0)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || config.samples <= 0)
+		goto usage;
+
+	nr_cpus = bench_cpu_list(&cpus);
+	if (nr_cpus <= 0)
+		return 1;
+	if (!config.nr_threads) {
+		config.threads[config.nr_threads++] = 0;
+		if (nr_cpus > 1)
+			config.threads[config.nr_threads++] = nr_cpus - 1;
+		config.threads[config.nr_threads++] = 2 * nr_cpus;
+	}
+	if (bench_pin_cpu(cpus[0]))
+		return 1;
+
+	tlb_ipis();
+	if (!have_tlb_irq)
+		fprintf(stderr, "no TLB line in /proc/interrupts, IPIs not reported\n");
+
+	/* Printed at the end, after the results */
+	summary = open_memstream(&table, &table_len);
+	if (!summary)
+		return 1;
+	bench_result_header(stdout, config.fmt);
+	if (config.fmt == BENCH_FMT_TEXT)
+		printf("%d CPUs, main thread on CPU %d\n", nr_cpus, cpus[0]);
+	fprintf(summary, "%-9s %-6s %7s %6s %10s %10s %10s %10s\n", "op", "bg",
+		"threads", "size", "p50_ns", "p99_ns", "max_ns", "ipis/call");
+
+	for (int b = NR_BG - 1; b >= 0; b--) {
+		if (config.bgs[b])
+			first_bg = b;
+	}
+
+	for (int t = 0; t < config.nr_threads; t++) {
+		for (int b = 0; b < NR_BG; b++) {
+			if (!config.bgs[b])
+				continue;
+			/* Nothing runs in the background, one pass is enough */
+			if (!config.threads[t] && b != first_bg)
+				continue;
+			if (run_threads(config.threads[t], b, cpus, nr_cpus, summary))
+				return 1;
+		}
+	}
+
+	/* Keep csv and json streams parseable */
+	fclose(summary);
+	fprintf(config.fmt == BENCH_FMT_TEXT ? stdout : stderr, "\n%s", table);
+	free(table);
+	free(cpus);
+	return 0;
+
+usage:
+	usage(argv[0]);
+	return 1;
+}
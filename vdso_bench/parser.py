@@ -1,50 +1,200 @@
-#!env python3
+#!/usr/bin/env python3
+"""
+Aggregate vdso_bench JSON lines results (run.sh, or vdso_bench -f json).
 
-import os, glob
-from typing import Final
+Records are grouped by row (test, mode, config, threads) and by column (the
+kernel by default), and every cell is the median and the interquartile
+range of all the runs that landed in it. With --baseline, every column is
+also shown as a ratio against the baseline column. The fastts "accuracy"
+records (ns off CLOCK_MONOTONIC) get a table of their own, in p99_ns unless
+--metric asks for another ns metric.
+
+Files are read one line at a time and only the metric is kept, so large
+result sets (10 kernels x 10 runs x every clock) do not need to fit in
+memory as records.
+
+    ./parser.py results/
+    ./parser.py results/ --column label --baseline 6.9 --metric p50_ns
+"""
+
+import argparse
+import json
 import logging
+import os
+import re
+import statistics
+import sys
+from collections import defaultdict
+from typing import Dict, Iterator, List, Tuple
+
+# run.sh names its files run_<label>_<date>_<run>.jsonl
+RUN_FILE = re.compile(r"run_(?P<label>.+)_\d+_\d+\.jsonl$")
+ROW_KEYS = ("test", "mode", "config", "threads")
+COLUMNS = ("kernel", "host", "clocksource", "label", "config", "threads")
+METRICS = ("ops_per_sec", "mean_ns", "min_ns", "p50_ns", "p90_ns", "p99_ns", "max_ns")
+# fastts vs CLOCK_MONOTONIC, a distribution of errors without a rate
+ACCURACY_MODE = "accuracy"
+ACCURACY_METRIC = "p99_ns"
+
+
+def result_files(paths: List[str]) -> Iterator[str]:
+    for path in paths:
+        if os.path.isdir(path):
+            for name in sorted(os.listdir(path)):
+                if name.endswith(".jsonl") or name.endswith(".json"):
+                    yield os.path.join(path, name)
+        else:
+            yield path
+
+
+def records(paths: List[str]) -> Iterator[dict]:
+    for filename in result_files(paths):
+        match = RUN_FILE.search(os.path.basename(filename))
+        label = match.group("label") if match else os.path.basename(filename)
+        with open(filename) as file:
+            for lineno, line in enumerate(file, 1):
+                line = line.strip()
+                if not line.startswith("{"):
+                    continue
+                try:
+                    record = json.loads(line)
+                except json.JSONDecodeError:
+                    logging.warning("%s:%d: not a JSON record, skipped", filename, lineno)
+                    continue
+                record["label"] = label
+                yield record
 
-TIMERS: Final[str] = ["getpid", "CLOCK_REALTIME", "CLOCK_MONOTONIC", "CLOCK_PROCESS_CPUTIME_ID", "CLOCK_THREAD_CPUTIME_ID", "CLOCK_MONOTONIC_RAW",  "CLOCK_REALTIME_COARSE", "CLOCK_MONOTONIC_COARSE", "CLOCK_BOOTTIME"]
-PATH: Final[str] = os.getcwd() + "/merged/"
-
-# k =  timername, v is {run: time}#
-# d : dict[dict[str: str]] = {}
-d = {}
-
-columns = []
-for filename in os.listdir(PATH):
-    # print(filename)
-    columns.append(filename)
-    with open(os.path.join(PATH, filename)) as file:
-        while line := file.readline():
-            for timer in TIMERS:
-                if timer in line:
-                    # Get the proper name from the line
-                    timer = line.split(' ')[4]
-                    # Number of calls to CLOCK_REALTIME : 34.09 M/s per thread
-                    value = line.split(' ')[6]
-                    if timer not in d:
-                        d[timer] = {}
-                    # print(f"+Adding: {timer=} {filename=} = {value=}")
-                    d[timer][filename] = value
-        # break
-
-columns.sort()
-
-print('name, ', end="")
-for col in columns:
-    col = col.split('_')[1] + "_" + col.split('_')[3]
-    print(f"{col}, ", end="")
-
-print("")
-
-for timer in sorted(d.keys()):
-    values = d[timer]
-    print(f"{timer}, ", end='')
-    for col in columns:
-        if not col in values:
-            print(",", end='')
+
+def quartiles(values: List[float]) -> Tuple[float, float, float]:
+    if len(values) < 2:
+        return values[0], values[0], values[0]
+    q1, q2, q3 = statistics.quantiles(values, n=4, method="inclusive")
+    return q1, q2, q3
+
+
+Table = Dict[Tuple, Dict[str, List[float]]]
+
+
+def collect(args) -> Tuple[Table, Table]:
+    table: Table = defaultdict(lambda: defaultdict(list))
+    accuracy: Table = defaultdict(lambda: defaultdict(list))
+    accuracy_metric = args.metric if args.metric != "ops_per_sec" else ACCURACY_METRIC
+
+    for record in records(args.paths):
+        if args.tool and record.get("tool") != args.tool:
+            continue
+        # Failed clocks (REALTIME_ALARM as non root, ...) would drag medians to 0
+        if record.get("mode") == "error" or not record.get("samples"):
+            continue
+        if record.get("mode") == ACCURACY_MODE:
+            value = record.get(accuracy_metric)
+            target = accuracy
+        else:
+            value = record.get(args.metric)
+            target = table
+        if value is None:
             continue
-        print(f"{values[col]}, ", end = '')
+        row = tuple(str(record.get(key, "")) for key in ROW_KEYS)
+        target[row][str(record.get(args.column, ""))].append(float(value))
+
+    return table, accuracy
+
+
+def format_cell(values: List[float], scale: float, ratio: float) -> str:
+    if not values:
+        return ""
+    q1, median, q3 = quartiles(values)
+    cell = f"{median / scale:.2f} ±{(q3 - q1) / scale:.2f} (n={len(values)})"
+    if ratio:
+        cell += f" x{median / ratio:.3f}"
+    return cell
+
+
+def print_table(args, table: Table, metric: str) -> None:
+    columns = sorted({column for cells in table.values() for column in cells})
+    scale = 1e6 if metric == "ops_per_sec" else 1.0
+
+    if args.csv:
+        header = list(ROW_KEYS)
+        for column in columns:
+            header += [f"{column}_median", f"{column}_q1", f"{column}_q3", f"{column}_n"]
+            if args.baseline:
+                header.append(f"{column}_ratio")
+        print(",".join(header))
+        for row in sorted(table):
+            cells = table[row]
+            base = cells.get(args.baseline) if args.baseline else None
+            base_median = quartiles(base)[1] if base else 0
+            line = [f'"{key}"' for key in row]
+            for column in columns:
+                values = cells.get(column)
+                if not values:
+                    line += [""] * (5 if args.baseline else 4)
+                    continue
+                q1, median, q3 = quartiles(values)
+                line += [f"{median:.2f}", f"{q1:.2f}", f"{q3:.2f}", str(len(values))]
+                if args.baseline:
+                    line.append(f"{median / base_median:.4f}" if base_median else "")
+            print(",".join(line))
+        return
+
+    unit = "M/s" if metric == "ops_per_sec" else "ns"
+    print(f"{metric} ({unit}), median ±IQR per {args.column}"
+          + (f", x ratio vs {args.baseline}" if args.baseline else ""))
+
+    names = [" ".join(part for part in row[:3] if part) + f" t={row[3]}" for row in table]
+    width = max(len(name) for name in names + ["test"])
+    cell_width = max([len(column) for column in columns] + [30])
+
+    print(f"{'test':<{width}}" + "".join(f" {column:>{cell_width}}" for column in columns))
+    for row in sorted(table):
+        cells = table[row]
+        base = cells.get(args.baseline) if args.baseline else None
+        base_median = quartiles(base)[1] if base else 0
+        name = " ".join(part for part in row[:3] if part) + f" t={row[3]}"
+        line = f"{name:<{width}}"
+        for column in columns:
+            line += f" {format_cell(cells.get(column, []), scale, base_median):>{cell_width}}"
+        print(line)
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("paths", nargs="+", help="result files or directories of .jsonl files")
+    parser.add_argument("--metric", default="ops_per_sec", choices=METRICS,
+                        help="value to aggregate (default: ops_per_sec, shown in M/s)")
+    parser.add_argument("--column", default="kernel", choices=COLUMNS,
+                        help="what the columns compare (default: kernel)")
+    parser.add_argument("--baseline", help="column value the others are divided by")
+    parser.add_argument("--tool", default="vdso_bench", help="only records of this tool")
+    parser.add_argument("--csv", action="store_true", help="median,q1,q3,n per column, as CSV")
+    args = parser.parse_args()
+
+    table, accuracy = collect(args)
+    if not table and not accuracy:
+        logging.error("no records found")
+        return 1
+
+    columns = {column for cells in list(table.values()) + list(accuracy.values())
+               for column in cells}
+    if args.baseline and args.baseline not in columns:
+        logging.error("baseline %s not in %s", args.baseline, ", ".join(sorted(columns)))
+        return 1
+
+    if table:
+        print_table(args, table, args.metric)
+    if accuracy:
+        if table:
+            print()
+        if not args.csv:
+            print("fastts error vs CLOCK_MONOTONIC")
+        print_table(args, accuracy,
+                    args.metric if args.metric != "ops_per_sec" else ACCURACY_METRIC)
+
+    return 0
+
 
-    print()
+if __name__ == "__main__":
+    logging.basicConfig(format="%(levelname)s: %(message)s")
+    sys.exit(main())
@@ -1,11 +1,18 @@
 #!/bin/bash
+#
+# Run vdso_bench RUNS times and keep one JSON lines file per run, named
+# results/run_<name>_<date>_<run>.jsonl. Every record carries the host,
+# kernel and clocksource, so results from different machines and kernels
+# can be thrown in the same directory and compared with parser.py:
+#
+#   ./parser.py results/ --baseline <kernel>
 
-RUNS=10
+RUNS=${RUNS:-10}
 NAME=${1:-default}
 # 10 seconds by default
 TIMEOUT=${2:-10}
 # number of parallel threads
-THREADS=10
+THREADS=${3:-10}
 DATE=$(date +%s)
 
 make clean
@@ -15,6 +22,6 @@ mkdir -p results
 echo "Starting a test with name: ${NAME}..."
 for i in $(seq ${RUNS}) ; do
 	set -x
-	./vdso_bench -t "${TIMEOUT}" -p "${THREADS}" > results/run_${NAME}_${DATE}_${i}
+	./vdso_bench -f json -t "${TIMEOUT}" -p "${THREADS}" > results/run_${NAME}_${DATE}_${i}.jsonl
 	set +x
 done
@@ -2,12 +2,26 @@
 #include <time.h>
 #include <stdint.h>
 #include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/rseq.h>
+#include <elf.h>
+#include <link.h>
 #include <sys/time.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+#include "bench.h"
+#include "fastts.h"
 
 /* Create a single thread that run clock_gettime() with different clockids,
  * and report the number of operations per second
@@ -25,6 +39,14 @@
 #define CLOCK_REALTIME_ALARM            8
 #define CLOCK_BOOTTIME_ALARM            9
 #define NATIVE_READ			10
+/* Raw counter converted to ns by benchlib/fastts */
+#define FASTTS				11
+#define FASTTS_SERIAL			12
+#define LAST_CLOCK			FASTTS_SERIAL
+
+/* ms between fastts resyncs against CLOCK_MONOTONIC, -R */
+static unsigned int fastts_resync_ms = 1000;
+static bool fastts_ok;
 
 char *clock_names[] = {
 	"CLOCK_REALTIME",
@@ -38,14 +60,43 @@ char *clock_names[] = {
 	"CLOCK_REALTIME_ALARM",
 	"CLOCK_BOOTTIME_ALARM",
 	"get_cntvct",
+	"fastts",
+	"fastts_serial",
 };
 
 
 enum test_type {
 	SYSCALL = 1,
-	GETTIME
+	GETTIME,
+	GETCPU,
+	GETRANDOM,
+};
+
+/* -C, how the current CPU is found */
+enum cpu_mode {
+	CPU_VDSO,
+	CPU_SYSCALL,
+	CPU_RSEQ,
+	CPU_LIBC,
+	NR_CPU_MODES,
 };
 
+const char *cpu_modes[] = { "vdso", "syscall", "rseq", "sched_getcpu" };
+
+/* -r, where the random bytes come from */
+enum random_mode {
+	RANDOM_VDSO,
+	RANDOM_SYSCALL,
+	RANDOM_URANDOM,
+	NR_RANDOM_MODES,
+};
+
+const char *random_modes[] = { "vdso", "syscall", "urandom" };
+
+/* Default getrandom buffer sizes, -B picks one */
+static const size_t random_sizes[] = { 16, 64, 256, 1024, 4096 };
+#define MAX_RANDOM_SIZE	4096
+
 typedef enum barrier {
 	ISB = 1,
 	SB,
@@ -56,11 +107,31 @@ struct thread_data {
         clockid_t clockid;
         barrier_t barrier;
 	bool print;
+	/* Call clock_gettime(2) directly, bypassing the vDSO */
+	bool force_syscall;
+	/* GETCPU and GETRANDOM: enum cpu_mode / random_mode and buffer size */
+	int mode;
+	size_t size;
+	enum bench_format fmt;
 };
 
-typedef unsigned long *(*thread_func)(void *);
+/*
+ * Calls between two counter reads. Each histogram sample is the number of
+ * counter ticks a whole batch took, so the reads are amortised and the
+ * per-call latency keeps sub-ns resolution.
+ */
+#define BATCH 16
 
-volatile bool stopping = false;
+struct clock_result {
+	double throughput;		/* M calls/s per thread */
+	double latency;			/* ns, average from the throughput */
+	struct bench_hist hist;		/* ticks per BATCH calls */
+	double syscalls_per_call;	/* raw_syscalls per call, -1 if unknown */
+	double syscall_p50;		/* ns, clock_gettime(2) baseline */
+	const char *path;		/* vdso, syscall or native */
+	struct bench_hist err;		/* fastts only, |ns off CLOCK_MONOTONIC| */
+	int64_t err_worst;		/* signed, the largest of err */
+};
 
 #ifdef CONFIG_ARM
 
@@ -107,7 +178,7 @@ static uint64_t gettime_asm(enum barrier b)
      * The rdtsc instruction loads the current value of the processor's
      * time-stamp counter into EDX:EAX (high:low)
      */
-    asm volatile("rdtscp" : "=a" (low), "=d" (high));
+    asm volatile("rdtscp" : "=a" (low), "=d" (high) : : "ecx");
 
     /* Combine the two 32-bit values into a 64-bit result */
     return ((uint64_t)high << 32) | low;
@@ -116,44 +187,74 @@ static uint64_t gettime_asm(enum barrier b)
 
 #define USE_LIBC_SYSCALL 1
 
-unsigned long *get_pid() {
+static void get_pid(struct bench_worker *w)
+{
+	struct bench_hist *hist = w->priv;
 	unsigned long count = 0;
-	unsigned long *ret;
 
-	while (!stopping) {
-		pid_t pid = getpid();
-		// Hack to avoid compiler optimization
-		if (pid)
-			count += 1;
+	while (!bench_pool_stopping(w)) {
+		uint64_t start = bench_cycles_serial();
+
+		for (int i = 0; i < BATCH; i++) {
+			pid_t pid = getpid();
+			// Hack to avoid compiler optimization
+			if (pid)
+				count += 1;
+		}
+		bench_hist_record(hist, bench_cycles_serial() - start);
 	}
 
-	ret = malloc(sizeof(unsigned long));;
-	if (!ret) {
-		fprintf(stderr, "Failed to allocate memory (get_pid)\n");
-		return NULL;
+	w->ops = count;
+}
+
+static inline int read_clock(struct thread_data *td, struct timespec *ts)
+{
+	if (td->clockid == NATIVE_READ) {
+		gettime_asm(td->barrier);
+		return 0;
+	}
+
+	if (td->clockid == FASTTS || td->clockid == FASTTS_SERIAL) {
+		uint64_t ns;
+
+		if (!fastts_ok)
+			return -1;
+		ns = td->clockid == FASTTS ? fastts_ns() : fastts_ns_serial();
+		ts->tv_sec = ns / 1000000000;
+		ts->tv_nsec = ns % 1000000000;
+		return 0;
 	}
-	*ret = count;
-	return ret;
+
+	if (td->force_syscall)
+		return syscall(SYS_clock_gettime, td->clockid, ts);
+
+	return clock_gettime(td->clockid, ts);
 }
 
-unsigned long *get_time(void *_td) {
-	struct thread_data *td = (struct thread_data *)_td;
+static void get_time(struct bench_worker *w)
+{
+	struct thread_data *td = w->arg;
+	struct bench_hist *hist = w->priv;
 	clockid_t clock = td->clockid;
 	unsigned long count = 0;
-	unsigned long *ret;
 	struct timespec ts;
 	int result;
 	static int printed;
 
-	while (!stopping) {
-		if (clock == 10) {
-			gettime_asm(td->barrier);
-		} else {
-			result = clock_gettime(clock, &ts);
+	while (!bench_pool_stopping(w)) {
+		uint64_t start = bench_cycles_serial();
+
+		result = 0;
+		for (int i = 0; i < BATCH; i++)
+			result |= read_clock(td, &ts);
+		bench_hist_record(hist, bench_cycles_serial() - start);
+
+		if (clock != NATIVE_READ) {
 			if (result != 0) {
 				fprintf(stderr, "Error getting time through clock_gettime (clockid_t = %s). clock_gettime(2) returned = %d\n", clock_names[clock], result);
-				stopping = true;
-				return NULL;
+				bench_pool_stop(w->pool);
+				w->ops = 0;
+				return;
 			}
 			if (td->print && !printed++) {
 				char buff[100];
@@ -163,73 +264,1074 @@ unsigned long *get_time(void *_td) {
 				printf(" * Raw timespec.tv_nsec: %09ld\n\n", ts.tv_nsec);
 			}
 		}
-		count += 1;
+		count += BATCH;
 	}
 
 	printed = 0;
-	ret = malloc(sizeof(unsigned long));;
-	if (!ret) {
-		fprintf(stderr, "Failed to allocate memory\n");
+	w->ops = count;
+}
+
+/*
+ * vDSO symbol lookup, as tools/testing/selftests/vDSO/parse_vdso.c does it
+ * minus the symbol versions. Uses DT_HASH, which every vDSO still has.
+ */
+static void *vdso_sym(const char *name)
+{
+	ElfW(Ehdr) *ehdr = (ElfW(Ehdr) *)getauxval(AT_SYSINFO_EHDR);
+	ElfW(Phdr) *phdr;
+	ElfW(Dyn) *dyn = NULL;
+	ElfW(Sym) *symtab = NULL;
+	const char *strtab = NULL;
+	uint32_t *hash = NULL;
+	uintptr_t base = (uintptr_t)ehdr, load_offset = 0;
+	bool found_load = false;
+
+	if (!ehdr)
+		return NULL;
+
+	phdr = (ElfW(Phdr) *)(base + ehdr->e_phoff);
+	for (int i = 0; i < ehdr->e_phnum; i++) {
+		if (phdr[i].p_type == PT_LOAD && !found_load) {
+			found_load = true;
+			load_offset = base + phdr[i].p_offset - phdr[i].p_vaddr;
+		} else if (phdr[i].p_type == PT_DYNAMIC) {
+			dyn = (ElfW(Dyn) *)(base + phdr[i].p_offset);
+		}
+	}
+	if (!found_load || !dyn)
+		return NULL;
+
+	for (; dyn->d_tag != DT_NULL; dyn++) {
+		switch (dyn->d_tag) {
+		case DT_STRTAB:
+			strtab = (const char *)(dyn->d_un.d_ptr + load_offset);
+			break;
+		case DT_SYMTAB:
+			symtab = (ElfW(Sym) *)(dyn->d_un.d_ptr + load_offset);
+			break;
+		case DT_HASH:
+			hash = (uint32_t *)(dyn->d_un.d_ptr + load_offset);
+			break;
+		}
+	}
+	if (!strtab || !symtab || !hash)
 		return NULL;
+
+	/* hash[1] is nchain, the number of symbols */
+	for (uint32_t i = 0; i < hash[1]; i++) {
+		ElfW(Sym) *sym = &symtab[i];
+
+		if (ELF64_ST_TYPE(sym->st_info) != STT_FUNC ||
+		    sym->st_shndx == SHN_UNDEF)
+			continue;
+		if (!strcmp(strtab + sym->st_name, name))
+			return (void *)(sym->st_value + load_offset);
 	}
-	*ret = count;
-	return ret;
+
+	return NULL;
 }
 
-float create_threads(int thread_count, int secs, thread_func func, struct thread_data *td)
+/* x86 calls them __vdso_*, arm64, powerpc and s390 __kernel_* */
+static void *vdso_func(const char *name)
 {
-	unsigned long **counts;
-	float total = 0;
-        pthread_t *threads;
-        int ret;
+	char sym[64];
+	void *addr;
 
-	threads = malloc(thread_count * sizeof(pthread_t));
-	counts = malloc(thread_count * sizeof(unsigned long *));
+	snprintf(sym, sizeof(sym), "__vdso_%s", name);
+	addr = vdso_sym(sym);
+	if (addr)
+		return addr;
 
-        stopping = false;
-	for (int i = 0 ; i < thread_count; i++) {
-		ret = pthread_create(&threads[i], NULL, (void *)func, td);
-		if (ret) {
-			fprintf(stderr, "pthread_create failed: %d\n", ret);
-			return -1;
+	snprintf(sym, sizeof(sym), "__kernel_%s", name);
+	return vdso_sym(sym);
+}
+
+typedef long (*vdso_getcpu_t)(unsigned int *cpu, unsigned int *node, void *cache);
+typedef ssize_t (*vdso_getrandom_t)(void *buf, size_t len, unsigned int flags,
+				    void *state, size_t state_len);
+
+/* From the kernel's vgetrandom, returned when called with state_len ~0 */
+struct vgetrandom_opaque_params {
+	uint32_t size_of_opaque_state;
+	uint32_t mmap_prot;
+	uint32_t mmap_flags;
+	uint32_t reserved[13];
+};
+
+static vdso_getcpu_t vdso_getcpu;
+static vdso_getrandom_t vdso_getrandom;
+static struct vgetrandom_opaque_params vgetrandom_params;
+
+static struct rseq *rseq_area(void)
+{
+	if (!__rseq_size)
+		return NULL;
+	return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/* NULL if the mode can run here, why not otherwise */
+static const char *mode_unavailable(struct thread_data *td)
+{
+	if (td->type == GETCPU) {
+		if (td->mode == CPU_VDSO && !vdso_getcpu)
+			return "no getcpu in the vDSO";
+		if (td->mode == CPU_RSEQ && !rseq_area())
+			return "rseq not registered by libc";
+	}
+	if (td->type == GETRANDOM && td->mode == RANDOM_VDSO && !vdso_getrandom)
+		return "no getrandom in the vDSO (Linux < 6.11)";
+
+	return NULL;
+}
+
+static void vdso_init(void)
+{
+	vdso_getcpu = vdso_func("getcpu");
+	vdso_getrandom = vdso_func("getrandom");
+
+	if (vdso_getrandom &&
+	    vdso_getrandom(NULL, 0, 0, &vgetrandom_params, ~0UL) != 0)
+		vdso_getrandom = NULL;
+}
+
+static void get_cpu(struct bench_worker *w)
+{
+	struct thread_data *td = w->arg;
+	struct bench_hist *hist = w->priv;
+	struct rseq *rs = rseq_area();
+	unsigned long count = 0, sum = 0;
+	unsigned int cpu = 0, node;
+
+	while (!bench_pool_stopping(w)) {
+		uint64_t start = bench_cycles_serial();
+
+		for (int i = 0; i < BATCH; i++) {
+			switch (td->mode) {
+			case CPU_VDSO:
+				vdso_getcpu(&cpu, &node, NULL);
+				break;
+			case CPU_SYSCALL:
+				syscall(SYS_getcpu, &cpu, &node, NULL);
+				break;
+			case CPU_RSEQ:
+				cpu = __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+				break;
+			case CPU_LIBC:
+				cpu = sched_getcpu();
+				break;
+			}
+			sum += cpu;
 		}
+		bench_hist_record(hist, bench_cycles_serial() - start);
+		count += BATCH;
 	}
-        sleep(secs);
-        stopping = true;
-	for (int i = 0 ; i < thread_count; i++) {
-		unsigned long count_per_thread = 0;
 
-		pthread_join(threads[i], (void **)&counts[i]);
-		if (!counts[i]) {
-			continue;
+	// Hack to avoid compiler optimization
+	if (sum == ~0UL)
+		printf("%lu\n", sum);
+	w->ops = count;
+}
+
+static void get_random(struct bench_worker *w)
+{
+	struct thread_data *td = w->arg;
+	struct bench_hist *hist = w->priv;
+	char buf[MAX_RANDOM_SIZE];
+	size_t state_len = 0;
+	unsigned long count = 0;
+	void *state = NULL;
+	int fd = -1;
+
+	/* One opaque state per thread, never shared */
+	if (td->mode == RANDOM_VDSO) {
+		long page = sysconf(_SC_PAGESIZE);
+
+		state_len = (vgetrandom_params.size_of_opaque_state + page - 1) & ~(page - 1);
+		state = mmap(NULL, state_len, vgetrandom_params.mmap_prot,
+			     vgetrandom_params.mmap_flags, -1, 0);
+		if (state == MAP_FAILED)
+			goto fail;
+		state_len = vgetrandom_params.size_of_opaque_state;
+	} else if (td->mode == RANDOM_URANDOM) {
+		fd = open("/dev/urandom", O_RDONLY);
+		if (fd < 0)
+			goto fail;
+	}
+
+	while (!bench_pool_stopping(w)) {
+		uint64_t start = bench_cycles_serial();
+		ssize_t ret = td->size;
+
+		for (int i = 0; i < BATCH && ret == (ssize_t)td->size; i++) {
+			switch (td->mode) {
+			case RANDOM_VDSO:
+				ret = vdso_getrandom(buf, td->size, 0, state, state_len);
+				break;
+			case RANDOM_SYSCALL:
+				ret = syscall(SYS_getrandom, buf, td->size, 0);
+				break;
+			case RANDOM_URANDOM:
+				ret = read(fd, buf, td->size);
+				break;
+			}
 		}
-		count_per_thread = *counts[i];
-		/* return in Millions */
-		total += (count_per_thread / (1000.0 * 1000.0)) / secs;
+		bench_hist_record(hist, bench_cycles_serial() - start);
+		if (ret != (ssize_t)td->size)
+			goto fail;
+		count += BATCH;
+	}
+
+	w->ops = count;
+	goto out;
+
+fail:
+	fprintf(stderr, "getrandom (%s, %zu B) failed: %m\n",
+		random_modes[td->mode], td->size);
+	bench_pool_stop(w->pool);
+	w->ops = 0;
+out:
+	if (state && state != MAP_FAILED)
+		munmap(state, (vgetrandom_params.size_of_opaque_state +
+			       sysconf(_SC_PAGESIZE) - 1) & ~(sysconf(_SC_PAGESIZE) - 1));
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * clock_gettime() silently falls back to the syscall when the vDSO cannot
+ * read the current clocksource (hpet, unstable tsc, ...). Count the
+ * raw_syscalls:sys_enter events of the workers to catch it. The counter is
+ * inherited, so it has to be opened before the workers are created.
+ */
+static int raw_syscalls_id(void)
+{
+	const char *paths[] = {
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+	};
+	int id = -1;
+
+	for (unsigned int i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+		FILE *f = fopen(paths[i], "r");
+
+		if (!f)
+			continue;
+		if (fscanf(f, "%d", &id) != 1)
+			id = -1;
+		fclose(f);
+		if (id >= 0)
+			break;
+	}
+
+	return id;
+}
+
+static int open_syscall_counter(void)
+{
+	struct perf_event_attr attr;
+	int id = raw_syscalls_id();
+
+	if (id < 0)
+		return -1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.size = sizeof(attr);
+	attr.config = id;
+	attr.inherit = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Per call latency, in ns, at the given percentile */
+static double call_ns(const struct bench_hist *hist, double percentile)
+{
+	return bench_cycles_to_ns(bench_hist_percentile(hist, percentile)) / BATCH;
+}
+
+/*
+ * Run thread_count workers for msecs. Fills the throughput, the merged
+ * latency histogram and, when raw_syscalls can be counted, the number of
+ * syscalls per call.
+ */
+static void create_threads(int thread_count, int msecs, bench_worker_fn func,
+			   struct thread_data *td, struct clock_result *res)
+{
+	struct bench_hist *hists;
+	struct bench_pool *pool;
+	uint64_t ops, syscalls;
+	int fd;
+
+	memset(res, 0, sizeof(*res));
+	bench_hist_reset(&res->hist);
+	res->syscalls_per_call = -1;
+
+	hists = malloc(thread_count * sizeof(struct bench_hist));
+	if (!hists) {
+		fprintf(stderr, "Failed to allocate histograms\n");
+		return;
+	}
+
+	fd = open_syscall_counter();
+
+	pool = bench_pool_create(thread_count, NULL, 0, func, td);
+	if (!pool) {
+		fprintf(stderr, "Failed to create the worker pool\n");
+		goto out;
+	}
+	for (int i = 0; i < thread_count; i++) {
+		bench_hist_reset(&hists[i]);
+		pool->workers[i].priv = &hists[i];
+	}
+
+	ops = bench_pool_run_for(pool, msecs);
+
+	for (int i = 0; i < thread_count; i++)
+		bench_hist_merge(&res->hist, &hists[i]);
+
+	if (fd >= 0 && ops && read(fd, &syscalls, sizeof(syscalls)) == sizeof(syscalls))
+		res->syscalls_per_call = (double)syscalls / ops;
+
+	/* M calls per second per thread */
+	res->throughput = ops / (1000.0 * msecs) / thread_count;
+	res->latency = res->throughput ? 1000 / res->throughput : 0;
+
+	bench_pool_destroy(pool);
+out:
+	if (fd >= 0)
+		close(fd);
+	free(hists);
+}
+
+/*
+ * A vDSO clock is a handful of ns while the syscall is one or two hundred,
+ * so either more than one syscall every other call, or a p50 close to the
+ * one of clock_gettime(2), means the vDSO is falling back to the syscall.
+ */
+static const char *clock_path(struct thread_data *td, struct clock_result *res)
+{
+	struct thread_data baseline = *td;
+	struct clock_result *sys;
+
+	if (td->type == SYSCALL)
+		return "syscall";
+	if (td->type == GETCPU || td->type == GETRANDOM) {
+		if (!res->throughput)
+			return "error";
+		/* The vDSO getrandom falls back to the syscall too */
+		if (res->syscalls_per_call > 0.5 && td->mode == 0)
+			return "syscall";
+		return td->type == GETCPU ? cpu_modes[td->mode] :
+					    random_modes[td->mode];
+	}
+	if (td->clockid >= NATIVE_READ && res->throughput)
+		return "native";
+	/* get_time() stops the pool with no ops when the clock fails */
+	if (!res->throughput)
+		return "error";
+
+	sys = malloc(sizeof(*sys));
+	if (!sys)
+		return "unknown";
+
+	baseline.force_syscall = true;
+	baseline.print = false;
+	create_threads(1, 100, get_time, &baseline, sys);
+	res->syscall_p50 = call_ns(&sys->hist, 50);
+	free(sys);
+
+	if (res->syscalls_per_call >= 0)
+		return res->syscalls_per_call > 0.5 ? "syscall" : "vdso";
+
+	return call_ns(&res->hist, 50) > 0.7 * res->syscall_p50 ? "syscall" : "vdso";
+}
+
+/*
+ * How far fastts is from CLOCK_MONOTONIC, sampled every ms for msecs so a
+ * few resyncs are covered. Each sample is bracketed by two clock_gettime()
+ * and compared with their midpoint, wide brackets are dropped.
+ */
+static void fastts_accuracy(int msecs, bool serial, struct clock_result *res)
+{
+	struct timespec tick = { .tv_nsec = 1000 * 1000 };
+
+	bench_hist_reset(&res->err);
+	res->err_worst = 0;
+
+	for (int i = 0; i < msecs; i++) {
+		uint64_t before = bench_now_ns();
+		uint64_t ns = serial ? fastts_ns_serial() : fastts_ns();
+		uint64_t after = bench_now_ns();
+		int64_t err = ns - (before + (after - before) / 2);
+
+		nanosleep(&tick, NULL);
+		/* Preempted in the middle, the midpoint means nothing */
+		if (after - before > 2000)
+			continue;
+
+		bench_hist_record(&res->err, llabs(err));
+		if (llabs(err) > llabs(res->err_worst))
+			res->err_worst = err;
+	}
+}
+
+/* Run one test and decide how it was served, res->path is always set */
+static void measure(int thread_count, int secs, bench_worker_fn func,
+		    struct thread_data *td, struct clock_result *res)
+{
+	create_threads(thread_count, secs * 1000, func, td, res);
+	res->path = clock_path(td, res);
+
+	bench_hist_reset(&res->err);
+	if (td->type == GETTIME && fastts_ok &&
+	    (td->clockid == FASTTS || td->clockid == FASTTS_SERIAL))
+		fastts_accuracy(secs * 1000, td->clockid == FASTTS_SERIAL, res);
+}
+
+static const char *test_name(struct thread_data *td)
+{
+	switch (td->type) {
+	case SYSCALL:
+		return "getpid";
+	case GETCPU:
+		return "getcpu";
+	case GETRANDOM:
+		return "getrandom";
+	default:
+		return clock_names[td->clockid];
 	}
+}
+
+static void print_record(int thread_count, struct thread_data *td,
+			 struct clock_result *res, const char *config)
+{
+	struct bench_result r;
 
-	free(threads);
-	free(counts);
-	return total;
+	bench_result_init(&r, "vdso_bench", test_name(td));
+	r.mode = res->path;
+	r.config = config;
+	r.threads = thread_count;
+	r.ops_per_sec = res->throughput * 1000 * 1000;
+	r.samples = res->hist.count * BATCH;
+	r.min_ns = bench_cycles_to_ns(res->hist.min) / BATCH;
+	r.mean_ns = res->latency;
+	r.p50_ns = call_ns(&res->hist, 50);
+	r.p90_ns = call_ns(&res->hist, 90);
+	r.p99_ns = call_ns(&res->hist, 99);
+	r.max_ns = bench_cycles_to_ns(res->hist.max) / BATCH;
+	bench_result_print(stdout, td->fmt, &r);
 }
 
-void run_for_secs(int thread_count, int secs, thread_func func, struct thread_data *td)
+void run_for_secs(int thread_count, int secs, bench_worker_fn func, struct thread_data *td)
 {
-	double throughput, calls_per_s, latency;
+	struct clock_result *res = malloc(sizeof(*res));
+	const char *unavailable = mode_unavailable(td);
+	double throughput, latency;
+	char config[32] = "";
+
+	if (!res) {
+		fprintf(stderr, "Failed to allocate results\n");
+		return;
+	}
 
+	if (td->type == GETRANDOM)
+		snprintf(config, sizeof(config), "%zu B", td->size);
 
-	calls_per_s = create_threads(thread_count, secs, func, td);
-	throughput = calls_per_s/ thread_count;
-	latency = 1000/(throughput); // in ns
+	if (unavailable) {
+		fprintf(stderr, "%s (%s%s%s): %s\n", test_name(td),
+			td->type == GETCPU ? cpu_modes[td->mode] : random_modes[td->mode],
+			config[0] ? ", " : "", config, unavailable);
+		goto out;
+	}
+
+	measure(thread_count, secs, func, td, res);
+	throughput = res->throughput;
+	latency = res->latency;
+
+	if (td->fmt != BENCH_FMT_TEXT) {
+		print_record(thread_count, td, res, config[0] ? config : NULL);
+		if (res->err.count) {
+			struct bench_result r;
+
+			bench_result_init(&r, "vdso_bench", test_name(td));
+			r.mode = "accuracy";
+			r.config = "CLOCK_MONOTONIC";
+			bench_result_from_hist(&r, &res->err);
+			bench_result_print(stdout, td->fmt, &r);
+		}
+		goto out;
+	}
 
 	switch(td->type) {
 		case (GETTIME):
-			printf("Number of calls to %s (%d) : %.2f M/s per thread. Latency: %.2f ns\n", clock_names[td->clockid],  td->clockid, throughput, latency);
+			printf("Number of calls to %s (%d) : %.2f M/s per thread. Latency: %.2f ns", clock_names[td->clockid],  td->clockid, throughput, latency);
 			break;
 		case (SYSCALL):
-			printf("Number of calls to getpid (2) : %.2f M/s per thread. Latecy %.2f ns\n", throughput, latency);
+			printf("Number of calls to getpid (2) : %.2f M/s per thread. Latecy %.2f ns", throughput, latency);
+			break;
+		case (GETCPU):
+			printf("Number of calls to getcpu (%s) : %.2f M/s per thread. Latency: %.2f ns", cpu_modes[td->mode], throughput, latency);
+			break;
+		case (GETRANDOM):
+			printf("Number of calls to getrandom (%s, %s) : %.2f M/s per thread. Latency: %.2f ns", random_modes[td->mode], config, throughput, latency);
 			break;
 	}
+
+	printf(" | p50=%.2f p90=%.2f p99=%.2f p99.9=%.2f ns | %s",
+	       call_ns(&res->hist, 50), call_ns(&res->hist, 90),
+	       call_ns(&res->hist, 99), call_ns(&res->hist, 99.9), res->path);
+	if (res->syscall_p50)
+		printf(" (syscall p50=%.2f ns", res->syscall_p50);
+	if (res->syscalls_per_call >= 0)
+		printf("%s%.2f syscalls/call", res->syscall_p50 ? ", " : " (",
+		       res->syscalls_per_call);
+	if (res->syscall_p50 || res->syscalls_per_call >= 0)
+		printf(")");
+	if (td->type == GETRANDOM)
+		printf(" | %.2f MB/s", throughput * td->size);
+	if (res->err.count)
+		printf(" | off CLOCK_MONOTONIC p50=%lu p99=%lu worst=%ld ns",
+		       bench_hist_percentile(&res->err, 50),
+		       bench_hist_percentile(&res->err, 99), res->err_worst);
+	printf("\n");
+
+out:
+	free(res);
+}
+
+/*
+ * Clocksource sweep. The watchdog can demote tsc / arch_sys_counter to a
+ * source the vDSO cannot read, this shows what every clock costs then.
+ */
+#define CS_PATH		"/sys/devices/system/clocksource/clocksource0/"
+#define CS_MAX		8
+#define CS_LEN		32
+
+static char cs_saved[CS_LEN];
+
+static int read_clocksource(const char *file, char *buf, size_t len)
+{
+	FILE *f = fopen(file, "r");
+
+	if (!f)
+		return -1;
+	if (!fgets(buf, len, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return 0;
+}
+
+/* Plain open/write so it can be called from a signal handler */
+static int set_clocksource(const char *name)
+{
+	int fd = open(CS_PATH "current_clocksource", O_WRONLY);
+	int ret;
+
+	if (fd < 0)
+		return -1;
+	ret = write(fd, name, strlen(name));
+	close(fd);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static void restore_clocksource(void)
+{
+	if (cs_saved[0])
+		set_clocksource(cs_saved);
+}
+
+static void restore_clocksource_signal(int sig)
+{
+	restore_clocksource();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static int sweep_clocksources(int thread_count, int secs, clockid_t clockid,
+			      struct thread_data *td)
+{
+	char available[CS_MAX * CS_LEN], *tok, *save;
+	char sources[CS_MAX][CS_LEN];
+	int first = clockid == -1 ? 0 : clockid;
+	int last = clockid == -1 ? LAST_CLOCK : clockid;
+	int nr_clocks = last - first + 1;
+	struct clock_result *res;
+	int nr = 0;
+
+	if (read_clocksource(CS_PATH "available_clocksource", available,
+			     sizeof(available)) ||
+	    read_clocksource(CS_PATH "current_clocksource", cs_saved,
+			     sizeof(cs_saved))) {
+		fprintf(stderr, "Cannot read " CS_PATH "\n");
+		return -1;
+	}
+
+	for (tok = strtok_r(available, " ", &save); tok && nr < CS_MAX;
+	     tok = strtok_r(NULL, " ", &save))
+		snprintf(sources[nr++], CS_LEN, "%s", tok);
+
+	res = calloc(nr * nr_clocks, sizeof(*res));
+	if (!res) {
+		fprintf(stderr, "Failed to allocate results\n");
+		return -1;
+	}
+
+	atexit(restore_clocksource);
+	signal(SIGINT, restore_clocksource_signal);
+	signal(SIGTERM, restore_clocksource_signal);
+
+	td->type = GETTIME;
+	for (int s = 0; s < nr; s++) {
+		if (set_clocksource(sources[s])) {
+			/* path stays NULL, printed as "-" */
+			fprintf(stderr, "Cannot switch to %s: %m\n", sources[s]);
+			continue;
+		}
+		/* Let the timekeeping and the vDSO data page pick it up */
+		usleep(100 * 1000);
+
+		for (int c = 0; c < nr_clocks; c++) {
+			struct clock_result *r = &res[s * nr_clocks + c];
+
+			td->clockid = first + c;
+			measure(thread_count, secs, get_time, td, r);
+			if (td->fmt != BENCH_FMT_TEXT)
+				print_record(thread_count, td, r, sources[s]);
+		}
+	}
+
+	restore_clocksource();
+
+	if (td->fmt == BENCH_FMT_TEXT) {
+		printf("\np50 ns per call (path), %d threads\n", thread_count);
+		printf("%-26s", "clock");
+		for (int s = 0; s < nr; s++)
+			printf(" %22s", sources[s]);
+		printf("\n");
+
+		for (int c = 0; c < nr_clocks; c++) {
+			printf("%-26s", clock_names[first + c]);
+			for (int s = 0; s < nr; s++) {
+				struct clock_result *r = &res[s * nr_clocks + c];
+				char cell[CS_LEN];
+
+				if (!r->path)
+					snprintf(cell, sizeof(cell), "-");
+				else if (!r->throughput)
+					snprintf(cell, sizeof(cell), "error");
+				else
+					snprintf(cell, sizeof(cell), "%.2f (%s)",
+						 call_ns(&r->hist, 50), r->path);
+				printf(" %22s", cell);
+			}
+			printf("\n");
+		}
+	}
+
+	free(res);
+
+	return 0;
+}
+
+
+
+/*
+ * Time namespace mode. Inside a time namespace with offsets the vDSO reads
+ * the timens page first and adds the offsets, compare that with the root
+ * namespace. unshare(CLONE_NEWTIME) only applies to the children, so the
+ * namespaced side runs in a forked child and sends its numbers back.
+ */
+#define TIMENS_OFFSET	86400	/* s, for both monotonic and boottime */
+
+#ifndef CLONE_NEWTIME
+#define CLONE_NEWTIME	0x00000080
+#endif
+
+struct timens_summary {
+	double throughput;
+	double latency;
+	uint64_t samples;
+	double min;
+	double p50;
+	double p90;
+	double p99;
+	double max;
+	char path[16];
+};
+
+static void summarise(struct clock_result *res, struct timens_summary *sum)
+{
+	sum->throughput = res->throughput;
+	sum->latency = res->latency;
+	sum->samples = res->hist.count * BATCH;
+	sum->min = bench_cycles_to_ns(res->hist.min) / BATCH;
+	sum->p50 = call_ns(&res->hist, 50);
+	sum->p90 = call_ns(&res->hist, 90);
+	sum->p99 = call_ns(&res->hist, 99);
+	sum->max = bench_cycles_to_ns(res->hist.max) / BATCH;
+	snprintf(sum->path, sizeof(sum->path), "%s", res->path);
+}
+
+static double monotonic_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Runs in the child, the first value sent is its CLOCK_MONOTONIC */
+static void timens_child(int fd, int thread_count, int secs, int first,
+			 int nr_clocks, struct thread_data *td)
+{
+	struct clock_result *res = malloc(sizeof(*res));
+	struct timens_summary sum;
+	double now = monotonic_secs();
+
+	if (!res || write(fd, &now, sizeof(now)) != sizeof(now))
+		exit(1);
+
+	for (int c = 0; c < nr_clocks; c++) {
+		td->clockid = first + c;
+		measure(thread_count, secs, get_time, td, res);
+		summarise(res, &sum);
+		if (write(fd, &sum, sizeof(sum)) != sizeof(sum))
+			exit(1);
+	}
+
+	exit(0);
+}
+
+static int timens_compare(int thread_count, int secs, clockid_t clockid,
+			  struct thread_data *td)
+{
+	char offsets[64];
+	int first = clockid == -1 ? 0 : clockid;
+	int last = clockid == -1 ? LAST_CLOCK : clockid;
+	int nr_clocks = last - first + 1;
+	struct timens_summary *ns, *root;
+	struct clock_result *res;
+	double ns_now, root_now;
+	int pipefd[2], fd, status;
+	pid_t pid;
+
+	if (unshare(CLONE_NEWTIME)) {
+		fprintf(stderr, "unshare(CLONE_NEWTIME): %m\n");
+		return -1;
+	}
+
+	/* Only allowed before a task enters the namespace */
+	snprintf(offsets, sizeof(offsets), "monotonic %d 0\nboottime %d 0\n",
+		 TIMENS_OFFSET, TIMENS_OFFSET);
+	fd = open("/proc/self/timens_offsets", O_WRONLY);
+	if (fd < 0 || write(fd, offsets, strlen(offsets)) < 0) {
+		fprintf(stderr, "Cannot set the time namespace offsets: %m\n");
+		return -1;
+	}
+	close(fd);
+
+	ns = calloc(nr_clocks, sizeof(*ns));
+	root = calloc(nr_clocks, sizeof(*root));
+	res = malloc(sizeof(*res));
+	if (!ns || !root || !res || pipe(pipefd)) {
+		fprintf(stderr, "Failed to allocate results\n");
+		return -1;
+	}
+
+	td->type = GETTIME;
+
+	/* One side at a time, so they do not compete for the CPUs */
+	root_now = monotonic_secs();
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork: %m\n");
+		return -1;
+	}
+	if (!pid) {
+		close(pipefd[0]);
+		timens_child(pipefd[1], thread_count, secs, first, nr_clocks, td);
+	}
+
+	close(pipefd[1]);
+	if (read(pipefd[0], &ns_now, sizeof(ns_now)) != sizeof(ns_now))
+		goto child_failed;
+	for (int c = 0; c < nr_clocks; c++)
+		if (read(pipefd[0], &ns[c], sizeof(ns[c])) != sizeof(ns[c]))
+			goto child_failed;
+	close(pipefd[0]);
+	waitpid(pid, &status, 0);
+
+	for (int c = 0; c < nr_clocks; c++) {
+		td->clockid = first + c;
+		measure(thread_count, secs, get_time, td, res);
+		summarise(res, &root[c]);
+	}
+
+	if (td->fmt != BENCH_FMT_TEXT) {
+		for (int c = 0; c < nr_clocks; c++) {
+			struct bench_result r;
+
+			for (int side = 0; side < 2; side++) {
+				struct timens_summary *sum = side ? &ns[c] : &root[c];
+
+				bench_result_init(&r, "vdso_bench", clock_names[first + c]);
+				r.mode = sum->path;
+				r.config = side ? "timens" : "root";
+				r.threads = thread_count;
+				r.ops_per_sec = sum->throughput * 1000 * 1000;
+				r.samples = sum->samples;
+				r.min_ns = sum->min;
+				r.mean_ns = sum->latency;
+				r.p50_ns = sum->p50;
+				r.p90_ns = sum->p90;
+				r.p99_ns = sum->p99;
+				r.max_ns = sum->max;
+				bench_result_print(stdout, td->fmt, &r);
+			}
+		}
+		goto out;
+	}
+
+	printf("\ntime namespace offset: %.0f s, %d threads\n",
+	       ns_now - root_now, thread_count);
+	printf("%-26s %30s %30s %8s\n", "clock", "root M/s p50 ns",
+	       "timens M/s p50 ns", "delta");
+	for (int c = 0; c < nr_clocks; c++) {
+		char cell[2][64];
+
+		for (int side = 0; side < 2; side++) {
+			struct timens_summary *sum = side ? &ns[c] : &root[c];
+
+			snprintf(cell[side], sizeof(cell[side]), "%.2f %.2f (%s)",
+				 sum->throughput, sum->p50, sum->path);
+		}
+		printf("%-26s %30s %30s", clock_names[first + c], cell[0], cell[1]);
+		if (root[c].p50 && root[c].throughput && ns[c].throughput)
+			printf(" %+7.1f%%", 100 * (ns[c].p50 - root[c].p50) / root[c].p50);
+		printf("\n");
+	}
+
+out:
+	free(res);
+	free(root);
+	free(ns);
+	return 0;
+
+child_failed:
+	fprintf(stderr, "The time namespace child failed\n");
+	waitpid(pid, &status, 0);
+	return -1;
+}
+
+
+
+/*
+ * Cross CPU monotonicity. One reader pinned on every CPU, they hand a
+ * shared head around with a CAS. The reader that moves head from s to s + 1
+ * read its clock after it saw head == s, so after the reader of entry s - 1
+ * read its own: t(s) < t(s - 1) is a backward step, and how far back it
+ * went is a lower bound of the skew between the two CPUs. Entries are
+ * published in a ring, each winner checks itself against its predecessor.
+ * A winner preempted before publishing holds head back by one lap at most.
+ */
+#define MONO_RING	4096
+
+struct mono_entry {
+	uint64_t seq;		/* s + 1 once published */
+	uint64_t ns;
+	int cpu;
+};
+
+struct mono_stats {
+	uint64_t reads;
+	uint64_t entries;
+	uint64_t handoffs;	/* entries whose predecessor ran on another CPU */
+	uint64_t backward;
+	uint64_t max_skew;	/* ns, largest backward step */
+	int skew_from;
+	int skew_to;
+	struct bench_hist gap;	/* ns between cross CPU consecutive entries */
+};
+
+static struct mono_entry mono_ring[MONO_RING];
+static uint64_t mono_head __attribute__((aligned(64)));
+
+static inline uint64_t mono_now(struct thread_data *td)
+{
+	struct timespec ts;
+
+	if (td->clockid == NATIVE_READ)
+		return bench_cycles_to_ns(bench_cycles_serial());
+
+	read_clock(td, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void mono_reader(struct bench_worker *w)
+{
+	struct thread_data *td = w->arg;
+	struct mono_stats *st = w->priv;
+
+	while (!bench_pool_stopping(w)) {
+		uint64_t s = __atomic_load_n(&mono_head, __ATOMIC_ACQUIRE);
+		uint64_t now = mono_now(td);
+		struct mono_entry *prev, *e;
+		uint64_t prev_ns;
+		int prev_cpu;
+
+		st->reads++;
+
+		/*
+		 * Entry s may only be claimed once the one a lap before it is
+		 * published, so a slot never has two writers at once.
+		 */
+		e = &mono_ring[s % MONO_RING];
+		if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) !=
+		    (s < MONO_RING ? 0 : s + 1 - MONO_RING))
+			continue;
+
+		if (!__atomic_compare_exchange_n(&mono_head, &s, s + 1, false,
+						 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			continue;
+
+		/* seqlock style, a lapped reader must not see half an entry */
+		__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		__atomic_store_n(&e->ns, now, __ATOMIC_RELAXED);
+		__atomic_store_n(&e->cpu, w->cpu, __ATOMIC_RELAXED);
+		__atomic_store_n(&e->seq, s + 1, __ATOMIC_RELEASE);
+		st->entries++;
+
+		if (!s)
+			continue;
+
+		/* The predecessor won its CAS already, it is about to publish */
+		prev = &mono_ring[(s - 1) % MONO_RING];
+		while (__atomic_load_n(&prev->seq, __ATOMIC_ACQUIRE) < s)
+			if (bench_pool_stopping(w))
+				return;
+		prev_ns = __atomic_load_n(&prev->ns, __ATOMIC_RELAXED);
+		prev_cpu = __atomic_load_n(&prev->cpu, __ATOMIC_RELAXED);
+		/* Lapped by the ring, nothing to compare with */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&prev->seq, __ATOMIC_RELAXED) != s)
+			continue;
+
+		if (prev_cpu == w->cpu)
+			continue;
+
+		st->handoffs++;
+		if (now < prev_ns) {
+			st->backward++;
+			if (prev_ns - now > st->max_skew) {
+				st->max_skew = prev_ns - now;
+				st->skew_from = prev_cpu;
+				st->skew_to = w->cpu;
+			}
+		} else {
+			bench_hist_record(&st->gap, now - prev_ns);
+		}
+	}
+}
+
+static int check_monotonic(int secs, clockid_t clockid, struct thread_data *td)
+{
+	struct mono_stats *stats, total = {};
+	struct bench_pool *pool;
+	int *cpus, nr_cpus;
+
+	if (clockid == -1)
+		clockid = CLOCK_MONOTONIC;
+	td->type = GETTIME;
+	td->clockid = clockid;
+
+	nr_cpus = bench_cpu_list(&cpus);
+	if (nr_cpus < 2) {
+		fprintf(stderr, "Needs at least two CPUs\n");
+		return -1;
+	}
+
+	stats = calloc(nr_cpus, sizeof(*stats));
+	if (!stats)
+		return -1;
+
+	pool = bench_pool_create(nr_cpus, cpus, nr_cpus, mono_reader, td);
+	if (!pool) {
+		fprintf(stderr, "Failed to create the worker pool\n");
+		return -1;
+	}
+	for (int i = 0; i < nr_cpus; i++) {
+		bench_hist_reset(&stats[i].gap);
+		stats[i].skew_from = stats[i].skew_to = -1;
+		pool->workers[i].priv = &stats[i];
+	}
+
+	bench_pool_run_for(pool, secs * 1000);
+
+	bench_hist_reset(&total.gap);
+	total.skew_from = total.skew_to = -1;
+	for (int i = 0; i < nr_cpus; i++) {
+		struct mono_stats *st = &stats[i];
+
+		total.reads += st->reads;
+		total.entries += st->entries;
+		total.handoffs += st->handoffs;
+		total.backward += st->backward;
+		if (st->max_skew > total.max_skew) {
+			total.max_skew = st->max_skew;
+			total.skew_from = st->skew_from;
+			total.skew_to = st->skew_to;
+		}
+		bench_hist_merge(&total.gap, &st->gap);
+	}
+
+	if (td->fmt != BENCH_FMT_TEXT) {
+		struct bench_result r;
+
+		bench_result_init(&r, "vdso_bench", clock_names[clockid]);
+		r.mode = total.backward ? "backward" : "monotonic";
+		r.config = "cross-cpu";
+		r.threads = nr_cpus;
+		r.ops_per_sec = (double)total.reads / secs / nr_cpus;
+		bench_result_from_hist(&r, &total.gap);
+		bench_result_print(stdout, td->fmt, &r);
+		goto out;
+	}
+
+	printf("%s across %d CPUs for %d seconds\n", clock_names[clockid], nr_cpus, secs);
+	printf("\treads:       %.2f M/s per CPU, %.2f ns per read + handoff\n",
+	       total.reads / (1e6 * secs) / nr_cpus,
+	       total.reads ? 1e9 * secs * nr_cpus / total.reads : 0);
+	printf("\tentries:     %lu, %lu handed to another CPU\n",
+	       total.entries, total.handoffs);
+	printf("\tgap:         p50=%lu p99=%lu max=%lu ns between cross CPU entries\n",
+	       bench_hist_percentile(&total.gap, 50),
+	       bench_hist_percentile(&total.gap, 99), total.gap.count ? total.gap.max : 0);
+	printf("\tbackward:    %lu steps", total.backward);
+	if (total.backward)
+		printf(", max skew %lu ns (CPU %d -> CPU %d)", total.max_skew,
+		       total.skew_from, total.skew_to);
+	printf("\n");
+
+	for (int i = 0; i < nr_cpus; i++) {
+		if (!stats[i].backward)
+			continue;
+		printf("\t  CPU %3d: %lu backward steps, max %lu ns from CPU %d\n",
+		       cpus[i], stats[i].backward, stats[i].max_skew,
+		       stats[i].skew_from);
+	}
+
+out:
+	bench_pool_destroy(pool);
+	free(stats);
+	free(cpus);
+	return total.backward ? 2 : 0;
 }
 
 
@@ -237,6 +1339,10 @@ void run_for_secs(int thread_count, int secs, thread_func func, struct thread_da
 void print_help(const char *name)
 {
 	fprintf(stderr, " Benchmark clock_gettime(3) function:\n\n");
+	fprintf(stderr, " Per call percentiles come from batches of %d calls bracketed by\n", BATCH);
+	fprintf(stderr, " counter reads. Each clock is flagged vdso or syscall by counting\n");
+	fprintf(stderr, " raw_syscalls events (needs perf access) or, failing that, by\n");
+	fprintf(stderr, " comparing it with a clock_gettime(2) baseline.\n\n");
 	fprintf(stderr, "%s <arguments>:\n", name);
 	fprintf(stderr, "	-h                 : This help\n");
 	fprintf(stderr, "	-s       	   : Only test the syscall benchmark\n");
@@ -246,9 +1352,20 @@ void print_help(const char *name)
 	fprintf(stderr, "	-p <threads_count> : Number of threads running clock_gettime() in a loop\n");
 	fprintf(stderr, "	-c <clockid>       : clock id argument\n");
 	fprintf(stderr, "	-v		   : verbose (print clock time returened)\n");
+	fprintf(stderr, "	-f <format>        : text (default), csv or json records\n");
+	fprintf(stderr, "	-R <ms>            : fastts resync interval (default %u)\n", fastts_resync_ms);
+	fprintf(stderr, "	-C                 : getcpu through the vDSO, the syscall, rseq cpu_id and sched_getcpu()\n");
+	fprintf(stderr, "	-r                 : getrandom through the vDSO, the syscall and /dev/urandom\n");
+	fprintf(stderr, "	-B <bytes>         : getrandom buffer size (default 16 to 4096, max %d)\n", MAX_RANDOM_SIZE);
+	fprintf(stderr, "	-n                 : compare the clocks in a time namespace with %d s offsets\n", TIMENS_OFFSET);
+	fprintf(stderr, "	                     against the root namespace (root)\n");
+	fprintf(stderr, "	-m                 : cross CPU monotonicity check, one reader per CPU on\n");
+	fprintf(stderr, "	                     the -c clock (CLOCK_MONOTONIC), exits 2 on backward steps\n");
+	fprintf(stderr, "	-S                 : run the clocks under every available clocksource\n");
+	fprintf(stderr, "	                     and print one table (root, restores the current one)\n");
 
 	fprintf(stderr, "\t   Supported clock ids\n");
-	for (int i = 0; i <= 10; i++) {
+	for (int i = 0; i <= LAST_CLOCK; i++) {
 		fprintf(stderr, "\t\t%d : %s\n", i, clock_names[i]);
 	}
 	fprintf(stderr, "\n");
@@ -265,10 +1382,16 @@ int main(int argc, char **argv)
 	clockid_t clockid = -1;
 	int arg;
 	bool syscall_only = false;
+	bool sweep = false;
+	bool timens = false;
+	bool monotonic = false;
+	bool getcpu_modes = false;
+	bool random_modes_run = false;
+	size_t random_size = 0;
 
 	struct thread_data td = {};
 
-	while ((arg = getopt (argc, argv, "ht:p:c:sibv")) != -1) {
+	while ((arg = getopt (argc, argv, "ht:p:c:sibvf:SnmR:CrB:")) != -1) {
 		switch (arg)
 		{
 			case 'h':
@@ -296,16 +1419,90 @@ int main(int argc, char **argv)
 			case 'v':
 				td.print = true;
 				break;
+			case 'f':
+				if (bench_parse_format(optarg) < 0) {
+					print_help(argv[0]);
+					return 1;
+				}
+				td.fmt = bench_parse_format(optarg);
+				break;
+			case 'S':
+				sweep = true;
+				break;
+			case 'n':
+				timens = true;
+				break;
+			case 'C':
+				getcpu_modes = true;
+				break;
+			case 'r':
+				random_modes_run = true;
+				break;
+			case 'B':
+				random_size = atoi(optarg);
+				if (!random_size || random_size > MAX_RANDOM_SIZE) {
+					print_help(argv[0]);
+					return 1;
+				}
+				break;
+			case 'R':
+				fastts_resync_ms = atoi(optarg);
+				break;
+			case 'm':
+				monotonic = true;
+				break;
 		}
 	}
 
 
-	printf("running %d threads for %d seconds\n", threads_count, timeout);
-	if (td.barrier && clockid != 10) {
+	if (td.fmt == BENCH_FMT_TEXT && !monotonic)
+		printf("running %d threads for %d seconds\n", threads_count, timeout);
+	bench_result_header(stdout, td.fmt);
+	if (td.barrier && clockid != NATIVE_READ) {
 		fprintf(stderr, "Barriers parameter is only valid for getcnt clockid\n");
 		exit(-1);
 	}
 
+	if (clockid == -1 || clockid >= FASTTS) {
+		fastts_ok = !fastts_init(fastts_resync_ms);
+		if (!fastts_ok)
+			fprintf(stderr, "fastts: cannot calibrate the counter\n");
+	}
+
+	if (getcpu_modes || random_modes_run) {
+		vdso_init();
+
+		td.type = GETCPU;
+		for (int m = 0; getcpu_modes && m < NR_CPU_MODES; m++) {
+			td.mode = m;
+			run_for_secs(threads_count, timeout, get_cpu, &td);
+		}
+
+		td.type = GETRANDOM;
+		for (unsigned int i = 0; random_modes_run &&
+		     i < sizeof(random_sizes) / sizeof(random_sizes[0]); i++) {
+			td.size = random_size ? random_size : random_sizes[i];
+			for (int m = 0; m < NR_RANDOM_MODES; m++) {
+				td.mode = m;
+				run_for_secs(threads_count, timeout, get_random, &td);
+			}
+			if (random_size)
+				break;
+		}
+
+		return 0;
+	}
+
+	if (monotonic) {
+		int ret = check_monotonic(timeout, clockid, &td);
+
+		return ret < 0 ? 1 : ret;
+	}
+	if (timens)
+		return timens_compare(threads_count, timeout, clockid, &td) ? 1 : 0;
+	if (sweep)
+		return sweep_clocksources(threads_count, timeout, clockid, &td) ? 1 : 0;
+
 	/* Execute syscall test if no parameter is passed
 	 * or syscall_only
 	 */
@@ -320,7 +1517,7 @@ int main(int argc, char **argv)
 	td.type = GETTIME;
 	if (clockid == -1) {
 		/* by default, do not run all types*/
-		for (int i = 0; i <= 10; i++) {
+		for (int i = 0; i <= LAST_CLOCK; i++) {
 			td.clockid = i;
 			run_for_secs(threads_count, timeout, get_time, &td);
 		}
@@ -0,0 +1,72 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+# Sweep wq_bench over every workqueue flavour, and every affinity scope for
+# the unbound one, at a list of rates.
+#
+#   ./run.sh [rate...]                 default: 10000 100000 0 (flat out)
+#
+# DURATION_MS, PRODUCERS, ITEMS, WORK_US and SLEEP_US are passed to the
+# module. Results go to results/wq_bench_<kernel>_<date>.txt.
+
+set -euo pipefail
+
+DURATION_MS=${DURATION_MS:-5000}
+PRODUCERS=${PRODUCERS:-0}
+ITEMS=${ITEMS:-64}
+WORK_US=${WORK_US:-0}
+SLEEP_US=${SLEEP_US:-0}
+RATES=("$@")
+[[ $# -gt 0 ]] || RATES=(10000 100000 0)
+
+DEBUGFS=/sys/kernel/debug/wq_bench
+UNBOUND=/sys/devices/virtual/workqueue/wq_bench_unbound
+SCOPES=(cpu smt cache cache_shard numa system)
+
+die() { echo "ERROR: $*" >&2; exit 1; }
+[[ $EUID -eq 0 ]] || die "must run as root"
+
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+if [[ ! -d "$DEBUGFS" ]]; then
+	insmod "$(dirname "$0")/wq_bench.ko" || die "build wq_bench.ko first (make KDIR=...)"
+	trap 'rmmod wq_bench' EXIT
+fi
+
+echo "$DURATION_MS" > "$DEBUGFS/duration_ms"
+echo "$PRODUCERS" > "$DEBUGFS/producers"
+echo "$ITEMS" > "$DEBUGFS/items"
+echo "$WORK_US" > "$DEBUGFS/work_us"
+echo "$SLEEP_US" > "$DEBUGFS/sleep_us"
+
+mkdir -p results
+out=results/wq_bench_$(uname -r)_$(date +%Y%m%d_%H%M%S).txt
+echo "==> $(nproc) CPUs, default scope $(cat /sys/module/workqueue/parameters/default_affinity_scope)" | tee "$out"
+
+run() {
+	local wq=$1 scope=$2 rate=$3
+
+	echo "$wq" > "$DEBUGFS/wq"
+	echo "$rate" > "$DEBUGFS/rate"
+	echo 1 > "$DEBUGFS/run"
+	{
+		echo "==> wq=$wq scope=$scope rate=$rate"
+		cat "$DEBUGFS/results"
+		echo
+	} | tee -a "$out"
+}
+
+for rate in "${RATES[@]}"; do
+	for wq in percpu highpri intensive ordered; do
+		run "$wq" - "$rate"
+	done
+	for scope in "${SCOPES[@]}"; do
+		# cache_shard only exists on recent kernels
+		if ! echo "$scope" > "$UNBOUND/affinity_scope" 2>/dev/null; then
+			echo "skipping scope $scope, not supported"
+			continue
+		fi
+		run unbound "$scope" "$rate"
+	done
+done
+echo default > "$UNBOUND/affinity_scope"
+
+echo "==> Results in $out"
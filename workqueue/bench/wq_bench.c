@@ -0,0 +1,553 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * wq_bench - workqueue latency and throughput benchmark.
+ *
+ * One producer kthread per selected CPU queues work items at a fixed rate
+ * on one of the benchmark workqueues:
+ *
+ *   percpu     per-CPU, the default system_wq flavour
+ *   unbound    WQ_UNBOUND, its affinity_scope is changed through sysfs
+ *   highpri    per-CPU WQ_HIGHPRI
+ *   intensive  per-CPU WQ_CPU_INTENSIVE
+ *   ordered    alloc_ordered_workqueue()
+ *
+ * Every item records queue-to-start latency (how long it sat in the pool
+ * worklist) and execution time, in per-CPU histograms merged on read.
+ *
+ * Usage (QEMU guest or bare metal, debugfs mounted):
+ *   insmod wq_bench.ko
+ *   cd /sys/kernel/debug/wq_bench
+ *   echo unbound > wq
+ *   echo cache > /sys/devices/virtual/workqueue/wq_bench_unbound/affinity_scope
+ *   echo 200000 > rate; echo 5000 > duration_ms; echo 1 > run
+ *   cat results
+ *
+ * Knobs:
+ *   rate         works/s across all producers, 0 queues as fast as items free up
+ *   duration_ms  length of a run, "run" blocks for that long
+ *   producers    number of producer CPUs, 0 for every online CPU
+ *   items        in-flight work items per producer, a busy item is an overrun
+ *   work_us      busy loop inside the work function
+ *   sleep_us     sleep inside the work function, exercises the concurrency
+ *                manager (a sleeping per-CPU worker lets the next one run)
+ *
+ * run.sh in this directory sweeps every workqueue and affinity scope.
+ */
+
+#include <linux/bitops.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+/* WQ_PERCPU only exists since 6.17, per-CPU was implied before */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#define WQ_PERCPU	0
+#endif
+
+/*
+ * Log-linear histogram: values below 8ns get their own bucket, above that
+ * every power of two is split in 8, so percentiles are within 12.5%.
+ */
+#define HIST_SUB_BITS	3
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct wqb_hist {
+	u64 count[HIST_BUCKETS];
+	u64 samples;
+	u64 sum;
+	u64 max;
+};
+
+struct wqb_stats {
+	struct wqb_hist start;
+	struct wqb_hist exec;
+	u64 executed;
+	u64 local;		/* started on the CPU that queued it */
+};
+
+struct wqb_item {
+	struct work_struct work;
+	u64 queued_ns;
+	int producer_cpu;
+	atomic_t busy;
+};
+
+struct wqb_producer {
+	struct task_struct *task;
+	struct wqb_item *items;
+	unsigned int nr_items;
+	int cpu;
+	u64 queued;
+	u64 overruns;
+};
+
+enum {
+	WQB_PERCPU,
+	WQB_UNBOUND,
+	WQB_HIGHPRI,
+	WQB_INTENSIVE,
+	WQB_ORDERED,
+	WQB_NR,
+};
+
+static const char * const wqb_names[] = {
+	[WQB_PERCPU]	= "percpu",
+	[WQB_UNBOUND]	= "unbound",
+	[WQB_HIGHPRI]	= "highpri",
+	[WQB_INTENSIVE]	= "intensive",
+	[WQB_ORDERED]	= "ordered",
+};
+
+static struct workqueue_struct *wqb_wqs[WQB_NR];
+static struct wqb_stats __percpu *wqb_stats;
+static struct wqb_producer *wqb_producers;
+static struct dentry *wqb_dir;
+static DEFINE_MUTEX(wqb_mutex);
+
+static int wqb_type = WQB_PERCPU;
+static u32 rate = 100000;
+static u32 duration_ms = 5000;
+static u32 producers;
+static u32 items = 64;
+static u32 work_us;
+static u32 sleep_us;
+
+/* Results of the last run, for the results file */
+static int last_type = -1;
+static u32 last_producers, last_rate, last_items, last_work_us, last_sleep_us;
+static u64 last_elapsed_ns, last_queued, last_overruns;
+
+static unsigned int hist_bucket(u64 v)
+{
+	unsigned int msb;
+
+	if (v < HIST_SUB)
+		return v;
+	msb = fls64(v) - 1;
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+	       ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static u64 hist_value(unsigned int bucket)
+{
+	unsigned int msb;
+
+	if (bucket < HIST_SUB)
+		return bucket;
+	msb = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+	return (u64)(HIST_SUB + bucket % HIST_SUB) << (msb - HIST_SUB_BITS);
+}
+
+static void hist_record(struct wqb_hist *h, u64 v)
+{
+	h->count[hist_bucket(v)]++;
+	h->samples++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void hist_merge(struct wqb_hist *dst, const struct wqb_hist *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->count[i] += src->count[i];
+	dst->samples += src->samples;
+	dst->sum += src->sum;
+	dst->max = max(dst->max, src->max);
+}
+
+static u64 hist_pct(const struct wqb_hist *h, unsigned int permille)
+{
+	u64 want = div_u64(h->samples * permille + 999, 1000), seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen && seen >= want)
+			return min(hist_value(i), h->max);
+	}
+	return h->max;
+}
+
+static void wqb_work_fn(struct work_struct *work)
+{
+	struct wqb_item *item = container_of(work, struct wqb_item, work);
+	int cpu = raw_smp_processor_id();
+	u64 start = ktime_get_ns(), end = start;
+	struct wqb_stats *st;
+
+	if (last_work_us) {
+		u64 until = start + (u64)last_work_us * NSEC_PER_USEC;
+
+		while ((end = ktime_get_ns()) < until)
+			cpu_relax();
+	}
+	if (last_sleep_us) {
+		usleep_range(last_sleep_us, last_sleep_us + last_sleep_us / 8 + 1);
+		end = ktime_get_ns();
+	}
+
+	/* Counted on the CPU the item finished on, unbound items may move */
+	st = get_cpu_ptr(wqb_stats);
+	hist_record(&st->start, start - item->queued_ns);
+	hist_record(&st->exec, end - start);
+	st->executed++;
+	if (cpu == item->producer_cpu)
+		st->local++;
+	put_cpu_ptr(wqb_stats);
+
+	atomic_set_release(&item->busy, 0);
+}
+
+static bool wqb_queue_one(struct wqb_producer *p, struct workqueue_struct *wq,
+			  unsigned int *cursor)
+{
+	struct wqb_item *item = &p->items[*cursor];
+
+	if (atomic_cmpxchg_acquire(&item->busy, 0, 1))
+		return false;
+
+	*cursor = (*cursor + 1) % p->nr_items;
+	item->queued_ns = ktime_get_ns();
+	queue_work(wq, &item->work);
+	p->queued++;
+	return true;
+}
+
+static int wqb_producer_fn(void *data)
+{
+	struct wqb_producer *p = data;
+	struct workqueue_struct *wq = wqb_wqs[last_type];
+	u64 interval = 0, start = ktime_get_ns();
+	unsigned int cursor = 0;
+
+	if (last_rate)
+		interval = div_u64((u64)NSEC_PER_SEC * last_producers, last_rate) ? : 1;
+
+	while (!kthread_should_stop()) {
+		u64 elapsed, due;
+		s64 left;
+
+		if (!interval) {
+			/* Flat out, back off only when every item is in flight */
+			if (!wqb_queue_one(p, wq, &cursor))
+				cond_resched();
+			continue;
+		}
+
+		elapsed = ktime_get_ns() - start;
+		due = div64_u64(elapsed, interval) + 1;
+		while (p->queued + p->overruns < due) {
+			if (!wqb_queue_one(p, wq, &cursor))
+				p->overruns++;
+		}
+
+		/* Sleep until the next item is due, spin when it is that close */
+		left = due * interval - (ktime_get_ns() - start);
+		if (left > 2 * NSEC_PER_USEC)
+			usleep_range(div_u64(left, NSEC_PER_USEC),
+				     div_u64(left, NSEC_PER_USEC) + 10);
+		else
+			cond_resched();
+	}
+	return 0;
+}
+
+static void wqb_free_producers(unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		kfree(wqb_producers[i].items);
+	kfree(wqb_producers);
+	wqb_producers = NULL;
+}
+
+static int wqb_run(void)
+{
+	unsigned int nr = producers ? : num_online_cpus();
+	unsigned int nr_items = items;
+	unsigned int i, j;
+	u64 start;
+	int cpu, ret = 0;
+
+	if (!nr_items)
+		return -EINVAL;
+	nr = min(nr, num_online_cpus());
+
+	wqb_producers = kcalloc(nr, sizeof(*wqb_producers), GFP_KERNEL);
+	if (!wqb_producers)
+		return -ENOMEM;
+
+	i = 0;
+	for_each_online_cpu(cpu) {
+		struct wqb_producer *p = &wqb_producers[i];
+
+		if (i == nr)
+			break;
+		p->cpu = cpu;
+		p->nr_items = nr_items;
+		p->items = kcalloc(nr_items, sizeof(*p->items), GFP_KERNEL);
+		if (!p->items) {
+			wqb_free_producers(i + 1);
+			return -ENOMEM;
+		}
+		for (j = 0; j < nr_items; j++) {
+			INIT_WORK(&p->items[j].work, wqb_work_fn);
+			p->items[j].producer_cpu = cpu;
+		}
+		i++;
+	}
+	nr = i;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(wqb_stats, cpu), 0, sizeof(struct wqb_stats));
+	last_producers = nr;
+	last_rate = rate;
+	last_items = nr_items;
+	last_work_us = work_us;
+	last_sleep_us = sleep_us;
+	last_type = wqb_type;
+
+	for (i = 0; i < nr; i++) {
+		struct wqb_producer *p = &wqb_producers[i];
+
+		p->task = kthread_create(wqb_producer_fn, p, "wq_bench/%d", p->cpu);
+		if (IS_ERR(p->task)) {
+			ret = PTR_ERR(p->task);
+			break;
+		}
+		kthread_bind(p->task, p->cpu);
+	}
+	if (ret) {
+		while (i--)
+			kthread_stop(wqb_producers[i].task);
+		wqb_free_producers(nr);
+		return ret;
+	}
+
+	start = ktime_get_ns();
+	for (i = 0; i < nr; i++)
+		wake_up_process(wqb_producers[i].task);
+
+	msleep_interruptible(duration_ms);
+
+	last_queued = last_overruns = 0;
+	for (i = 0; i < nr; i++) {
+		kthread_stop(wqb_producers[i].task);
+		last_queued += wqb_producers[i].queued;
+		last_overruns += wqb_producers[i].overruns;
+	}
+	/* Items still in flight are part of the run, their memory goes next */
+	flush_workqueue(wqb_wqs[last_type]);
+	last_elapsed_ns = ktime_get_ns() - start;
+
+	wqb_free_producers(nr);
+	return 0;
+}
+
+static void wqb_show_hist(struct seq_file *m, const char *name,
+			  const struct wqb_hist *h)
+{
+	if (!h->samples) {
+		seq_printf(m, "%-14s no samples\n", name);
+		return;
+	}
+	seq_printf(m, "%-14s samples=%llu mean=%llu p50=%llu p90=%llu p99=%llu p999=%llu max=%llu\n",
+		   name, h->samples, div64_u64(h->sum, h->samples),
+		   hist_pct(h, 500), hist_pct(h, 900), hist_pct(h, 990),
+		   hist_pct(h, 999), h->max);
+}
+
+static int wqb_results_show(struct seq_file *m, void *v)
+{
+	struct wqb_stats *total;
+	u64 executed;
+	int cpu;
+
+	mutex_lock(&wqb_mutex);
+	if (last_type < 0) {
+		seq_puts(m, "no run yet, echo 1 > run\n");
+		goto out;
+	}
+
+	total = kzalloc(sizeof(*total), GFP_KERNEL);
+	if (!total) {
+		mutex_unlock(&wqb_mutex);
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu) {
+		struct wqb_stats *st = per_cpu_ptr(wqb_stats, cpu);
+
+		hist_merge(&total->start, &st->start);
+		hist_merge(&total->exec, &st->exec);
+		total->executed += st->executed;
+		total->local += st->local;
+	}
+	executed = total->executed;
+
+	seq_printf(m, "wq=%s producers=%u rate=%u duration_ms=%llu items=%u work_us=%u sleep_us=%u\n",
+		   wqb_names[last_type], last_producers, last_rate,
+		   div_u64(last_elapsed_ns, NSEC_PER_MSEC), last_items, last_work_us,
+		   last_sleep_us);
+	seq_printf(m, "queued=%llu executed=%llu overruns=%llu throughput=%llu/s local=%llu%%\n",
+		   last_queued, executed, last_overruns,
+		   last_elapsed_ns ? div64_u64(executed * NSEC_PER_SEC, last_elapsed_ns) : 0,
+		   executed ? div64_u64(total->local * 100, executed) : 0);
+	seq_puts(m, "latency in ns\n");
+	wqb_show_hist(m, "queue_to_start", &total->start);
+	wqb_show_hist(m, "exec", &total->exec);
+
+	seq_puts(m, "executed per cpu\n");
+	for_each_possible_cpu(cpu) {
+		struct wqb_stats *st = per_cpu_ptr(wqb_stats, cpu);
+
+		if (st->executed)
+			seq_printf(m, "cpu%-4d %llu\n", cpu, st->executed);
+	}
+	kfree(total);
+out:
+	mutex_unlock(&wqb_mutex);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wqb_results);
+
+static ssize_t wqb_wq_read(struct file *file, char __user *ubuf,
+			   size_t count, loff_t *ppos)
+{
+	char buf[64];
+	int i, len = 0;
+
+	for (i = 0; i < WQB_NR; i++)
+		len += scnprintf(buf + len, sizeof(buf) - len,
+				 i == wqb_type ? "[%s]%s" : "%s%s", wqb_names[i],
+				 i == WQB_NR - 1 ? "\n" : " ");
+	return simple_read_from_buffer(ubuf, count, ppos, buf, len);
+}
+
+static ssize_t wqb_wq_write(struct file *file, const char __user *ubuf,
+			    size_t count, loff_t *ppos)
+{
+	char buf[16];
+	int type;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	type = sysfs_match_string(wqb_names, buf);
+	if (type < 0)
+		return type;
+
+	mutex_lock(&wqb_mutex);
+	wqb_type = type;
+	mutex_unlock(&wqb_mutex);
+	return count;
+}
+
+static const struct file_operations wqb_wq_fops = {
+	.owner	= THIS_MODULE,
+	.read	= wqb_wq_read,
+	.write	= wqb_wq_write,
+	.llseek	= default_llseek,
+};
+
+static ssize_t wqb_run_write(struct file *file, const char __user *ubuf,
+			     size_t count, loff_t *ppos)
+{
+	int ret;
+
+	if (mutex_lock_interruptible(&wqb_mutex))
+		return -EINTR;
+	ret = wqb_run();
+	mutex_unlock(&wqb_mutex);
+
+	return ret ? : count;
+}
+
+static const struct file_operations wqb_run_fops = {
+	.owner	= THIS_MODULE,
+	.write	= wqb_run_write,
+	.llseek	= noop_llseek,
+};
+
+static void wqb_destroy_wqs(void)
+{
+	int i;
+
+	for (i = 0; i < WQB_NR; i++) {
+		if (wqb_wqs[i])
+			destroy_workqueue(wqb_wqs[i]);
+	}
+}
+
+static int __init wq_bench_init(void)
+{
+	/*
+	 * WQ_SYSFS puts them under /sys/devices/virtual/workqueue/, ordered
+	 * workqueues refuse it since max_active must stay at 1.
+	 */
+	wqb_wqs[WQB_PERCPU] = alloc_workqueue("wq_bench_percpu",
+					      WQ_PERCPU | WQ_SYSFS, 0);
+	wqb_wqs[WQB_UNBOUND] = alloc_workqueue("wq_bench_unbound",
+					       WQ_UNBOUND | WQ_SYSFS, 0);
+	wqb_wqs[WQB_HIGHPRI] = alloc_workqueue("wq_bench_highpri",
+					       WQ_PERCPU | WQ_HIGHPRI | WQ_SYSFS, 0);
+	wqb_wqs[WQB_INTENSIVE] = alloc_workqueue("wq_bench_intensive",
+						 WQ_PERCPU | WQ_CPU_INTENSIVE | WQ_SYSFS, 0);
+	wqb_wqs[WQB_ORDERED] = alloc_ordered_workqueue("wq_bench_ordered", 0);
+	if (!wqb_wqs[WQB_PERCPU] || !wqb_wqs[WQB_UNBOUND] ||
+	    !wqb_wqs[WQB_HIGHPRI] || !wqb_wqs[WQB_INTENSIVE] ||
+	    !wqb_wqs[WQB_ORDERED])
+		goto err;
+
+	wqb_stats = alloc_percpu(struct wqb_stats);
+	if (!wqb_stats)
+		goto err;
+
+	wqb_dir = debugfs_create_dir("wq_bench", NULL);
+	debugfs_create_file("wq", 0644, wqb_dir, NULL, &wqb_wq_fops);
+	debugfs_create_file("run", 0200, wqb_dir, NULL, &wqb_run_fops);
+	debugfs_create_file("results", 0444, wqb_dir, NULL, &wqb_results_fops);
+	debugfs_create_u32("rate", 0644, wqb_dir, &rate);
+	debugfs_create_u32("duration_ms", 0644, wqb_dir, &duration_ms);
+	debugfs_create_u32("producers", 0644, wqb_dir, &producers);
+	debugfs_create_u32("items", 0644, wqb_dir, &items);
+	debugfs_create_u32("work_us", 0644, wqb_dir, &work_us);
+	debugfs_create_u32("sleep_us", 0644, wqb_dir, &sleep_us);
+
+	pr_info("wq_bench: loaded, see /sys/kernel/debug/wq_bench\n");
+	return 0;
+err:
+	wqb_destroy_wqs();
+	return -ENOMEM;
+}
+
+static void __exit wq_bench_exit(void)
+{
+	debugfs_remove_recursive(wqb_dir);
+	wqb_destroy_wqs();
+	free_percpu(wqb_stats);
+}
+
+module_init(wq_bench_init);
+module_exit(wq_bench_exit);
+
+MODULE_DESCRIPTION("Workqueue latency and throughput benchmark");
+MODULE_LICENSE("GPL");
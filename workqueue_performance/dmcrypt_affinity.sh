@@ -0,0 +1,179 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+# Compare workqueue affinity scopes without NFS: dm-crypt on a loop device
+# backed by tmpfs pushes every bio through the kcryptd workqueues, so the
+# run is bound by kworker placement rather than by a disk.
+#
+# For every scope the matching /sys/devices/virtual/workqueue/*/affinity_scope
+# files are set, fio writes then reads the crypt device, and perf records
+# workqueue_execute_start and sched_migrate_task to report on which CPUs and
+# LLCs the kcryptd work items ran and how many migrations of the kworkers
+# that ran them crossed an LLC. Other kworkers (kcryptd_io, the loop device)
+# are left out, their placement does not depend on the swept scope.
+#
+#   ./dmcrypt_affinity.sh [scope...]       default: cpu smt cache cache_shard numa system
+#
+# Needs dmsetup (dm-crypt), fio, jq and perf. SIZE, IMAGE_DIR, WQ_GLOB,
+# WORK_FUNCS (regex of the work functions of those workqueues), FIO_ARGS and
+# RUNTIME can be set from the environment.
+
+set -euo pipefail
+
+SIZE=${SIZE:-4G}
+IMAGE_DIR=${IMAGE_DIR:-/dev/shm}
+WQ_GLOB=${WQ_GLOB:-kcryptd-*}
+WORK_FUNCS=${WORK_FUNCS:-^kcryptd_crypt}
+RUNTIME=${RUNTIME:-10}
+FIO_ARGS=${FIO_ARGS:---bs=64k --iodepth=32 --numjobs=$(nproc) --ioengine=libaio}
+SCOPES=("$@")
+[[ $# -gt 0 ]] || SCOPES=(cpu smt cache cache_shard numa system)
+
+IMAGE=$IMAGE_DIR/wq_affinity.img
+DM_NAME=wq_affinity_crypt
+DM_DEV=/dev/mapper/$DM_NAME
+WQ_SYSFS=/sys/devices/virtual/workqueue
+TMP=$(mktemp -d)
+
+die() { echo "ERROR: $*" >&2; exit 1; }
+[[ $EUID -eq 0 ]] || die "must run as root"
+for tool in dmsetup fio jq perf losetup; do
+	command -v "$tool" >/dev/null || die "$tool not found"
+done
+
+LOOP=
+cleanup() {
+	for wq in "${WQS[@]:-}"; do
+		[[ -n "$wq" ]] && echo default > "$wq/affinity_scope" 2>/dev/null
+	done
+	dmsetup remove "$DM_NAME" 2>/dev/null || true
+	[[ -n "$LOOP" ]] && losetup -d "$LOOP"
+	rm -f "$IMAGE"
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+# --- dm-crypt on loop, throwaway key ---
+echo "==> ${SIZE} image in ${IMAGE_DIR}, dm-crypt aes-xts-plain64"
+truncate -s "$SIZE" "$IMAGE"
+LOOP=$(losetup --find --show --direct-io=on "$IMAGE")
+key=$(od -An -tx1 -N64 /dev/urandom | tr -d ' \n')
+sectors=$(blockdev --getsz "$LOOP")
+dmsetup create "$DM_NAME" --table "0 $sectors crypt aes-xts-plain64 $key 0 $LOOP 0"
+udevadm settle 2>/dev/null || true
+
+# kcryptd workqueues are created per device, after the table is loaded.
+# Only unbound ones have an affinity_scope (kcryptd_io-* is per-CPU).
+WQS=()
+for wq in "$WQ_SYSFS"/$WQ_GLOB; do
+	[[ -d "$wq" ]] || continue
+	if [[ ! -f "$wq/affinity_scope" ]]; then
+		echo "    workqueue $(basename "$wq") skipped, not unbound"
+		continue
+	fi
+	echo "    workqueue $(basename "$wq")"
+	WQS+=("$wq")
+done
+[[ ${#WQS[@]} -gt 0 ]] || die "no unbound workqueue matches $WQ_SYSFS/$WQ_GLOB"
+
+# cpu:llc pairs, the LLC is the highest cache index with an id
+llc_map=
+for cpu_dir in /sys/devices/system/cpu/cpu[0-9]*; do
+	cpu=${cpu_dir##*cpu}
+	llc=0
+	for index in "$cpu_dir"/cache/index*; do
+		[[ -f "$index/id" ]] && llc=$(cat "$index/id")
+	done
+	llc_map+="$cpu:$llc "
+done
+echo "    $(nproc) CPUs, $(echo "$llc_map" | tr ' ' '\n' | cut -d: -f2 | sort -u | grep -c .) LLCs"
+
+# perf script lines -> "cpus llcs migrations cross_llc"
+kworker_stats() {
+	perf script -i "$1" -F pid,cpu,event,trace 2>/dev/null |
+	awk -v map="$llc_map" -v funcs="$WORK_FUNCS" '
+	BEGIN {
+		n = split(map, pairs, " ")
+		for (i = 1; i <= n; i++) {
+			split(pairs[i], kv, ":")
+			llc[kv[1]] = kv[2]
+		}
+	}
+	function field(name,    m) {
+		if (match($0, name "=[^ ]+")) {
+			m = substr($0, RSTART + length(name) + 1, RLENGTH - length(name) - 1)
+			return m
+		}
+		return ""
+	}
+	# "pid [cpu] workqueue:workqueue_execute_start: work struct 0x...: function f"
+	/workqueue_execute_start/ {
+		if ($NF !~ funcs)
+			next
+		workers[$1] = 1
+		match($0, /\[[0-9]+\]/)
+		cpu = substr($0, RSTART + 1, RLENGTH - 2) + 0
+		if (!(cpu in seen_cpu)) {
+			seen_cpu[cpu] = 1
+			cpus++
+		}
+		if (!(llc[cpu] in seen_llc)) {
+			seen_llc[llc[cpu]] = 1
+			llcs++
+		}
+	}
+	# Kept until the end, a worker may migrate before its first kcryptd work
+	/sched_migrate_task/ {
+		if (field("comm") !~ /^kworker/)
+			next
+		nr++
+		mig_pid[nr] = field("pid")
+		mig_cross[nr] = llc[field("orig_cpu") + 0] != llc[field("dest_cpu") + 0]
+	}
+	END {
+		for (i = 1; i <= nr; i++) {
+			if (!(mig_pid[i] in workers))
+				continue
+			migrations++
+			cross += mig_cross[i]
+		}
+		printf "%d %d %d %d\n", cpus, llcs, migrations, cross
+	}'
+}
+
+printf "%-12s %10s %10s %6s %6s %10s %10s %7s\n" \
+	"scope" "write" "read" "cpus" "llcs" "migrate" "cross_llc" "cross%"
+printf "%-12s %10s %10s %6s %6s %10s %10s %7s\n" \
+	"-----" "-----" "----" "----" "----" "-------" "---------" "------"
+
+for scope in "${SCOPES[@]}"; do
+	ok=1
+	for wq in "${WQS[@]}"; do
+		# cache_shard only exists on recent kernels
+		echo "$scope" > "$wq/affinity_scope" 2>/dev/null || ok=0
+	done
+	if [[ $ok -eq 0 ]]; then
+		printf "%-12s skipped, not supported\n" "$scope"
+		continue
+	fi
+
+	perf record -q -a -o "$TMP/perf.data" \
+		-e workqueue:workqueue_execute_start -e sched:sched_migrate_task -- \
+		fio --filename="$DM_DEV" --direct=1 --time_based --runtime="$RUNTIME" \
+		    --group_reporting --output-format=json --output="$TMP/fio.json" \
+		    $FIO_ARGS --name=write --rw=write --stonewall --name=read --rw=read \
+		>/dev/null 2>&1
+
+	w_bw=$(jq '[.jobs[] | select(.jobname == "write") | .write.bw_bytes] | add' "$TMP/fio.json")
+	r_bw=$(jq '[.jobs[] | select(.jobname == "read") | .read.bw_bytes] | add' "$TMP/fio.json")
+	read -r cpus llcs migrations cross < <(kworker_stats "$TMP/perf.data")
+	cross_pct=$(awk -v c="$cross" -v m="$migrations" 'BEGIN { printf "%.1f", m ? c * 100 / m : 0 }')
+
+	printf "%-12s %9.1fM %9.1fM %6d %6d %10d %10d %6s%%\n" "$scope" \
+		"$(awk -v b="$w_bw" 'BEGIN { print b / 1048576 }')" \
+		"$(awk -v b="$r_bw" 'BEGIN { print b / 1048576 }')" \
+		"$cpus" "$llcs" "$migrations" "$cross" "$cross_pct"
+done
+
+echo ""
+echo "cpus/llcs: where kcryptd work items ran, migrate: migrations of the kworkers"
+echo "that ran them, cross_llc: migrations whose source and destination LLC differ."
@@ -0,0 +1,203 @@
+#!/bin/drgn
+"""
+Early workqueue stall detector, sampling every worker pool with drgn.
+
+The workqueue watchdog only complains after wq_watchdog_thresh (30s by
+default), and for stalls like the one wq_stall.ko reproduces the backtrace
+it prints is empty. This samples worker_pool_idr several times a second
+and, for every pool with pending work, computes the same age the watchdog
+uses (jiffies - pool->watchdog_ts, the last time the pool made progress).
+When the age crosses the threshold it prints the pool, nr_running, idle and
+total workers, the number of pending items and the work function (and
+workqueue) at the head of the worklist, then how long the stall lasted once
+the pool moves again.
+
+    drgn wq_monitor.py                    alert above 100ms, sample at 10Hz
+    drgn wq_monitor.py -t 20 -i 0.02      alert above 20ms, sample at 50Hz
+    drgn wq_monitor.py --once             dump every pool and exit
+
+Reading a pool is a handful of /proc/kcore reads, so the cost is per pool,
+not per work item (the pending count stops at --max-count).
+"""
+
+import argparse
+import sys
+import time
+from datetime import datetime
+
+from drgn import FaultError, Object, TypeKind, cast
+from drgn.helpers.linux.idr import idr_for_each
+from drgn.helpers.linux.list import list_empty, list_first_entry, list_for_each
+
+
+def constant(name, default):
+    try:
+        return prog[name].value_()
+    except (KeyError, LookupError):
+        return default
+
+
+def value(obj):
+    # nr_running was an atomic_t before 6.0
+    if obj.type_.kind == TypeKind.STRUCT:
+        return obj.counter.value_()
+    return obj.value_()
+
+
+def kernel_hz():
+    try:
+        from drgn.helpers.linux.kconfig import get_kconfig
+        return int(get_kconfig(prog)["CONFIG_HZ"])
+    except Exception:
+        pass
+    # No IKCONFIG, measure it
+    start, jiffies = time.monotonic(), prog["jiffies"].value_()
+    time.sleep(0.5)
+    elapsed = time.monotonic() - start
+    return round((prog["jiffies"].value_() - jiffies) / elapsed)
+
+
+PWQ_FLAG = constant("WORK_STRUCT_PWQ", 1 << 2)
+PWQ_SHIFT = constant("WORK_STRUCT_PWQ_SHIFT", 8)
+
+
+def pools():
+    for pool_id, entry in idr_for_each(prog["worker_pool_idr"].address_of_()):
+        yield pool_id, cast("struct worker_pool *", entry)
+
+
+def pool_name(pool):
+    cpu = pool.cpu.value_()
+    prio = "H" if pool.attrs.nice.value_() < 0 else ""
+    if cpu < 0:
+        return f"unbound node={pool.node.value_()}"
+    return f"cpu={cpu}{prio}"
+
+
+def work_symbol(func):
+    try:
+        return prog.symbol(func.value_()).name
+    except LookupError:
+        return hex(func.value_())
+
+
+def work_wq(work):
+    data = work.data.counter.value_()
+    if not data & PWQ_FLAG:
+        return "?"
+    pwq = Object(prog, "struct pool_workqueue *", data & ~((1 << PWQ_SHIFT) - 1))
+    return pwq.wq.name.string_().decode()
+
+
+def sample(pool, now, max_count):
+    """Age in jiffies and pool state, None when the worklist is empty."""
+    worklist = pool.worklist.address_of_()
+    if list_empty(worklist):
+        return None
+
+    pending = 0
+    for _ in list_for_each(worklist):
+        pending += 1
+        if pending >= max_count:
+            break
+
+    head = list_first_entry(worklist, "struct work_struct", "entry")
+    return {
+        "age": now - pool.watchdog_ts.value_(),
+        "nr_running": value(pool.nr_running),
+        "nr_idle": pool.nr_idle.value_(),
+        "nr_workers": pool.nr_workers.value_(),
+        "pending": pending,
+        "func": work_symbol(head.func),
+        "wq": work_wq(head),
+    }
+
+
+def fmt_state(state, max_count):
+    pending = f"{state['pending']}{'+' if state['pending'] >= max_count else ''}"
+    return (f"nr_running={state['nr_running']} idle={state['nr_idle']}/{state['nr_workers']} "
+            f"pending={pending} head={state['func']} ({state['wq']})")
+
+
+def dump(hz, max_count):
+    now = prog["jiffies"].value_()
+    print(f"{'pool':>5} {'where':<18} {'age_ms':>8} {'running':>7} {'idle':>5} {'workers':>7} {'pending':>7}  head")
+    for pool_id, pool in pools():
+        state = sample(pool, now, max_count)
+        if state is None:
+            print(f"{pool_id:>5} {pool_name(pool):<18} {'-':>8} {value(pool.nr_running):>7} "
+                  f"{pool.nr_idle.value_():>5} {pool.nr_workers.value_():>7} {0:>7}")
+            continue
+        print(f"{pool_id:>5} {pool_name(pool):<18} {state['age'] * 1000 // hz:>8} "
+              f"{state['nr_running']:>7} {state['nr_idle']:>5} {state['nr_workers']:>7} "
+              f"{state['pending']:>7}  {state['func']} ({state['wq']})")
+
+
+def monitor(args, hz):
+    threshold = args.threshold * hz // 1000 or 1
+    stalled = {}  # pool id -> [first seen, max age, state at max]
+    samples = 0
+
+    print(f"HZ={hz}, alert above {args.threshold}ms (watchdog: "
+          f"{constant('wq_watchdog_thresh', 30)}s), sampling every {args.interval * 1000:.0f}ms")
+    while True:
+        now = prog["jiffies"].value_()
+        for pool_id, pool in pools():
+            try:
+                state = sample(pool, now, args.max_count)
+            except FaultError:
+                # unbound pool freed under us, live kernel reads are racy
+                continue
+            stamp = datetime.now().strftime("%H:%M:%S.%f")[:-3]
+
+            if state is None or state["age"] < threshold:
+                if pool_id in stalled:
+                    first, worst, _ = stalled.pop(pool_id)
+                    print(f"{stamp} pool {pool_id} {pool_name(pool)} recovered after "
+                          f"{(now - first) * 1000 // hz}ms, max age {worst * 1000 // hz}ms")
+                continue
+
+            if pool_id not in stalled:
+                stalled[pool_id] = [now - state["age"], state["age"], state]
+                print(f"{stamp} STALL pool {pool_id} {pool_name(pool)} age={state['age'] * 1000 // hz}ms "
+                      + fmt_state(state, args.max_count))
+            elif state["age"] > stalled[pool_id][1]:
+                stalled[pool_id][1:] = [state["age"], state]
+                if args.verbose:
+                    print(f"{stamp} pool {pool_id} still stalled age={state['age'] * 1000 // hz}ms "
+                          + fmt_state(state, args.max_count))
+
+        samples += 1
+        if args.count and samples >= args.count:
+            return
+        time.sleep(args.interval)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-t", "--threshold", type=int, default=100,
+                        help="alert when a pool made no progress for this many ms (default: 100)")
+    parser.add_argument("-i", "--interval", type=float, default=0.1,
+                        help="seconds between samples (default: 0.1)")
+    parser.add_argument("-n", "--count", type=int, default=0,
+                        help="stop after this many samples (default: run forever)")
+    parser.add_argument("--max-count", type=int, default=1000,
+                        help="stop counting pending items per pool at this (default: 1000)")
+    parser.add_argument("--once", action="store_true", help="dump every pool and exit")
+    parser.add_argument("-v", "--verbose", action="store_true",
+                        help="print every sample where a stall gets older")
+    args = parser.parse_args()
+
+    hz = kernel_hz()
+    if args.once:
+        dump(hz, args.max_count)
+        return 0
+    try:
+        monitor(args, hz)
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+sys.exit(main())